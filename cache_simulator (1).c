@@ -1,7 +1,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stddef.h>
+#if defined(__has_include)
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#define HAVE_ZLIB_H 1
+#endif
+#if __has_include(<lzma.h>)
+#include <lzma.h>
+#define HAVE_LZMA_H 1
+#endif
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#define HAVE_ZSTD_H 1
+#endif
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define MIN_CACHE_SIZE 8
 #define MAX_CACHE_SIZE 8192
@@ -13,101 +46,6492 @@
 #define MAX_PHYSICAL_MEMORY 4096
 #define MAX_LINE_LENGTH 100
 #define MAX_PRINT_LINES 20
+#define MAX_TRACE_FILES 65536 // TraceReference.process is 16 bits
+
+#define HOST_CACHE_LINE 64
+#define HOST_PREFETCH_DISTANCE 16       // references, see hostPrefetchDistance
+#define HOST_PREFETCH_FOOTPRINT (1u << 20) // host L2 size when sysconf does not know it
+#define MAX_SWEEP_VALUES 32
+
+#define MODE_SIM 0
+#define MODE_STACK 1
+#define MODE_SCALING 2
+#define MODE_VM 3
+
+#define DATA_ACCESS_LENGTH 4
+
+#define WRITE_BUFFER_MAX_ENTRIES 64
+#define DEFAULT_WRITE_BUFFER_ENTRIES 8
+#define WRITE_BUFFER_DRAIN_CYCLES 4     // memory cycles to retire one buffered write
+#define WRITE_LOG_SIZE 256
+
+#define POLICY_RR 0
+#define POLICY_RND 1
+#define POLICY_LRU 2
+#define POLICY_PLRU 3
+#define POLICY_FIFO 4
+#define POLICY_SRRIP 5
+#define POLICY_BRRIP 6
+#define NUM_POLICIES 7
+
+const char* policy_names[] = { "rr", "rnd", "lru", "plru", "fifo", "srrip", "brrip" };
+const char* policy_descriptions[] = { "Round Robin", "Random", "Least Recently Used", "Tree Pseudo-LRU", "First In First Out", "Static RRIP", "Bimodal RRIP" };
+
+// How a lookup compares the tags of a set, see tagMatchMask
+#define TAG_MATCH_SCALAR 0
+#define TAG_MATCH_SSE2 1
+#define TAG_MATCH_AVX2 2
+#define TAG_MATCH_AVX512 3
+#define NUM_TAG_MATCHES 4
+
+const char* tag_match_names[] = { "scalar", "sse2", "avx2", "avx512" };
+
+typedef struct Cache Cache;
+typedef struct MissClassifier MissClassifier;
+typedef struct Prefetcher Prefetcher;
+// Simulates one access to the block holding address, returns 1 on a hit
+typedef int (*CacheAccessFunction)(Cache* cache, unsigned int address, int write);
+
+// Writes on their way to memory: dirty blocks written back and, with
+// write-through or no-write-allocate, stores. Entries retire in order, one
+// every WRITE_BUFFER_DRAIN_CYCLES of the cache's clock; a write to a block
+// that is still queued merges into its entry, and a write into a full buffer
+// stalls until the oldest entry retires.
+// Whether a miss writes back depends on the data, so rather than branch on it
+// the access appends every candidate to a log and only advances the log count
+// when the write is real. The buffer replays the log when it fills and before
+// results are read; a stall only delays everything after it by a constant,
+// so the replay gives the same stalls as handling each write at once.
+typedef struct {
+    unsigned int blocks[WRITE_BUFFER_MAX_ENTRIES];
+    double retire_at[WRITE_BUFFER_MAX_ENTRIES];
+    int entries;                // capacity, 0 makes every write wait for memory
+    int head;
+    int count;
+    double drain_end;           // when the newest entry retires
+    int logged;
+    unsigned int log_blocks[WRITE_LOG_SIZE];
+    double log_cycles[WRITE_LOG_SIZE]; // the cache's clock at each write
+} WriteBuffer;
+
+// Flat set-associative cache. All sets live in one host-cache-line aligned
+// allocation: tags[set * associativity + way] holds the tag of each way and
+// valid[set] is a bitmask with bit `way` set once that way has been filled;
+// dirty[set] marks the ways written since their fill under write-back.
+// The address geometry is computed once in createCache so an access is only
+// shifts and masks.
+struct Cache {
+    int cache_size_kb;
+    int total_rows;
+    int associativity;
+    int block_size;
+    int policy;
+    int write_back;             // 0 for write-through
+    int write_allocate;         // 0 sends write misses around the cache
+    int offset_bits;            // log2(block_size)
+    int index_bits;             // log2(total_rows), the "Index Size"
+    int tag_bits;               // 32 - (index_bits + offset_bits), the "Tag Size"
+    unsigned int index_mask;
+    CacheAccessFunction access; // specialized for this geometry when possible
+    unsigned int* tags;
+    unsigned short* valid;
+    unsigned short* dirty;
+    unsigned long long* set_state; // per-set replacement metadata, see initialSetState
+    MissClassifier* classifier; // three-C classification, NULL when disabled
+    Prefetcher* prefetcher;     // NULL when disabled
+    int host_prefetch;          // references ahead simulateCacheReferences prefetches sets, 0 for none
+    WriteBuffer write_buffer;
+
+    // Statistics
+    long long cache_hits;
+    long long compulsory_misses;
+    long long capacity_misses;
+    long long conflict_misses;
+    long long split_references; // references that touched more than one block
+    double cycles;
+    long long writebacks;
+    long long write_arounds;    // write misses sent past the cache, no-write-allocate
+    long long write_buffer_merges;
+    long long write_buffer_stalls;
+    double write_stall_cycles;
+};
+
+// Time a pipeline stage spent working, waiting for input (starved) and waiting
+// for room downstream (blocked)
+typedef struct {
+    double total_seconds;
+    double starved_seconds;
+    double blocked_seconds;
+    long long items;
+} StageStats;
+
+// Per-trace totals, shared by every cache simulated over the same references
+typedef struct {
+    long long inst_counter;
+    long long instruction_bytes;
+    long long src_dst_bytes;
+    long long trace_bytes;
+    long long writes;
+    double parse_seconds;
+    long long context_switches;
+    int pipelined;
+    StageStats stages[3];
+} TraceTotals;
+
+#define TRACE_IO_MMAP 0
+#define TRACE_IO_PIPELINE 1
+#define MAX_DECOMPRESS_THREADS 16
+
+// How replayTraces reads trace files, set from -io
+static int trace_io_mode = TRACE_IO_MMAP;
+// Instructions each trace runs before the next one is switched in, set from
+// -n; 0 runs the traces one after another
+static int trace_time_slice = 0;
+
+void printUsage() {
+    printf("Usage: ./cache_simulator -s <cache size KB> -b <block size> -a <associativity> -r <replacement policy> -p <physical memory MB> -u <percentage of phys mem used> -n <Instr / Time Slice> -f <trace file name(s)>\n");
+    printf("       ./cache_simulator -l1i <spec> -l1d <spec> [-l2 <spec>] [-l3 <spec>] [-inclusion nine|inclusive|exclusive] [-mem <cycles>] -f <trace file name(s)>\n");
+    printf("       a level <spec> is <size KB>:<block size>:<associativity>:<policy>[:<latency cycles>]; without -l1i L1 is unified\n");
+    printf("       ./cache_simulator convert <text trace> <binary trace> [delta]\n");
+    printf("       ./cache_simulator generate sequential|strided|random|pointer|zipf <instructions> <trace file> [text|binary|delta] [seed]\n");
+    printf("       ./cache_simulator bench [-i <instructions per pattern>] [-g <patterns>] [-s/-b/-a/-r lists] [-seed <seed>] [-simd <setting>] [-host-prefetch <references>] [-o <results csv>] [-label <name>]\n");
+    printf("-f may be repeated for any number of traces; with -n above 0 they run as processes switched round robin every -n instructions, with -n 0 one after another\n");
+    printf("-s, -b, -a and -r also take comma separated lists; -s, -b and -a take power-of-two ranges such as 8-8192\n");
+    printf("-r is one of rr, rnd, lru, plru (power-of-two associativity), fifo, srrip or brrip\n");
+    printf("-t <threads> simulates the configurations of a sweep on that many threads, or splits the sets of a single cache across them\n");
+    printf("-m stack prints the LRU miss rate curve of every cache size and associativity for each -b block size; -s, -a and -r are not needed\n");
+    printf("-w back|through picks the write policy, -wa on|off write allocation and -wbuf <entries> the write buffer (default: back, on, %d)\n", DEFAULT_WRITE_BUFFER_ENTRIES);
+    printf("-pf nextline|stride|stream attaches a hardware prefetcher and -pfd <degree> sets how many blocks it runs ahead (default: none; 1, or 4 per stream buffer)\n");
+    printf("-warmup <instructions> leaves the first instructions out of the statistics\n");
+    printf("-sample <unit>:<period>[:<warming>] measures the last unit instructions of every period, with the rest warming the caches or only warming instructions before each unit\n");
+    printf("-checkpoint <file> saves the cache state and trace position after the last trace, and every -checkpoint-every <instructions>; -restore <file> continues from one\n");
+    printf("-interval <instructions>|slice writes per-interval statistics of every cache to -stats <file>, as -stats-format csv (default) or binary\n");
+    printf("-perf on times the parse, lookup and stats phases with the host's hardware counters and reports host cycles per simulated access\n");
+    printf("-simd on|off|sse2|avx2|avx512 caps the vector tag compare of 4, 8 and 16-way lookups (default: the widest the CPU supports)\n");
+    printf("-host-prefetch <references> sets how far ahead lookups prefetch the simulated sets of caches larger than the host's L2, 0 to turn it off (default %d)\n", HOST_PREFETCH_DISTANCE);
+    printf("-c 3c splits misses into compulsory, capacity and conflict with a fully associative LRU shadow cache\n");
+    printf("-io pipeline reads, decodes and simulates on separate threads (default: -io mmap); interleaved traces are always memory-mapped\n");
+    printf("Traces may be gzip, xz or zstd compressed, and -f - reads one from standard input; such traces always use -io pipeline\n");
+    printf("-decompress-threads <threads> decodes the frames of a multi-frame zstd trace on that many threads (default: one per CPU, up to %d)\n", MAX_DECOMPRESS_THREADS);
+    printf("-m scaling times a single cache with 1 to -t set-sharded threads\n");
+    printf("-m vm runs the traces as processes switched every -n instructions and translates their addresses through page tables and a TLB\n");
+    printf("-tlb <entries>:<associativity> sizes the TLB of -m vm (default 64:4)\n");
+}
+
+void* alignedCalloc(size_t size) {
+    // aligned_alloc requires the size to be a multiple of the alignment
+    size_t rounded = (size + HOST_CACHE_LINE - 1) & ~(size_t)(HOST_CACHE_LINE - 1);
+    void* ptr = aligned_alloc(HOST_CACHE_LINE, rounded);
+    if (ptr != NULL) {
+        memset(ptr, 0, rounded);
+    }
+    return ptr;
+}
+
+// Integer log2 of a power of two, -1 for anything else
+int log2Int(unsigned int value) {
+    if (value == 0 || (value & (value - 1)) != 0) {
+        return -1;
+    }
+    int bits = 0;
+    while ((value >> bits) != 1) {
+        bits++;
+    }
+    return bits;
+}
+
+#define MISS_CLASS_COMPULSORY 0
+#define MISS_CLASS_CAPACITY 1
+#define MISS_CLASS_CONFLICT 2
+
+CacheAccessFunction selectCacheAccess(Cache* cache);
+int classifyReference(MissClassifier* classifier, unsigned int block);
+void resetMissClassifier(MissClassifier* classifier);
+void freeMissClassifier(MissClassifier* classifier);
+void resetPrefetcher(Cache* cache);
+void clearPrefetcherStatistics(Prefetcher* prefetcher, double clock);
+void freePrefetcher(Prefetcher* prefetcher);
+
+// Check that cache_size_kb splits into a power-of-two number of rows of
+// power-of-two blocks, as the shift/mask address decomposition requires
+int validCacheGeometry(int cache_size_kb, int block_size, int associativity) {
+    int cache_size_b = cache_size_kb * 1024;
+    if (cache_size_b % (block_size * associativity) != 0) {
+        return 0;
+    }
+    return log2Int(cache_size_b / (block_size * associativity)) >= 0 && log2Int(block_size) >= 0;
+}
+
+// Replacement metadata is one 64-bit word per set (set_state):
+//  RR     next victim way
+//  RND    xorshift state
+//  LRU    recency stack, 4 bits per way, nibble 0 is the most recent way
+//  FIFO   insertion stack, same layout as LRU but only updated on fills
+//  PLRU   tree bits, node n (1..ways-1) at bit n, 1 = the victim is right
+//  SRRIP  2-bit re-reference prediction value per way in the low 32 bits
+//  BRRIP  as SRRIP, with an xorshift state for the bimodal insertion in the
+//         high 32 bits
+#define RRPV_MAX 3
+#define BRRIP_LONG_INSERT_ODDS 32
+
+// Identity recency order: way i at position i
+static inline unsigned long long initialWayOrder(int associativity) {
+    unsigned long long order = 0;
+    for (int way = associativity - 1; way >= 0; way--) {
+        order = (order << 4) | (unsigned long long)way;
+    }
+    return order;
+}
+
+// Initial replacement state of a set
+unsigned long long initialSetState(Cache* cache, int set) {
+    unsigned int seed = 0x9e3779b9u ^ ((unsigned int)cache->cache_size_kb * 73856093u) ^ ((unsigned int)cache->block_size * 19349663u) ^ ((unsigned int)cache->associativity * 83492791u);
+    seed ^= (unsigned int)set * 0x85ebca6bu;
+    if (seed == 0) {
+        seed = 1;
+    }
+    switch (cache->policy) {
+    case POLICY_RND:
+        // Every set draws from its own stream, seeded from the configuration
+        // and the set index, so RND results do not depend on the order in
+        // which sets are visited or on which thread simulates them
+        return seed;
+    case POLICY_LRU:
+    case POLICY_FIFO:
+        return initialWayOrder(cache->associativity);
+    case POLICY_SRRIP:
+        return 0xffffffffull;
+    case POLICY_BRRIP:
+        return ((unsigned long long)seed << 32) | 0xffffffffull;
+    default:
+        return 0;
+    }
+}
+
+// Zero the statistics and the clock, which the write buffer drains against
+void clearCacheStatistics(Cache* cache) {
+    cache->cache_hits = 0;
+    cache->compulsory_misses = 0;
+    cache->capacity_misses = 0;
+    cache->conflict_misses = 0;
+    cache->split_references = 0;
+    cache->writebacks = 0;
+    cache->write_arounds = 0;
+    cache->write_buffer_merges = 0;
+    cache->write_buffer_stalls = 0;
+    cache->write_stall_cycles = 0.0;
+    if (cache->prefetcher != NULL) {
+        clearPrefetcherStatistics(cache->prefetcher, cache->cycles);
+    }
+    cache->cycles = 0.0;
+    cache->write_buffer.head = 0;
+    cache->write_buffer.count = 0;
+    cache->write_buffer.drain_end = 0.0;
+    cache->write_buffer.logged = 0;
+}
+
+// Fold the statistics of a set shard into the whole cache
+void addCacheStatistics(Cache* cache, const Cache* part) {
+    cache->cache_hits += part->cache_hits;
+    cache->compulsory_misses += part->compulsory_misses;
+    cache->capacity_misses += part->capacity_misses;
+    cache->conflict_misses += part->conflict_misses;
+    cache->split_references += part->split_references;
+    cache->cycles += part->cycles;
+    cache->writebacks += part->writebacks;
+    cache->write_arounds += part->write_arounds;
+    cache->write_buffer_merges += part->write_buffer_merges;
+    cache->write_buffer_stalls += part->write_buffer_stalls;
+    cache->write_stall_cycles += part->write_stall_cycles;
+}
+
+// Empty every set and clear the statistics
+void resetCache(Cache* cache) {
+    size_t ways = (size_t)cache->total_rows * cache->associativity;
+    memset(cache->tags, 0, ways * sizeof(unsigned int));
+    memset(cache->valid, 0, cache->total_rows * sizeof(unsigned short));
+    memset(cache->dirty, 0, cache->total_rows * sizeof(unsigned short));
+    for (int set = 0; set < cache->total_rows; set++) {
+        cache->set_state[set] = initialSetState(cache, set);
+    }
+    if (cache->classifier != NULL) {
+        resetMissClassifier(cache->classifier);
+    }
+    if (cache->prefetcher != NULL) {
+        resetPrefetcher(cache);
+    }
+    clearCacheStatistics(cache);
+}
+
+// Host prefetching of simulated sets (-host-prefetch): how many references
+// ahead simulateCacheReferences prefetches the set a reference will look up,
+// for caches whose set arrays are larger than the host's L2 (per sysconf,
+// HOST_PREFETCH_FOOTPRINT when it does not say). Smaller caches stay close
+// to the host's core and would only pay for the prefetches.
+static int host_prefetch_distance = HOST_PREFETCH_DISTANCE;
+
+int hostPrefetchDistance(Cache* cache) {
+    static long host_cache_bytes = 0;
+    if (host_cache_bytes == 0) {
+        long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+        host_cache_bytes = l2 > 0 ? l2 : (long)HOST_PREFETCH_FOOTPRINT;
+    }
+    size_t footprint = (size_t)cache->total_rows * (cache->associativity * sizeof(unsigned int) + 2 * sizeof(unsigned short) +
+                                                    sizeof(unsigned long long));
+    return footprint > (size_t)host_cache_bytes ? host_prefetch_distance : 0;
+}
+
+// The geometry must pass validCacheGeometry. The cache starts out
+// write-back and write-allocate with a DEFAULT_WRITE_BUFFER_ENTRIES buffer.
+int createCache(Cache* cache, int cache_size_kb, int block_size, int associativity, int policy) {
+    memset(cache, 0, sizeof(*cache));
+    int total_rows = cache_size_kb * 1024 / (block_size * associativity);
+    cache->cache_size_kb = cache_size_kb;
+    cache->total_rows = total_rows;
+    cache->associativity = associativity;
+    cache->block_size = block_size;
+    cache->policy = policy;
+    cache->write_back = 1;
+    cache->write_allocate = 1;
+    cache->write_buffer.entries = DEFAULT_WRITE_BUFFER_ENTRIES;
+    cache->offset_bits = log2Int(block_size);
+    cache->index_bits = log2Int(total_rows);
+    cache->tag_bits = 32 - (cache->index_bits + cache->offset_bits);
+    cache->index_mask = (unsigned int)total_rows - 1;
+    cache->access = selectCacheAccess(cache);
+    cache->host_prefetch = hostPrefetchDistance(cache);
+    cache->tags = (unsigned int*)alignedCalloc((size_t)total_rows * associativity * sizeof(unsigned int));
+    cache->valid = (unsigned short*)alignedCalloc((size_t)total_rows * sizeof(unsigned short));
+    cache->dirty = (unsigned short*)alignedCalloc((size_t)total_rows * sizeof(unsigned short));
+    cache->set_state = (unsigned long long*)alignedCalloc((size_t)total_rows * sizeof(unsigned long long));
+    if (cache->tags == NULL || cache->valid == NULL || cache->dirty == NULL || cache->set_state == NULL) {
+        free(cache->tags);
+        free(cache->valid);
+        free(cache->dirty);
+        free(cache->set_state);
+        return 0;
+    }
+    resetCache(cache);
+    return 1;
+}
+
+void freeCache(Cache* cache) {
+    free(cache->tags);
+    free(cache->valid);
+    free(cache->dirty);
+    free(cache->set_state);
+    if (cache->classifier != NULL) {
+        freeMissClassifier(cache->classifier);
+    }
+    if (cache->prefetcher != NULL) {
+        freePrefetcher(cache->prefetcher);
+    }
+    cache->tags = NULL;
+    cache->valid = NULL;
+    cache->dirty = NULL;
+    cache->set_state = NULL;
+    cache->classifier = NULL;
+    cache->prefetcher = NULL;
+}
+
+static inline unsigned int nextRandom(unsigned int* state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Move way to the most recent position of a 4-bit-per-way stack
+static inline unsigned long long promoteWay(unsigned long long order, int way) {
+    int position = 0;
+    while ((int)((order >> (4 * position)) & 0xf) != way) {
+        position++;
+    }
+    unsigned long long newer = order & ((1ull << (4 * position)) - 1);
+    unsigned long long older = position == 15 ? 0 : order & ~((1ull << (4 * (position + 1))) - 1);
+    return older | (newer << 4) | (unsigned long long)way;
+}
+
+static inline int plruVictim(unsigned long long bits, int associativity) {
+    int node = 1;
+    while (node < associativity) {
+        node = 2 * node + (int)((bits >> node) & 1);
+    }
+    return node - associativity;
+}
+
+// Point every tree node on the path to way away from it
+static inline unsigned long long plruTouch(unsigned long long bits, int way, int associativity) {
+    int node = way + associativity;
+    while (node > 1) {
+        int parent = node >> 1;
+        if (node & 1) {
+            bits &= ~(1ull << parent);
+        }
+        else {
+            bits |= 1ull << parent;
+        }
+        node = parent;
+    }
+    return bits;
+}
+
+static inline unsigned long long rrpvSet(unsigned long long state, int way, unsigned int rrpv) {
+    return (state & ~(3ull << (2 * way))) | ((unsigned long long)rrpv << (2 * way));
+}
+
+// Way with the largest RRPV; the whole set ages so that it reaches RRPV_MAX
+static inline int rripVictim(unsigned long long* state, int associativity) {
+    int victim = 0;
+    unsigned int oldest = 0;
+    for (int way = 0; way < associativity; way++) {
+        unsigned int rrpv = (unsigned int)(*state >> (2 * way)) & 3;
+        if (rrpv > oldest) {
+            oldest = rrpv;
+            victim = way;
+        }
+    }
+    unsigned int age = RRPV_MAX - oldest;
+    if (age > 0) {
+        for (int way = 0; way < associativity; way++) {
+            unsigned int rrpv = (unsigned int)(*state >> (2 * way)) & 3;
+            *state = rrpvSet(*state, way, rrpv + age);
+        }
+    }
+    return victim;
+}
+
+// Update the set state for a hit on way
+static inline void replacementHit(unsigned long long* state, int way, int associativity, int policy) {
+    switch (policy) {
+    case POLICY_LRU:
+        *state = promoteWay(*state, way);
+        break;
+    case POLICY_PLRU:
+        *state = plruTouch(*state, way, associativity);
+        break;
+    case POLICY_SRRIP:
+    case POLICY_BRRIP:
+        *state = rrpvSet(*state, way, 0);
+        break;
+    default:
+        break;
+    }
+}
+
+// Choose the way to replace in a full set
+static inline int replacementVictim(unsigned long long* state, int associativity, int policy) {
+    switch (policy) {
+    case POLICY_RR: {
+        int way = (int)*state;
+        *state = (unsigned long long)((way + 1) % associativity);
+        return way;
+    }
+    case POLICY_RND: {
+        unsigned int x = (unsigned int)*state;
+        int way = (int)(nextRandom(&x) % associativity);
+        *state = x;
+        return way;
+    }
+    case POLICY_LRU:
+    case POLICY_FIFO:
+        return (int)((*state >> (4 * (associativity - 1))) & 0xf);
+    case POLICY_PLRU:
+        return plruVictim(*state, associativity);
+    default:
+        return rripVictim(state, associativity);
+    }
+}
+
+// Update the set state after way was filled with a new block
+static inline void replacementFill(unsigned long long* state, int way, int associativity, int policy) {
+    switch (policy) {
+    case POLICY_LRU:
+    case POLICY_FIFO:
+        *state = promoteWay(*state, way);
+        break;
+    case POLICY_PLRU:
+        *state = plruTouch(*state, way, associativity);
+        break;
+    case POLICY_SRRIP:
+        *state = rrpvSet(*state, way, RRPV_MAX - 1);
+        break;
+    case POLICY_BRRIP: {
+        // Mostly insert at distant re-reference, occasionally at long
+        unsigned int x = (unsigned int)(*state >> 32);
+        unsigned int rrpv = nextRandom(&x) % BRRIP_LONG_INSERT_ODDS == 0 ? RRPV_MAX - 1 : RRPV_MAX;
+        *state = ((unsigned long long)x << 32) | (*state & 0xffffffffull);
+        *state = rrpvSet(*state, way, rrpv);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Way of the set holding tag, or -1
+static inline int findCacheWay(const unsigned int* set_tags, unsigned int set_valid, unsigned int tag, int associativity) {
+    for (int i = 0; i < associativity; i++) {
+        if ((set_valid >> i) & 1 && set_tags[i] == tag) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#if defined(__x86_64__)
+// Vector tag compares: the tags of a set are contiguous, so one compare of
+// the set's tags against the broadcast tag gives a bit per matching way, which
+// the caller masks with the set's valid bits. SSE2 is part of x86-64; the
+// AVX2 and AVX-512 compares are only reached from access functions built for
+// those targets and picked by selectCacheAccess when the CPU has them.
+static inline unsigned int tagMatchSse2(const unsigned int* set_tags, unsigned int tag, int associativity) {
+    __m128i key = _mm_set1_epi32((int)tag);
+    unsigned int matches = 0;
+    for (int i = 0; i < associativity; i += 4) {
+        __m128i tags = _mm_loadu_si128((const __m128i*)(set_tags + i));
+        matches |= (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(tags, key))) << i;
+    }
+    return matches;
+}
+
+static inline __attribute__((target("avx2"))) unsigned int tagMatchAvx2(const unsigned int* set_tags, unsigned int tag, int associativity) {
+    __m256i key = _mm256_set1_epi32((int)tag);
+    unsigned int matches = 0;
+    for (int i = 0; i < associativity; i += 8) {
+        __m256i tags = _mm256_loadu_si256((const __m256i*)(set_tags + i));
+        matches |= (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(tags, key))) << i;
+    }
+    return matches;
+}
+
+static inline __attribute__((target("avx512f"))) unsigned int tagMatchAvx512(const unsigned int* set_tags, unsigned int tag) {
+    return _mm512_cmpeq_epi32_mask(_mm512_loadu_si512((const void*)set_tags), _mm512_set1_epi32((int)tag));
+}
+#endif
+
+// findCacheWay with the tag compare picked at compile time. Vector compares
+// need the associativity to be a multiple of their width: 4 ways for SSE2,
+// 8 for AVX2 and 16 for AVX-512.
+static inline __attribute__((always_inline)) int findCacheWayWith(const unsigned int* set_tags, unsigned int set_valid, unsigned int tag, int associativity, int tag_match) {
+#if defined(__x86_64__)
+    if (tag_match != TAG_MATCH_SCALAR) {
+        unsigned int matches = tag_match == TAG_MATCH_AVX512 ? tagMatchAvx512(set_tags, tag)
+                             : tag_match == TAG_MATCH_AVX2   ? tagMatchAvx2(set_tags, tag, associativity)
+                                                             : tagMatchSse2(set_tags, tag, associativity);
+        matches &= set_valid;
+        return matches != 0 ? __builtin_ctz(matches) : -1;
+    }
+#endif
+    return findCacheWay(set_tags, set_valid, tag, associativity);
+}
+
+// Way to fill with a new block: an empty way first, otherwise the victim the
+// replacement policy picks
+static inline int chooseFillWay(unsigned long long* state, unsigned int set_valid, int associativity, int policy) {
+    unsigned int full_mask = (1u << associativity) - 1;
+    if (set_valid != full_mask) {
+        return __builtin_ctz(~set_valid);
+    }
+    return replacementVictim(state, associativity, policy);
+}
+
+// Run the logged writes through the write buffer, stalling the cache's clock
+// while it is full
+void drainWriteLog(Cache* cache) {
+    WriteBuffer* buffer = &cache->write_buffer;
+    double delay = 0.0;
+    for (int w = 0; w < buffer->logged; w++) {
+        unsigned int block = buffer->log_blocks[w];
+        double now = buffer->log_cycles[w] + delay;
+        while (buffer->count > 0 && buffer->retire_at[buffer->head] <= now) {
+            buffer->head = (buffer->head + 1) % WRITE_BUFFER_MAX_ENTRIES;
+            buffer->count--;
+        }
+        int merged = 0;
+        for (int i = 0; i < buffer->count && !merged; i++) {
+            merged = buffer->blocks[(buffer->head + i) % WRITE_BUFFER_MAX_ENTRIES] == block;
+        }
+        if (merged) {
+            cache->write_buffer_merges++;
+            continue;
+        }
+        if (buffer->count == buffer->entries) {
+            double retire = buffer->count > 0 ? buffer->retire_at[buffer->head]
+                                              : (now > buffer->drain_end ? now : buffer->drain_end) + WRITE_BUFFER_DRAIN_CYCLES;
+            cache->write_buffer_stalls++;
+            delay += retire - now;
+            now = retire;
+            if (buffer->count == 0) {
+                buffer->drain_end = retire;
+                continue;
+            }
+            buffer->head = (buffer->head + 1) % WRITE_BUFFER_MAX_ENTRIES;
+            buffer->count--;
+        }
+        int slot = (buffer->head + buffer->count) % WRITE_BUFFER_MAX_ENTRIES;
+        buffer->drain_end = (now > buffer->drain_end ? now : buffer->drain_end) + WRITE_BUFFER_DRAIN_CYCLES;
+        buffer->blocks[slot] = block;
+        buffer->retire_at[slot] = buffer->drain_end;
+        buffer->count++;
+    }
+    buffer->logged = 0;
+    cache->cycles += delay;
+    cache->write_stall_cycles += delay;
+}
+
+// Log a write of block to memory when write is 1
+static inline void logMemoryWrite(Cache* cache, unsigned int block, unsigned int write) {
+    WriteBuffer* buffer = &cache->write_buffer;
+    buffer->log_blocks[buffer->logged] = block;
+    buffer->log_cycles[buffer->logged] = cache->cycles;
+    buffer->logged += write;
+    if (buffer->logged == WRITE_LOG_SIZE) {
+        drainWriteLog(cache);
+    }
+}
+
+// Shared body of every access variant. The specialized variants below pass
+// compile-time constants for offset_bits, associativity, policy and the tag
+// compare so the shifts, the way loop and the replacement policy are resolved
+// by the compiler, which only happens if the body is inlined into each of them.
+static inline __attribute__((always_inline)) int accessCacheSet(Cache* cache, unsigned int address, int write, int offset_bits, int associativity, int policy, int tag_match) {
+    // The shadow cache of -c 3c sees every reference, hits included
+    int miss_class = MISS_CLASS_COMPULSORY;
+    if (cache->classifier != NULL) {
+        miss_class = classifyReference(cache->classifier, address >> offset_bits);
+    }
+    unsigned int tag = address >> (offset_bits + cache->index_bits);
+    unsigned int set_index = (address >> offset_bits) & cache->index_mask;
+    unsigned int* set_tags = cache->tags + (size_t)set_index * associativity;
+    unsigned int set_valid = cache->valid[set_index];
+    unsigned long long* state = &cache->set_state[set_index];
+
+    // Check if the tag exists in any of the cache lines in the set
+    int way = findCacheWayWith(set_tags, set_valid, tag, associativity, tag_match);
+    if (way >= 0) {
+        replacementHit(state, way, associativity, policy);
+        cache->cache_hits++;
+        cache->cycles += 1.0;
+        if (cache->write_back) {
+            cache->dirty[set_index] |= (unsigned short)((unsigned int)write << way);
+        }
+        else {
+            logMemoryWrite(cache, address >> offset_bits, write);
+        }
+        return 1;
+    }
+
+    if (miss_class == MISS_CLASS_COMPULSORY) {
+        cache->compulsory_misses++;
+    }
+    else if (miss_class == MISS_CLASS_CAPACITY) {
+        cache->capacity_misses++;
+    }
+    else {
+        cache->conflict_misses++;
+    }
+
+    // Calculate CPI
+    int cache_access_cycles = 1;
+    int cache_miss_cycles = 4;
+    int instruction_execution_cycles = 2;
+    cache->cycles += (cache_access_cycles + cache_miss_cycles + instruction_execution_cycles);
+
+    if (!cache->write_allocate && write) {
+        cache->write_arounds++;
+        logMemoryWrite(cache, address >> offset_bits, 1);
+        return 0;
+    }
+
+    int next_line = chooseFillWay(state, set_valid, associativity, policy);
+    replacementFill(state, next_line, associativity, policy);
+
+    // Update the cache entry with the new tag
+    cache->valid[set_index] = (unsigned short)(set_valid | (1u << next_line));
+    if (cache->write_back) {
+        unsigned int set_dirty = cache->dirty[set_index];
+        unsigned int written_back = (set_dirty >> next_line) & 1;
+        cache->dirty[set_index] = (unsigned short)((set_dirty & ~(1u << next_line)) | ((unsigned int)write << next_line));
+        cache->writebacks += written_back;
+        logMemoryWrite(cache, (set_tags[next_line] << cache->index_bits) | set_index, written_back);
+    }
+    else {
+        logMemoryWrite(cache, address >> offset_bits, write);
+    }
+    set_tags[next_line] = tag;
+    return 0;
+}
+
+// Generic variant, used for geometries without a specialization
+int simulateCacheAccess(Cache* cache, unsigned int address, int write) {
+    return accessCacheSet(cache, address, write, cache->offset_bits, cache->associativity, cache->policy, TAG_MATCH_SCALAR);
+}
+
+// Block-level operations used by the cache hierarchy, where a level has to
+// report hits and victims and accept blocks moved in from other levels.
+// They leave the statistics to the caller.
+
+// Look address up, updating the replacement state on a hit
+int probeCache(Cache* cache, unsigned int address) {
+    unsigned int tag = address >> (cache->offset_bits + cache->index_bits);
+    unsigned int set_index = (address >> cache->offset_bits) & cache->index_mask;
+    int way = findCacheWay(cache->tags + (size_t)set_index * cache->associativity, cache->valid[set_index], tag, cache->associativity);
+    if (way < 0) {
+        return 0;
+    }
+    replacementHit(&cache->set_state[set_index], way, cache->associativity, cache->policy);
+    return 1;
+}
+
+// Insert the block holding address, which must not be present. Returns 1 and
+// the address of the displaced block when a valid block was evicted.
+int fillCache(Cache* cache, unsigned int address, unsigned int* evicted_address) {
+    unsigned int tag = address >> (cache->offset_bits + cache->index_bits);
+    unsigned int set_index = (address >> cache->offset_bits) & cache->index_mask;
+    unsigned int* set_tags = cache->tags + (size_t)set_index * cache->associativity;
+    unsigned int set_valid = cache->valid[set_index];
+    unsigned long long* state = &cache->set_state[set_index];
+    int way = chooseFillWay(state, set_valid, cache->associativity, cache->policy);
+    int evicted = (set_valid >> way) & 1;
+    if (evicted) {
+        *evicted_address = (set_tags[way] << (cache->offset_bits + cache->index_bits)) | (set_index << cache->offset_bits);
+    }
+    replacementFill(state, way, cache->associativity, cache->policy);
+    cache->valid[set_index] = (unsigned short)(set_valid | (1u << way));
+    set_tags[way] = tag;
+    return evicted;
+}
+
+// Whether the block holding address is present, without touching the
+// replacement state
+int cacheHoldsBlock(Cache* cache, unsigned int address) {
+    unsigned int tag = address >> (cache->offset_bits + cache->index_bits);
+    unsigned int set_index = (address >> cache->offset_bits) & cache->index_mask;
+    return findCacheWay(cache->tags + (size_t)set_index * cache->associativity, cache->valid[set_index], tag, cache->associativity) >= 0;
+}
+
+// Drop the block holding address; returns 1 when it was present
+int invalidateCache(Cache* cache, unsigned int address) {
+    unsigned int tag = address >> (cache->offset_bits + cache->index_bits);
+    unsigned int set_index = (address >> cache->offset_bits) & cache->index_mask;
+    int way = findCacheWay(cache->tags + (size_t)set_index * cache->associativity, cache->valid[set_index], tag, cache->associativity);
+    if (way < 0) {
+        return 0;
+    }
+    cache->valid[set_index] &= (unsigned short)~(1u << way);
+    return 1;
+}
+
+#define DEFINE_CACHE_ACCESS(BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY, NAME) \
+    int simulateCacheAccessB##BLOCK_SIZE##A##WAYS##NAME(Cache* cache, unsigned int address, int write) { \
+        return accessCacheSet(cache, address, write, OFFSET_BITS, WAYS, POLICY, TAG_MATCH_SCALAR); \
+    }
+
+#define DEFINE_CACHE_ACCESS_POLICIES(BLOCK_SIZE, OFFSET_BITS, WAYS) \
+    DEFINE_CACHE_ACCESS(BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY_RR, Rr) \
+    DEFINE_CACHE_ACCESS(BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY_RND, Rnd) \
+    DEFINE_CACHE_ACCESS(BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY_LRU, Lru) \
+    DEFINE_CACHE_ACCESS(BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY_PLRU, Plru) \
+    DEFINE_CACHE_ACCESS(BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY_FIFO, Fifo) \
+    DEFINE_CACHE_ACCESS(BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY_SRRIP, Srrip) \
+    DEFINE_CACHE_ACCESS(BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY_BRRIP, Brrip)
+
+#define DEFINE_CACHE_ACCESS_WAYS(BLOCK_SIZE, OFFSET_BITS) \
+    DEFINE_CACHE_ACCESS_POLICIES(BLOCK_SIZE, OFFSET_BITS, 1) \
+    DEFINE_CACHE_ACCESS_POLICIES(BLOCK_SIZE, OFFSET_BITS, 2) \
+    DEFINE_CACHE_ACCESS_POLICIES(BLOCK_SIZE, OFFSET_BITS, 4) \
+    DEFINE_CACHE_ACCESS_POLICIES(BLOCK_SIZE, OFFSET_BITS, 8) \
+    DEFINE_CACHE_ACCESS_POLICIES(BLOCK_SIZE, OFFSET_BITS, 16)
+
+DEFINE_CACHE_ACCESS_WAYS(8, 3)
+DEFINE_CACHE_ACCESS_WAYS(16, 4)
+DEFINE_CACHE_ACCESS_WAYS(32, 5)
+DEFINE_CACHE_ACCESS_WAYS(64, 6)
+
+#define CACHE_ACCESS_POLICY_ROW(BLOCK_SIZE, WAYS) \
+    { simulateCacheAccessB##BLOCK_SIZE##A##WAYS##Rr, simulateCacheAccessB##BLOCK_SIZE##A##WAYS##Rnd, \
+      simulateCacheAccessB##BLOCK_SIZE##A##WAYS##Lru, simulateCacheAccessB##BLOCK_SIZE##A##WAYS##Plru, \
+      simulateCacheAccessB##BLOCK_SIZE##A##WAYS##Fifo, simulateCacheAccessB##BLOCK_SIZE##A##WAYS##Srrip, \
+      simulateCacheAccessB##BLOCK_SIZE##A##WAYS##Brrip }
+
+#define CACHE_ACCESS_WAYS_ROW(BLOCK_SIZE) \
+    { CACHE_ACCESS_POLICY_ROW(BLOCK_SIZE, 1), CACHE_ACCESS_POLICY_ROW(BLOCK_SIZE, 2), CACHE_ACCESS_POLICY_ROW(BLOCK_SIZE, 4), \
+      CACHE_ACCESS_POLICY_ROW(BLOCK_SIZE, 8), CACHE_ACCESS_POLICY_ROW(BLOCK_SIZE, 16) }
+
+// Indexed by [log2(block_size) - 3][log2(associativity)][policy]
+static const CacheAccessFunction specialized_access[4][5][NUM_POLICIES] = {
+    CACHE_ACCESS_WAYS_ROW(8),
+    CACHE_ACCESS_WAYS_ROW(16),
+    CACHE_ACCESS_WAYS_ROW(32),
+    CACHE_ACCESS_WAYS_ROW(64),
+};
+
+#if defined(__x86_64__)
+// The same variants with vector tag compares, for 4, 8 and 16 ways
+#define DEFINE_VECTOR_CACHE_ACCESS(MATCH, TARGET, BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY, NAME) \
+    TARGET int simulateCacheAccess##MATCH##B##BLOCK_SIZE##A##WAYS##NAME(Cache* cache, unsigned int address, int write) { \
+        return accessCacheSet(cache, address, write, OFFSET_BITS, WAYS, POLICY, TAG_MATCH_##MATCH); \
+    }
+
+#define DEFINE_VECTOR_CACHE_ACCESS_POLICIES(MATCH, TARGET, BLOCK_SIZE, OFFSET_BITS, WAYS) \
+    DEFINE_VECTOR_CACHE_ACCESS(MATCH, TARGET, BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY_RR, Rr) \
+    DEFINE_VECTOR_CACHE_ACCESS(MATCH, TARGET, BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY_RND, Rnd) \
+    DEFINE_VECTOR_CACHE_ACCESS(MATCH, TARGET, BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY_LRU, Lru) \
+    DEFINE_VECTOR_CACHE_ACCESS(MATCH, TARGET, BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY_PLRU, Plru) \
+    DEFINE_VECTOR_CACHE_ACCESS(MATCH, TARGET, BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY_FIFO, Fifo) \
+    DEFINE_VECTOR_CACHE_ACCESS(MATCH, TARGET, BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY_SRRIP, Srrip) \
+    DEFINE_VECTOR_CACHE_ACCESS(MATCH, TARGET, BLOCK_SIZE, OFFSET_BITS, WAYS, POLICY_BRRIP, Brrip)
+
+#define DEFINE_VECTOR_CACHE_ACCESS_BLOCKS(MATCH, TARGET, WAYS) \
+    DEFINE_VECTOR_CACHE_ACCESS_POLICIES(MATCH, TARGET, 8, 3, WAYS) \
+    DEFINE_VECTOR_CACHE_ACCESS_POLICIES(MATCH, TARGET, 16, 4, WAYS) \
+    DEFINE_VECTOR_CACHE_ACCESS_POLICIES(MATCH, TARGET, 32, 5, WAYS) \
+    DEFINE_VECTOR_CACHE_ACCESS_POLICIES(MATCH, TARGET, 64, 6, WAYS)
+
+#define TARGET_SSE2
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+
+DEFINE_VECTOR_CACHE_ACCESS_BLOCKS(SSE2, TARGET_SSE2, 4)
+DEFINE_VECTOR_CACHE_ACCESS_BLOCKS(SSE2, TARGET_SSE2, 8)
+DEFINE_VECTOR_CACHE_ACCESS_BLOCKS(SSE2, TARGET_SSE2, 16)
+DEFINE_VECTOR_CACHE_ACCESS_BLOCKS(AVX2, TARGET_AVX2, 8)
+DEFINE_VECTOR_CACHE_ACCESS_BLOCKS(AVX2, TARGET_AVX2, 16)
+DEFINE_VECTOR_CACHE_ACCESS_BLOCKS(AVX512, TARGET_AVX512, 16)
+
+#define VECTOR_ACCESS_POLICY_ROW(MATCH, BLOCK_SIZE, WAYS) \
+    { simulateCacheAccess##MATCH##B##BLOCK_SIZE##A##WAYS##Rr, simulateCacheAccess##MATCH##B##BLOCK_SIZE##A##WAYS##Rnd, \
+      simulateCacheAccess##MATCH##B##BLOCK_SIZE##A##WAYS##Lru, simulateCacheAccess##MATCH##B##BLOCK_SIZE##A##WAYS##Plru, \
+      simulateCacheAccess##MATCH##B##BLOCK_SIZE##A##WAYS##Fifo, simulateCacheAccess##MATCH##B##BLOCK_SIZE##A##WAYS##Srrip, \
+      simulateCacheAccess##MATCH##B##BLOCK_SIZE##A##WAYS##Brrip }
+
+#define VECTOR_ACCESS_BLOCK_ROWS(MATCH, WAYS) \
+    { VECTOR_ACCESS_POLICY_ROW(MATCH, 8, WAYS), VECTOR_ACCESS_POLICY_ROW(MATCH, 16, WAYS), \
+      VECTOR_ACCESS_POLICY_ROW(MATCH, 32, WAYS), VECTOR_ACCESS_POLICY_ROW(MATCH, 64, WAYS) }
+
+// Indexed by [log2(block_size) - 3][policy], one table per tag compare and
+// associativity, starting at the narrowest associativity the compare covers
+typedef CacheAccessFunction VectorAccessTable[4][NUM_POLICIES];
+static const VectorAccessTable sse2_access[3] = {
+    VECTOR_ACCESS_BLOCK_ROWS(SSE2, 4), VECTOR_ACCESS_BLOCK_ROWS(SSE2, 8), VECTOR_ACCESS_BLOCK_ROWS(SSE2, 16)
+};
+static const VectorAccessTable avx2_access[2] = { VECTOR_ACCESS_BLOCK_ROWS(AVX2, 8), VECTOR_ACCESS_BLOCK_ROWS(AVX2, 16) };
+static const VectorAccessTable avx512_access[1] = { VECTOR_ACCESS_BLOCK_ROWS(AVX512, 16) };
+#endif
+
+// Widest tag compare the CPU supports, or TAG_MATCH_SCALAR with -simd off
+static int preferred_tag_match = -1;
+
+int hostTagMatch() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return TAG_MATCH_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return TAG_MATCH_AVX2;
+    }
+    return TAG_MATCH_SSE2;
+#else
+    return TAG_MATCH_SCALAR;
+#endif
+}
+
+// The tag compare cache gets with preferred as the widest allowed: the widest
+// one no wider than the set
+int cacheTagMatch(Cache* cache, int preferred) {
+    int ways_bits = log2Int(cache->associativity);
+    if (cache->offset_bits < 3 || cache->offset_bits > 6 || ways_bits < 2) {
+        return TAG_MATCH_SCALAR;
+    }
+    if (preferred >= TAG_MATCH_AVX512 && ways_bits >= 4) {
+        return TAG_MATCH_AVX512;
+    }
+    if (preferred >= TAG_MATCH_AVX2 && ways_bits >= 3) {
+        return TAG_MATCH_AVX2;
+    }
+    return preferred >= TAG_MATCH_SSE2 ? TAG_MATCH_SSE2 : TAG_MATCH_SCALAR;
+}
+
+CacheAccessFunction selectCacheAccessWith(Cache* cache, int tag_match) {
+    int ways_bits = log2Int(cache->associativity);
+    int block = cache->offset_bits - 3;
+#if defined(__x86_64__)
+    switch (cacheTagMatch(cache, tag_match)) {
+    case TAG_MATCH_AVX512:
+        return avx512_access[ways_bits - 4][block][cache->policy];
+    case TAG_MATCH_AVX2:
+        return avx2_access[ways_bits - 3][block][cache->policy];
+    case TAG_MATCH_SSE2:
+        return sse2_access[ways_bits - 2][block][cache->policy];
+    default:
+        break;
+    }
+#endif
+    if (cache->offset_bits >= 3 && cache->offset_bits <= 6 && ways_bits >= 0 && ways_bits <= 4) {
+        return specialized_access[block][ways_bits][cache->policy];
+    }
+    return simulateCacheAccess;
+}
+
+// -simd on|off, or the name of a tag compare to cap it at
+int parseSimdSetting(const char* setting) {
+    int host = hostTagMatch();
+    if (strcmp(setting, "on") == 0) {
+        preferred_tag_match = host;
+        return 1;
+    }
+    if (strcmp(setting, "off") == 0) {
+        preferred_tag_match = TAG_MATCH_SCALAR;
+        return 1;
+    }
+    for (int m = 0; m < NUM_TAG_MATCHES; m++) {
+        if (strcmp(setting, tag_match_names[m]) == 0) {
+            if (m > host) {
+                printf("This CPU does not support %s tag compares.\n", setting);
+                return 0;
+            }
+            preferred_tag_match = m;
+            return 1;
+        }
+    }
+    printf("Invalid -simd setting. It must be on, off, scalar, sse2, avx2 or avx512.\n");
+    return 0;
+}
+
+CacheAccessFunction selectCacheAccess(Cache* cache) {
+    if (preferred_tag_match < 0) {
+        preferred_tag_match = hostTagMatch();
+    }
+    return selectCacheAccessWith(cache, preferred_tag_match);
+}
+
+// Three-C miss classification. Every reference also goes through a shadow
+// fully associative LRU cache with as many blocks as the real one:
+//  - a hash table of the resident blocks, made of buckets of
+//    SHADOW_BUCKET_WAYS blocks with a valid bit each, like the sets of a
+//    cache. A bucket is one host cache line and is searched with the same
+//    tag compare as a set, so neither finding nor removing a block walks a
+//    probe sequence. A block goes to the first bucket with room from its
+//    home bucket on; each bucket counts the blocks stored past it from
+//    buckets before it, and a search only goes on to the next bucket while
+//    that count is nonzero. With SHADOW_SLOT_FACTOR slots per shadow block
+//    that is rare.
+//  - the LRU order, a circular doubly linked list through the table slots.
+//    A hit moves its slot to the front and the LRU block is the one before
+//    the sentinel, so every reference is a bounded number of steps.
+//  - one first-touch bit per block of the 32-bit block space. The bitmap is
+//    reserved up front and the kernel backs only the pages that get written,
+//    so it costs memory in proportion to the footprint of the trace.
+// accessCacheSet classifies each reference itself before the lookup. A miss
+// in the real cache is compulsory on the first touch of its block, capacity
+// when the shadow cache misses as well, and conflict otherwise.
+#define SHADOW_BUCKET_WAYS 16           // blocks per bucket, one 64-byte host line
+#define SHADOW_SLOT_FACTOR 2            // table slots per shadow block
+#define SHADOW_EMPTY 0xffffffffu        // never a block number: blocks have at most 29 bits
+#define SHADOW_TOUCHED_PAGE_WORDS 1024  // first-touch words saved per checkpoint page
+#if defined(__x86_64__)
+#define SHADOW_TAG_MATCH TAG_MATCH_SSE2 // part of x86-64, so no target attribute is needed
+#else
+#define SHADOW_TAG_MATCH TAG_MATCH_SCALAR
+#endif
+
+typedef struct {
+    unsigned int prev;
+    unsigned int next;
+} ShadowLink;
+
+struct MissClassifier {
+    unsigned long long* touched; // bit per block, set on its first reference
+    size_t touched_bytes;
+    unsigned int* bucket_blocks; // SHADOW_BUCKET_WAYS resident blocks per bucket
+    unsigned short* bucket_valid;
+    unsigned int* crossings;    // blocks stored past each bucket from buckets up to it
+    ShadowLink* links;          // LRU order by slot, bucket * SHADOW_BUCKET_WAYS + way
+    unsigned int bucket_mask;
+    int bucket_shift;           // 32 - log2(buckets), for the multiplicative hash
+    unsigned int sentinel;      // list head past the last slot: next is the MRU block, prev the LRU one
+    unsigned int capacity;
+    unsigned int used;
+    unsigned int last_block;    // most recent reference, always resident
+};
+
+void resetMissClassifier(MissClassifier* classifier) {
+    // Hands the pages back; they read as zero until written again
+    madvise(classifier->touched, classifier->touched_bytes, MADV_DONTNEED);
+    memset(classifier->bucket_valid, 0, ((size_t)classifier->bucket_mask + 1) * sizeof(unsigned short));
+    memset(classifier->crossings, 0, ((size_t)classifier->bucket_mask + 1) * sizeof(unsigned int));
+    classifier->links[classifier->sentinel].prev = classifier->sentinel;
+    classifier->links[classifier->sentinel].next = classifier->sentinel;
+    classifier->used = 0;
+    classifier->last_block = SHADOW_EMPTY;
+}
+
+void freeMissClassifier(MissClassifier* classifier) {
+    if (classifier->touched != NULL) {
+        munmap(classifier->touched, classifier->touched_bytes);
+    }
+    free(classifier->bucket_blocks);
+    free(classifier->bucket_valid);
+    free(classifier->crossings);
+    free(classifier->links);
+    free(classifier);
+}
+
+static inline unsigned int shadowHomeBucket(MissClassifier* classifier, unsigned int block) {
+    return (block * 0x9e3779b1u) >> classifier->bucket_shift;
+}
+
+// Slot holding block, or SHADOW_EMPTY
+static inline unsigned int findShadowSlot(MissClassifier* classifier, unsigned int block) {
+    unsigned int bucket = shadowHomeBucket(classifier, block);
+    while (1) {
+        int way = findCacheWayWith(classifier->bucket_blocks + (size_t)bucket * SHADOW_BUCKET_WAYS,
+                                   classifier->bucket_valid[bucket], block, SHADOW_BUCKET_WAYS, SHADOW_TAG_MATCH);
+        if (way >= 0) {
+            return bucket * SHADOW_BUCKET_WAYS + (unsigned int)way;
+        }
+        if (classifier->crossings[bucket] == 0) {
+            return SHADOW_EMPTY;
+        }
+        bucket = (bucket + 1) & classifier->bucket_mask;
+    }
+}
+
+// Store block in the first bucket with a free way from its home on. The
+// table has SHADOW_SLOT_FACTOR slots per block, so there always is one.
+static inline unsigned int insertShadowSlot(MissClassifier* classifier, unsigned int block) {
+    unsigned int bucket = shadowHomeBucket(classifier, block);
+    while (classifier->bucket_valid[bucket] == (1u << SHADOW_BUCKET_WAYS) - 1) {
+        classifier->crossings[bucket]++;
+        bucket = (bucket + 1) & classifier->bucket_mask;
+    }
+    unsigned int way = (unsigned int)__builtin_ctz(~(unsigned int)classifier->bucket_valid[bucket]);
+    classifier->bucket_valid[bucket] |= (unsigned short)(1u << way);
+    unsigned int slot = bucket * SHADOW_BUCKET_WAYS + way;
+    classifier->bucket_blocks[slot] = block;
+    return slot;
+}
+
+static inline void removeShadowSlot(MissClassifier* classifier, unsigned int slot) {
+    unsigned int bucket = slot / SHADOW_BUCKET_WAYS;
+    classifier->bucket_valid[bucket] &= (unsigned short)~(1u << (slot % SHADOW_BUCKET_WAYS));
+    for (unsigned int home = shadowHomeBucket(classifier, classifier->bucket_blocks[slot]); home != bucket;
+         home = (home + 1) & classifier->bucket_mask) {
+        classifier->crossings[home]--;
+    }
+}
+
+static inline void unlinkShadowSlot(MissClassifier* classifier, unsigned int slot) {
+    ShadowLink link = classifier->links[slot];
+    classifier->links[link.prev].next = link.next;
+    classifier->links[link.next].prev = link.prev;
+}
+
+// Make slot the most recently used
+static inline void pushShadowSlot(MissClassifier* classifier, unsigned int slot) {
+    unsigned int sentinel = classifier->sentinel;
+    unsigned int mru = classifier->links[sentinel].next;
+    classifier->links[slot].prev = sentinel;
+    classifier->links[slot].next = mru;
+    classifier->links[mru].prev = slot;
+    classifier->links[sentinel].next = slot;
+}
+
+// Reference block in the shadow cache and return how a miss on it in the
+// real cache would be classified
+int classifyReference(MissClassifier* classifier, unsigned int block) {
+    // Runs of references to one block leave the LRU order unchanged
+    if (block == classifier->last_block) {
+        return MISS_CLASS_CONFLICT;
+    }
+    classifier->last_block = block;
+
+    unsigned int slot = findShadowSlot(classifier, block);
+    if (slot != SHADOW_EMPTY) {
+        unlinkShadowSlot(classifier, slot);
+        pushShadowSlot(classifier, slot);
+        return MISS_CLASS_CONFLICT;
+    }
+
+    unsigned long long* word = &classifier->touched[block >> 6];
+    unsigned long long bit = 1ull << (block & 63);
+    int miss_class = (*word & bit) ? MISS_CLASS_CAPACITY : MISS_CLASS_COMPULSORY;
+    *word |= bit;
+
+    if (classifier->used < classifier->capacity) {
+        classifier->used++;
+    }
+    else {
+        // Evict the least recently used block
+        unsigned int victim = classifier->links[classifier->sentinel].prev;
+        unlinkShadowSlot(classifier, victim);
+        removeShadowSlot(classifier, victim);
+    }
+    pushShadowSlot(classifier, insertShadowSlot(classifier, block));
+    return miss_class;
+}
+
+// Attach a classifier to the cache; accessCacheSet consults it on every
+// access, so every simulation path (serial, sweep workers) classifies
+int enableMissClassification(Cache* cache) {
+    MissClassifier* classifier = (MissClassifier*)calloc(1, sizeof(MissClassifier));
+    if (classifier == NULL) {
+        return 0;
+    }
+    unsigned int capacity = (unsigned int)cache->total_rows * cache->associativity;
+    int bucket_bits = 1;
+    while (((unsigned long long)SHADOW_BUCKET_WAYS << bucket_bits) < (unsigned long long)SHADOW_SLOT_FACTOR * capacity) {
+        bucket_bits++;
+    }
+    size_t slots = (size_t)SHADOW_BUCKET_WAYS << bucket_bits;
+    classifier->capacity = capacity;
+    classifier->touched_bytes = (((size_t)1 << (32 - cache->offset_bits)) + 7) / 8;
+    classifier->touched = (unsigned long long*)mmap(NULL, classifier->touched_bytes, PROT_READ | PROT_WRITE,
+                                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (classifier->touched == MAP_FAILED) {
+        classifier->touched = NULL;
+    }
+    classifier->bucket_mask = (1u << bucket_bits) - 1;
+    classifier->bucket_shift = 32 - bucket_bits;
+    classifier->bucket_blocks = (unsigned int*)alignedCalloc(slots * sizeof(unsigned int));
+    classifier->bucket_valid = (unsigned short*)alignedCalloc(((size_t)1 << bucket_bits) * sizeof(unsigned short));
+    classifier->crossings = (unsigned int*)alignedCalloc(((size_t)1 << bucket_bits) * sizeof(unsigned int));
+    classifier->sentinel = (unsigned int)slots;
+    classifier->links = (ShadowLink*)malloc((slots + 1) * sizeof(ShadowLink));
+    if (classifier->touched == NULL || classifier->bucket_blocks == NULL || classifier->bucket_valid == NULL || classifier->crossings == NULL || classifier->links == NULL) {
+        freeMissClassifier(classifier);
+        return 0;
+    }
+    resetMissClassifier(classifier);
+    cache->classifier = classifier;
+    return 1;
+}
+
+double elapsedSeconds(struct timespec* start, struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Host profiling (-perf on): where the host's time goes while simulating. The
+// replay is split into phases, parse (decoding a batch), lookup (the batch
+// consumer: the caches and anything in front of them) and stats (finishing
+// and printing the results). Switching phase reads the clock and one
+// perf_event group of hardware counters and charges the difference to the
+// phase being left, so a batch costs two reads. The counters follow this
+// thread in user mode only. Counters the kernel refuses (perf_event_paranoid,
+// containers, hosts without the event) are left out and the phases are still
+// timed. When the kernel multiplexed the group, each phase's counts are scaled
+// by the share of that phase's time the group was actually counting.
+#define PROFILE_IDLE -1
+#define PROFILE_PARSE 0
+#define PROFILE_LOOKUP 1
+#define PROFILE_STATS 2
+#define NUM_PROFILE_PHASES 3
+#define HOST_CYCLES 0
+#define HOST_INSTRUCTIONS 1
+#define HOST_LLC_MISSES 2
+#define HOST_BRANCH_MISSES 3
+#define NUM_HOST_COUNTERS 4
+
+const char* profile_phase_names[] = { "parse", "lookup", "stats" };
+const char* host_counter_names[] = { "cycles", "instructions", "LLC misses", "branch misses" };
+const unsigned long long host_counter_events[] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                   PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+
+typedef struct {
+    int group_fd;               // -1 when no counter could be opened
+    int fds[NUM_HOST_COUNTERS];
+    int slots[NUM_HOST_COUNTERS]; // position of each counter in a group read, -1 if not opened
+    int num_open;
+    int phase;                  // phase being timed, PROFILE_IDLE outside the replay
+    struct timespec last_time;
+    unsigned long long last[NUM_HOST_COUNTERS]; // raw counts at the last switch
+    unsigned long long last_enabled;            // group enabled and running time, ns
+    unsigned long long last_running;
+    double seconds[NUM_PROFILE_PHASES];
+    unsigned long long counts[NUM_PROFILE_PHASES][NUM_HOST_COUNTERS];
+    long long switches;
+} HostProfile;
+
+// Set by main when -perf is on; replayTraces and refillTraceProcess switch phases
+static HostProfile* host_profile = NULL;
+
+static long perfEventOpen(struct perf_event_attr* attr, int group_fd) {
+    return syscall(__NR_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+void openHostProfile(HostProfile* profile) {
+    memset(profile, 0, sizeof(*profile));
+    profile->group_fd = -1;
+    profile->phase = PROFILE_IDLE;
+    for (int c = 0; c < NUM_HOST_COUNTERS; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = host_counter_events[c];
+        attr.disabled = profile->group_fd < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int fd = (int)perfEventOpen(&attr, profile->group_fd);
+        profile->fds[c] = fd;
+        profile->slots[c] = -1;
+        if (fd < 0) {
+            continue;
+        }
+        if (profile->group_fd < 0) {
+            profile->group_fd = fd;
+        }
+        profile->slots[c] = profile->num_open++;
+    }
+    if (profile->group_fd >= 0) {
+        ioctl(profile->group_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(profile->group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+void closeHostProfile(HostProfile* profile) {
+    for (int c = 0; c < NUM_HOST_COUNTERS; c++) {
+        if (profile->fds[c] >= 0) {
+            close(profile->fds[c]);
+        }
+    }
+}
+
+// Raw cumulative counts since the group was enabled, and the group's enabled
+// and running times; returns 0 when the group cannot be read
+static int readHostCounters(HostProfile* profile, unsigned long long* values, unsigned long long* enabled,
+                            unsigned long long* running) {
+    unsigned long long buffer[3 + NUM_HOST_COUNTERS];
+    if (profile->group_fd < 0 || read(profile->group_fd, buffer, sizeof(buffer)) < (ssize_t)(3 * sizeof(buffer[0]))) {
+        return 0;
+    }
+    memset(values, 0, NUM_HOST_COUNTERS * sizeof(unsigned long long));
+    for (int c = 0; c < NUM_HOST_COUNTERS; c++) {
+        if (profile->slots[c] >= 0 && profile->slots[c] < (int)buffer[0]) {
+            values[c] = buffer[3 + profile->slots[c]];
+        }
+    }
+    *enabled = buffer[1];
+    *running = buffer[2];
+    return 1;
+}
+
+// Charge everything since the last switch to the current phase and start timing phase
+void switchProfilePhase(HostProfile* profile, int phase) {
+    if (phase == profile->phase) {
+        return;
+    }
+    struct timespec now;
+    unsigned long long values[NUM_HOST_COUNTERS];
+    unsigned long long enabled;
+    unsigned long long running;
+    int counted = readHostCounters(profile, values, &enabled, &running);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (profile->phase != PROFILE_IDLE) {
+        profile->seconds[profile->phase] += elapsedSeconds(&profile->last_time, &now);
+    }
+    if (counted) {
+        // Scale this phase's deltas by its own enabled / running ratio; a
+        // phase the group never ran in gets nothing rather than a guess
+        if (profile->phase != PROFILE_IDLE && running > profile->last_running) {
+            double scale = (double)(enabled - profile->last_enabled) / (running - profile->last_running);
+            for (int c = 0; c < NUM_HOST_COUNTERS; c++) {
+                if (values[c] > profile->last[c]) {
+                    profile->counts[profile->phase][c] += (unsigned long long)((values[c] - profile->last[c]) * scale);
+                }
+            }
+        }
+        memcpy(profile->last, values, sizeof(values));
+        profile->last_enabled = enabled;
+        profile->last_running = running;
+    }
+    profile->phase = phase;
+    profile->last_time = now;
+    profile->switches++;
+}
+
+void printHostProfile(HostProfile* profile, long long accesses) {
+    printf("\n***** HOST PROFILE *****\n");
+    if (profile->num_open == 0) {
+        printf("Hardware counters unavailable (perf_event_open refused); phases are timed only\n");
+    }
+    else if (profile->num_open < NUM_HOST_COUNTERS) {
+        printf("Counters not available on this host:");
+        for (int c = 0; c < NUM_HOST_COUNTERS; c++) {
+            if (profile->slots[c] < 0) {
+                printf(" %s", host_counter_names[c]);
+            }
+        }
+        printf("\n");
+    }
+    printf("%-7s %10s %14s %14s %6s %12s %12s\n", "Phase", "Seconds", "Cycles", "Instructions", "IPC", "LLC Misses",
+           "Br Misses");
+    double total_seconds = 0.0;
+    unsigned long long total[NUM_HOST_COUNTERS] = { 0, 0, 0, 0 };
+    for (int p = 0; p < NUM_PROFILE_PHASES; p++) {
+        unsigned long long* counts = profile->counts[p];
+        printf("%-7s %10.3f %14llu %14llu %6.2f %12llu %12llu\n", profile_phase_names[p], profile->seconds[p],
+               counts[HOST_CYCLES], counts[HOST_INSTRUCTIONS],
+               counts[HOST_CYCLES] > 0 ? (double)counts[HOST_INSTRUCTIONS] / counts[HOST_CYCLES] : 0.0,
+               counts[HOST_LLC_MISSES], counts[HOST_BRANCH_MISSES]);
+        total_seconds += profile->seconds[p];
+        for (int c = 0; c < NUM_HOST_COUNTERS; c++) {
+            total[c] += counts[c];
+        }
+    }
+    printf("%-7s %10.3f %14llu %14llu %6.2f %12llu %12llu\n", "total", total_seconds, total[HOST_CYCLES],
+           total[HOST_INSTRUCTIONS], total[HOST_CYCLES] > 0 ? (double)total[HOST_INSTRUCTIONS] / total[HOST_CYCLES] : 0.0,
+           total[HOST_LLC_MISSES], total[HOST_BRANCH_MISSES]);
+    if (accesses > 0) {
+        printf("Lookup ns / Simulated Access: %.2f\n", profile->seconds[PROFILE_LOOKUP] * 1e9 / accesses);
+        if (profile->slots[HOST_CYCLES] >= 0) {
+            printf("Host Cycles / Simulated Access: %.2f (lookup %.2f, parse %.2f)\n", (double)total[HOST_CYCLES] / accesses,
+                   (double)profile->counts[PROFILE_LOOKUP][HOST_CYCLES] / accesses,
+                   (double)profile->counts[PROFILE_PARSE][HOST_CYCLES] / accesses);
+        }
+    }
+    printf("Phase Switches: %lld\n", profile->switches);
+}
+
+// Trace references decoded from the EIP/dstM/srcM lines. A dstM line yields
+// up to two references; zero addresses are not memory operands and are dropped.
+#define REF_INSTRUCTION 0
+#define REF_WRITE 1
+#define REF_READ 2
+#define TRACE_BATCH_SIZE 4096
+
+typedef struct {
+    unsigned char kind;
+    unsigned char length;
+    unsigned short process;     // trace index, set by replayTracesInterleaved
+    unsigned int address;
+} TraceReference;
+
+// Binary traces start with an 8 byte magic and a 32-bit flags word, followed
+// by one record per reference. A record is a header byte (kind in the top two
+// bits, length in the low six) and then either the 4 byte little-endian address
+// or, with BINARY_TRACE_DELTA, the zigzag LEB128 difference from the previous
+// address of the same kind.
+#define BINARY_TRACE_MAGIC "CSTRACE1"
+#define BINARY_TRACE_HEADER_SIZE 12
+#define BINARY_TRACE_DELTA 1
+#define BINARY_RECORD_MAX_SIZE 6
+#define TRACE_RELEASE_CHUNK (64u << 20)
+#define INTERLEAVED_RELEASE_CHUNK (64u << 10) // per open trace when interleaving
+
+// Memory-mapped trace file, parsed in place. Text and binary traces are told
+// apart by the magic at the start of the file.
+typedef struct {
+    int fd;
+    const char* data;
+    size_t size;
+    size_t pos;
+    size_t released;
+    size_t release_chunk;
+    int binary;
+    unsigned int flags;
+    unsigned int last_address[3];
+} TraceReader;
+
+int openTraceReader(TraceReader* reader, const char* path) {
+    struct stat st;
+    reader->fd = open(path, O_RDONLY);
+    if (reader->fd < 0) {
+        return 0;
+    }
+    if (fstat(reader->fd, &st) != 0) {
+        close(reader->fd);
+        return 0;
+    }
+    reader->size = (size_t)st.st_size;
+    reader->pos = 0;
+    reader->released = 0;
+    reader->release_chunk = TRACE_RELEASE_CHUNK;
+    reader->binary = 0;
+    reader->flags = 0;
+    memset(reader->last_address, 0, sizeof(reader->last_address));
+    reader->data = NULL;
+    if (reader->size > 0) {
+        void* map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+        if (map == MAP_FAILED) {
+            close(reader->fd);
+            return 0;
+        }
+        madvise(map, reader->size, MADV_SEQUENTIAL);
+        reader->data = (const char*)map;
+    }
+    // The mapping outlives the descriptor, so any number of traces can be
+    // open at once
+    close(reader->fd);
+    reader->fd = -1;
+    if (reader->size >= BINARY_TRACE_HEADER_SIZE && memcmp(reader->data, BINARY_TRACE_MAGIC, 8) == 0) {
+        const unsigned char* header = (const unsigned char*)reader->data + 8;
+        reader->binary = 1;
+        reader->flags = header[0] | (header[1] << 8) | (header[2] << 16) | ((unsigned int)header[3] << 24);
+        reader->pos = BINARY_TRACE_HEADER_SIZE;
+    }
+    return 1;
+}
+
+// Drop mapped pages that have already been decoded so resident memory stays
+// bounded on traces larger than RAM
+void releaseConsumedTrace(TraceReader* reader) {
+    if (reader->pos - reader->released >= reader->release_chunk) {
+        size_t release_end = reader->pos & ~(size_t)(reader->release_chunk - 1);
+        madvise((void*)(reader->data + reader->released), release_end - reader->released, MADV_DONTNEED);
+        reader->released = release_end;
+    }
+}
+
+void closeTraceReader(TraceReader* reader) {
+    if (reader->data != NULL) {
+        munmap((void*)reader->data, reader->size);
+    }
+}
+
+// Nibble value of every byte, 0xff for characters that are not hex digits
+static unsigned char hex_digit_value[256];
+
+void initHexDigitTable() {
+    memset(hex_digit_value, 0xff, sizeof(hex_digit_value));
+    for (int i = 0; i < 10; i++) {
+        hex_digit_value['0' + i] = (unsigned char)i;
+    }
+    for (int i = 0; i < 6; i++) {
+        hex_digit_value['a' + i] = (unsigned char)(10 + i);
+        hex_digit_value['A' + i] = (unsigned char)(10 + i);
+    }
+}
+
+// Parse up to 8 hex digits starting at *cursor, stopping at end
+static inline unsigned int scanHex(const char** cursor, const char* end) {
+    const unsigned char* p = (const unsigned char*)*cursor;
+    unsigned int value = 0;
+    for (int i = 0; i < 8 && p < (const unsigned char*)end; i++, p++) {
+        unsigned int digit = hex_digit_value[*p];
+        if (digit > 15) {
+            break;
+        }
+        value = (value << 4) | digit;
+    }
+    *cursor = (const char*)p;
+    return value;
+}
+
+static inline const char* skipSpaces(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+    return p;
+}
+
+// Decode references from a text trace into batch until it is full or the
+// file ends. Returns the number of references written.
+int readTextTraceBatch(TraceReader* reader, TraceReference* batch, int max_refs) {
+    const char* p = reader->data + reader->pos;
+    const char* end = reader->data + reader->size;
+    int count = 0;
+
+    // A line produces at most two references
+    while (p < end && count + 2 <= max_refs) {
+        const char* line_end = (const char*)memchr(p, '\n', (size_t)(end - p));
+        if (line_end == NULL) {
+            line_end = end;
+        }
+
+        if (*p == 'E' && line_end - p > 5 && memcmp(p, "EIP (", 5) == 0) {
+            const char* q = p + 5;
+            int length = 0;
+            while (q < line_end && *q >= '0' && *q <= '9') {
+                length = length * 10 + (*q - '0');
+                q++;
+            }
+            if (q < line_end && *q == ')') {
+                q++;
+            }
+            if (q < line_end && *q == ':') {
+                q++;
+            }
+            q = skipSpaces(q, line_end);
+            batch[count].kind = REF_INSTRUCTION;
+            batch[count].length = (unsigned char)length;
+            batch[count].address = scanHex(&q, line_end);
+            count++;
+        }
+        else if (*p == 'd' && line_end - p > 5 && memcmp(p, "dstM:", 5) == 0) {
+            const char* q = skipSpaces(p + 5, line_end);
+            unsigned int dst_address = scanHex(&q, line_end);
+            unsigned int src_address = 0;
+
+            // Skip the data value that follows the destination address
+            q = skipSpaces(q, line_end);
+            while (q < line_end && *q != ' ' && *q != '\t') {
+                q++;
+            }
+            q = skipSpaces(q, line_end);
+            if (line_end - q > 5 && memcmp(q, "srcM:", 5) == 0) {
+                q = skipSpaces(q + 5, line_end);
+                src_address = scanHex(&q, line_end);
+            }
+
+            if (dst_address != 0) {
+                batch[count].kind = REF_WRITE;
+                batch[count].length = DATA_ACCESS_LENGTH;
+                batch[count].address = dst_address;
+                count++;
+            }
+            if (src_address != 0) {
+                batch[count].kind = REF_READ;
+                batch[count].length = DATA_ACCESS_LENGTH;
+                batch[count].address = src_address;
+                count++;
+            }
+        }
+
+        p = line_end < end ? line_end + 1 : end;
+    }
+
+    reader->pos = (size_t)(p - reader->data);
+    return count;
+}
+
+int readBinaryTraceBatch(TraceReader* reader, TraceReference* batch, int max_refs) {
+    const unsigned char* p = (const unsigned char*)reader->data + reader->pos;
+    const unsigned char* end = (const unsigned char*)reader->data + reader->size;
+    int count = 0;
+
+    if (reader->flags & BINARY_TRACE_DELTA) {
+        while (count < max_refs && p < end) {
+            const unsigned char* record = p;
+            unsigned int header = *p++;
+            unsigned int kind = header >> 6;
+            unsigned int zigzag = 0;
+            int shift = 0;
+            while (p < end && (*p & 0x80) && shift < 32) {
+                zigzag |= (unsigned int)(*p++ & 0x7f) << shift;
+                shift += 7;
+            }
+            if (shift >= 32 || kind > REF_READ) {
+                p = end; // corrupt record: a 32-bit delta takes at most five bytes
+                break;
+            }
+            if (p == end) {
+                p = record; // truncated record
+                break;
+            }
+            zigzag |= (unsigned int)*p++ << shift;
+            unsigned int delta = (zigzag >> 1) ^ (0u - (zigzag & 1));
+            reader->last_address[kind] += delta;
+            batch[count].kind = (unsigned char)kind;
+            batch[count].length = (unsigned char)(header & 0x3f);
+            batch[count].address = reader->last_address[kind];
+            count++;
+        }
+        if (p < end && count < max_refs) {
+            p = end;
+        }
+    }
+    else {
+        while (count < max_refs && end - p >= 5) {
+            batch[count].kind = (unsigned char)(p[0] >> 6);
+            batch[count].length = (unsigned char)(p[0] & 0x3f);
+            batch[count].address = p[1] | (p[2] << 8) | (p[3] << 16) | ((unsigned int)p[4] << 24);
+            p += 5;
+            count++;
+        }
+        if (count < max_refs) {
+            p = end; // ignore a trailing partial record
+        }
+    }
+
+    reader->pos = (size_t)(p - (const unsigned char*)reader->data);
+    return count;
+}
+
+int readTraceBatch(TraceReader* reader, TraceReference* batch, int max_refs) {
+    int count = reader->binary ? readBinaryTraceBatch(reader, batch, max_refs) : readTextTraceBatch(reader, batch, max_refs);
+    releaseConsumedTrace(reader);
+    return count;
+}
+
+// Encode one reference as a binary trace record, returns the record size
+static inline int encodeTraceRecord(unsigned char* out, TraceReference* ref, unsigned int* last_address, int delta) {
+    unsigned int length = ref->length > 0x3f ? 0x3f : ref->length;
+    out[0] = (unsigned char)((ref->kind << 6) | length);
+    if (!delta) {
+        out[1] = (unsigned char)ref->address;
+        out[2] = (unsigned char)(ref->address >> 8);
+        out[3] = (unsigned char)(ref->address >> 16);
+        out[4] = (unsigned char)(ref->address >> 24);
+        return 5;
+    }
+
+    int difference = (int)(ref->address - last_address[ref->kind]);
+    unsigned int zigzag = ((unsigned int)difference << 1) ^ (unsigned int)(difference >> 31);
+    last_address[ref->kind] = ref->address;
+    int size = 1;
+    while (zigzag >= 0x80) {
+        out[size++] = (unsigned char)(zigzag | 0x80);
+        zigzag >>= 7;
+    }
+    out[size++] = (unsigned char)zigzag;
+    return size;
+}
+
+// Returns 1 when the header was written
+int writeBinaryTraceHeader(FILE* out, int delta) {
+    unsigned char header[BINARY_TRACE_HEADER_SIZE];
+    unsigned int flags = delta ? BINARY_TRACE_DELTA : 0;
+    memcpy(header, BINARY_TRACE_MAGIC, 8);
+    header[8] = (unsigned char)flags;
+    header[9] = (unsigned char)(flags >> 8);
+    header[10] = (unsigned char)(flags >> 16);
+    header[11] = (unsigned char)(flags >> 24);
+    return fwrite(header, 1, sizeof(header), out) == sizeof(header);
+}
+
+// convert <text trace> <binary trace> [delta]
+// Streams the text trace through the parser one batch at a time, so memory use
+// does not depend on the trace size.
+int convertTrace(int argc, char* argv[]) {
+    if (argc < 4 || argc > 5 || (argc == 5 && strcmp(argv[4], "delta") != 0)) {
+        printUsage();
+        return 1;
+    }
+    int delta = argc == 5;
+
+    TraceReader reader;
+    if (!openTraceReader(&reader, argv[2])) {
+        printf("Error opening trace file %s\n", argv[2]);
+        return 1;
+    }
+    if (reader.binary) {
+        printf("Trace file %s is already binary.\n", argv[2]);
+        closeTraceReader(&reader);
+        return 1;
+    }
+    FILE* out = fopen(argv[3], "wb");
+    if (out == NULL) {
+        printf("Error opening output file %s\n", argv[3]);
+        closeTraceReader(&reader);
+        return 1;
+    }
+
+    int failed = !writeBinaryTraceHeader(out, delta);
+
+    TraceReference* batch = (TraceReference*)malloc(TRACE_BATCH_SIZE * sizeof(TraceReference));
+    unsigned char* encoded = (unsigned char*)malloc(TRACE_BATCH_SIZE * BINARY_RECORD_MAX_SIZE);
+    unsigned int last_address[3] = { 0, 0, 0 };
+    long long records = 0;
+    long long output_bytes = BINARY_TRACE_HEADER_SIZE;
+    int count;
+    while (!failed && (count = readTraceBatch(&reader, batch, TRACE_BATCH_SIZE)) > 0) {
+        size_t size = 0;
+        for (int i = 0; i < count; i++) {
+            size += encodeTraceRecord(encoded + size, &batch[i], last_address, delta);
+        }
+        if (fwrite(encoded, 1, size, out) != size) {
+            failed = 1;
+            break;
+        }
+        records += count;
+        output_bytes += size;
+    }
+    long long input_bytes = (long long)reader.size;
+    free(batch);
+    free(encoded);
+    closeTraceReader(&reader);
+    // fclose flushes the last buffered records, so it can fail too
+    if (fclose(out) != 0 || failed) {
+        printf("Error writing output file %s\n", argv[3]);
+        remove(argv[3]);
+        return 1;
+    }
+
+    printf("Converted %s -> %s (%s)\n", argv[2], argv[3], delta ? "delta" : "plain");
+    printf("Records: %lld\n", records);
+    printf("Input Bytes: %lld\t Output Bytes: %lld (%.1f%%)\n", input_bytes, output_bytes,
+           input_bytes > 0 ? output_bytes * 100.0 / input_bytes : 0.0);
+    return 0;
+}
+
+
+// Parse a comma separated list of values into values. An entry "lo-hi" expands
+// to lo, 2*lo, 4*lo, ... up to hi. Returns the number of values, -1 on error.
+int parseValueList(const char* arg, int* values, int max_values) {
+    int count = 0;
+    const char* p = arg;
+    while (*p != '\0') {
+        char* end;
+        long low = strtol(p, &end, 10);
+        long high = low;
+        if (end == p) {
+            return -1;
+        }
+        p = end;
+        if (*p == '-') {
+            high = strtol(p + 1, &end, 10);
+            if (end == p + 1 || low <= 0 || high < low) {
+                return -1;
+            }
+            p = end;
+        }
+        for (long value = low; value <= high; value = (low == high) ? high + 1 : value * 2) {
+            if (count >= max_values) {
+                return -1;
+            }
+            values[count++] = (int)value;
+        }
+        if (*p == ',') {
+            p++;
+        }
+        else if (*p != '\0') {
+            return -1;
+        }
+    }
+    return count;
+}
+
+int parsePolicy(const char* name) {
+    for (int i = 0; i < (int)(sizeof(policy_names) / sizeof(policy_names[0])); i++) {
+        if (strcasecmp(name, policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Parse a comma separated list of replacement policies, -1 on error
+int parsePolicyList(char* arg, int* values, int max_values) {
+    int count = 0;
+    for (char* name = strtok(arg, ","); name != NULL; name = strtok(NULL, ",")) {
+        int policy = parsePolicy(name);
+        if (policy < 0 || count >= max_values) {
+            return -1;
+        }
+        values[count++] = policy;
+    }
+    return count;
+}
+
+// Parse the list of -s, -b, -a or -r into values and its length into count.
+// Prints what is wrong and returns 0 for an invalid list.
+int parseGeometryList(const char* option, char* arg, int* values, int* count) {
+    int n;
+    if (strcmp(option, "-r") == 0) {
+        n = parsePolicyList(arg, values, MAX_SWEEP_VALUES);
+        if (n <= 0) {
+            printf("Invalid replacement policy. It must be rr, rnd, lru, plru, fifo, srrip or brrip.\n");
+            return 0;
+        }
+        *count = n;
+        return 1;
+    }
+    int low = MIN_ASSOCIATIVITY;
+    int high = MAX_ASSOCIATIVITY;
+    const char* error = "Invalid associativity. It must be between 1 and 16.";
+    if (strcmp(option, "-s") == 0) {
+        low = MIN_CACHE_SIZE;
+        high = MAX_CACHE_SIZE;
+        error = "Invalid cache size. It must be between 8 KB and 8 MB.";
+    }
+    else if (strcmp(option, "-b") == 0) {
+        low = MIN_BLOCK_SIZE;
+        high = MAX_BLOCK_SIZE;
+        error = "Invalid block size. It must be between 8 bytes and 64 bytes.";
+    }
+    n = parseValueList(arg, values, MAX_SWEEP_VALUES);
+    for (int j = 0; j < n; j++) {
+        if (values[j] < low || values[j] > high) {
+            n = -1;
+        }
+    }
+    if (n <= 0) {
+        printf("%s\n", error);
+        return 0;
+    }
+    *count = n;
+    return 1;
+}
+
+// Set the -host-prefetch distance; prints what is wrong and returns 0 when
+// it is out of range
+int parseHostPrefetchDistance(const char* arg) {
+    int distance;
+    char extra;
+    if (sscanf(arg, "%d%c", &distance, &extra) != 1 || distance < 0 || distance >= TRACE_BATCH_SIZE) {
+        printf("Invalid host prefetch distance. It must be between 0 and %d references.\n", TRACE_BATCH_SIZE - 1);
+        return 0;
+    }
+    host_prefetch_distance = distance;
+    return 1;
+}
+
+void accountTraceBatch(TraceTotals* totals, TraceReference* batch, int count) {
+    for (int j = 0; j < count; j++) {
+        if (batch[j].kind == REF_INSTRUCTION) {
+            totals->inst_counter += 1;
+            totals->instruction_bytes += batch[j].length;
+        }
+        else {
+            totals->src_dst_bytes += batch[j].length;
+            totals->writes += batch[j].kind == REF_WRITE;
+        }
+    }
+}
+
+// Receives each decoded batch of references during a trace replay
+typedef void (*BatchConsumer)(void* context, TraceReference* batch, int count);
+
+// Last byte a reference touches, counting a zero length as one byte
+static inline unsigned int referenceEnd(const TraceReference* ref) {
+    unsigned int end = ref->address + (ref->length > 0 ? ref->length - 1u : 0u);
+    return end < ref->address ? 0xffffffffu : end;
+}
+
+// Number of blocks of 2^offset_bits bytes after the first that ref touches
+static inline unsigned int extraBlocks(const TraceReference* ref, int offset_bits) {
+    return (referenceEnd(ref) >> offset_bits) - (ref->address >> offset_bits);
+}
+
+void simulateSplitReference(Cache* cache, const TraceReference* ref, unsigned int extra) {
+    unsigned int block = ref->address >> cache->offset_bits;
+    cache->split_references++;
+    for (unsigned int b = 1; b <= extra; b++) {
+        cache->access(cache, (block + b) << cache->offset_bits, ref->kind == REF_WRITE);
+    }
+}
+
+// Look up every block a reference touches, in address order. Hardly any
+// reference crosses a block boundary, so the first block goes straight to
+// the lookup and the rest takes one well-predicted test.
+static inline void simulateReference(Cache* cache, const TraceReference* ref) {
+    cache->access(cache, ref->address, ref->kind == REF_WRITE);
+    unsigned int extra = extraBlocks(ref, cache->offset_bits);
+    if (extra != 0) {
+        simulateSplitReference(cache, ref, extra);
+    }
+}
+
+// Hardware prefetchers. A prefetcher is a plug-in attached to one cache. It
+// sees every demand lookup through train, with the lookup's outcome and the
+// PC (the EIP of the latest instruction fetch), and asks for blocks with
+// issuePrefetch. A prefetcher that holds its blocks outside the cache also
+// implements probe, which is asked on each demand miss and moves the block
+// into the cache when it has it.
+//  - nextline: tagged next-line; a miss or the first use of a prefetched
+//    block fetches the next degree blocks
+//  - stride: a PC-indexed table of the last address and stride of every load
+//    and store; once a stride repeats it fetches degree strides ahead, at
+//    least a block apart
+//  - stream: STREAM_BUFFERS FIFO buffers of degree blocks; a miss no buffer
+//    head holds restarts the least recently used buffer at the next block,
+//    and a hit on a head moves that block into the cache and tops the buffer
+//    up
+// Prefetch fills never count as accesses, hits or misses. A prefetched block
+// is useful when a demand reference uses it and useless when it leaves the
+// cache (or its stream buffer) unused. It is late when the demand comes
+// before the fill completes, PREFETCH_LATENCY_CYCLES after the request, and
+// the demand then waits out the rest. Prefetches stay in the 4 KB page of the
+// reference that triggered them, as hardware cannot translate past it. Blocks
+// evicted by prefetch fills go into a pollution filter, and a demand miss on
+// one of them counts as pollution.
+#define PREFETCH_NONE 0
+#define PREFETCH_NEXT_LINE 1
+#define PREFETCH_STRIDE 2
+#define PREFETCH_STREAM 3
+#define NUM_PREFETCHERS 4
+#define MAX_PREFETCH_DEGREE 16
+#define PREFETCH_LATENCY_CYCLES 4       // the miss penalty of the CPI model
+#define PREFETCH_PAGE_BITS 12
+#define PREFETCH_INFLIGHT 16            // latest fills checked for timeliness
+#define POLLUTION_FILTER_BITS 12
+#define STRIDE_TABLE_BITS 8
+#define STRIDE_CONFIDENT 2
+#define STRIDE_CONFIDENCE_MAX 3
+#define STREAM_BUFFERS 4
+
+#define PREFETCH_EVENT_HIT 0
+#define PREFETCH_EVENT_MISS 1
+#define PREFETCH_EVENT_FIRST_USE 2      // first demand hit on a prefetched block
+
+const char* prefetcher_names[] = { "none", "nextline", "stride", "stream" };
+const char* prefetcher_descriptions[] = { "None", "Tagged Next-Line", "PC-Indexed Stride", "Stream Buffers" };
+const int default_prefetch_degrees[] = { 0, 1, 1, 4 };
+
+typedef void (*PrefetchTrainFunction)(Prefetcher* prefetcher, Cache* cache, unsigned int address, int kind, int event);
+typedef int (*PrefetchProbeFunction)(Prefetcher* prefetcher, Cache* cache, unsigned int address);
+
+typedef struct {
+    int valid;
+    unsigned int pc;
+    unsigned int last_address;
+    int stride;
+    int confidence;
+} StrideEntry;
+
+typedef struct {
+    unsigned int head_block;    // the buffer holds count blocks from here on
+    int count;
+    int head;                   // ready_at is a ring starting here
+    double ready_at[MAX_PREFETCH_DEGREE];
+    unsigned long long last_use;
+} StreamBuffer;
+
+struct Prefetcher {
+    int type;
+    int degree;
+    PrefetchTrainFunction train;
+    PrefetchProbeFunction probe; // NULL when prefetches fill the cache itself
+    unsigned int pc;
+    unsigned short* prefetched; // per set, ways filled by a prefetch and not used yet
+    unsigned int inflight_blocks[PREFETCH_INFLIGHT]; // block + 1, 0 when empty
+    double inflight_ready[PREFETCH_INFLIGHT];
+    int inflight_next;
+    unsigned int* pollution_filter; // block + 1 of blocks a prefetch evicted
+    StrideEntry* stride_table;
+    StreamBuffer streams[STREAM_BUFFERS];
+    unsigned long long stream_clock;
+
+    // Statistics
+    long long issued;           // blocks fetched into the cache or a stream buffer
+    long long redundant;        // requests for blocks the cache already held
+    long long useful;
+    long long useless;
+    long long late;
+    double late_cycles;
+    long long pollution_misses;
+};
+
+void resetPrefetcher(Cache* cache) {
+    Prefetcher* prefetcher = cache->prefetcher;
+    memset(prefetcher->prefetched, 0, cache->total_rows * sizeof(unsigned short));
+    memset(prefetcher->pollution_filter, 0, ((size_t)1 << POLLUTION_FILTER_BITS) * sizeof(unsigned int));
+    if (prefetcher->stride_table != NULL) {
+        memset(prefetcher->stride_table, 0, ((size_t)1 << STRIDE_TABLE_BITS) * sizeof(StrideEntry));
+    }
+    memset(prefetcher->inflight_blocks, 0, sizeof(prefetcher->inflight_blocks));
+    memset(prefetcher->streams, 0, sizeof(prefetcher->streams));
+    prefetcher->inflight_next = 0;
+    prefetcher->stream_clock = 0;
+    prefetcher->pc = 0;
+    clearPrefetcherStatistics(prefetcher, 0.0);
+}
+
+// Zero the statistics of a cache whose clock restarts from clock; fills
+// still in flight keep the time they have left
+void clearPrefetcherStatistics(Prefetcher* prefetcher, double clock) {
+    for (int i = 0; i < PREFETCH_INFLIGHT; i++) {
+        prefetcher->inflight_ready[i] -= clock;
+    }
+    for (int s = 0; s < STREAM_BUFFERS; s++) {
+        for (int d = 0; d < MAX_PREFETCH_DEGREE; d++) {
+            prefetcher->streams[s].ready_at[d] -= clock;
+        }
+    }
+    prefetcher->issued = 0;
+    prefetcher->redundant = 0;
+    prefetcher->useful = 0;
+    prefetcher->useless = 0;
+    prefetcher->late = 0;
+    prefetcher->late_cycles = 0.0;
+    prefetcher->pollution_misses = 0;
+}
+
+void freePrefetcher(Prefetcher* prefetcher) {
+    free(prefetcher->prefetched);
+    free(prefetcher->pollution_filter);
+    free(prefetcher->stride_table);
+    free(prefetcher);
+}
+
+static inline unsigned int pollutionSlot(unsigned int block) {
+    return (block * 0x9e3779b1u) >> (32 - POLLUTION_FILTER_BITS);
+}
+
+// Count a demand use of a prefetched block that is still wait cycles away
+static inline void recordPrefetchUse(Prefetcher* prefetcher, Cache* cache, double wait) {
+    prefetcher->useful++;
+    if (wait > 0.0) {
+        prefetcher->late++;
+        prefetcher->late_cycles += wait;
+        cache->cycles += wait;
+    }
+}
+
+// Cycles until the prefetch of block completes, 0 once it has
+static inline double prefetchWait(Prefetcher* prefetcher, Cache* cache, unsigned int block) {
+    for (int i = 0; i < PREFETCH_INFLIGHT; i++) {
+        if (prefetcher->inflight_blocks[i] == block + 1 && prefetcher->inflight_ready[i] > cache->cycles) {
+            return prefetcher->inflight_ready[i] - cache->cycles;
+        }
+    }
+    return 0.0;
+}
+
+// Insert the block holding address, which must not be present, ahead of
+// demand. tagged is 0 for a block a stream buffer hands over on a miss, which
+// is used at once and displaces what the demand fill would have.
+void prefetchFill(Cache* cache, unsigned int address, int tagged) {
+    Prefetcher* prefetcher = cache->prefetcher;
+    unsigned int tag = address >> (cache->offset_bits + cache->index_bits);
+    unsigned int set_index = (address >> cache->offset_bits) & cache->index_mask;
+    unsigned int* set_tags = cache->tags + (size_t)set_index * cache->associativity;
+    unsigned int set_valid = cache->valid[set_index];
+    unsigned long long* state = &cache->set_state[set_index];
+    int way = chooseFillWay(state, set_valid, cache->associativity, cache->policy);
+    unsigned int bit = 1u << way;
+    if (set_valid & bit) {
+        unsigned int victim = (set_tags[way] << cache->index_bits) | set_index;
+        if (tagged) {
+            prefetcher->pollution_filter[pollutionSlot(victim)] = victim + 1;
+        }
+        prefetcher->useless += (prefetcher->prefetched[set_index] & bit) != 0;
+        if (cache->write_back && (cache->dirty[set_index] & bit)) {
+            cache->writebacks++;
+            logMemoryWrite(cache, victim, 1);
+        }
+    }
+    replacementFill(state, way, cache->associativity, cache->policy);
+    cache->valid[set_index] = (unsigned short)(set_valid | bit);
+    cache->dirty[set_index] &= (unsigned short)~bit;
+    if (tagged) {
+        prefetcher->prefetched[set_index] |= (unsigned short)bit;
+    }
+    else {
+        prefetcher->prefetched[set_index] &= (unsigned short)~bit;
+    }
+    set_tags[way] = tag;
+}
+
+// Request the block holding address on behalf of a reference to trigger
+void issuePrefetch(Cache* cache, unsigned int trigger, unsigned int address) {
+    Prefetcher* prefetcher = cache->prefetcher;
+    if ((address ^ trigger) >> PREFETCH_PAGE_BITS) {
+        return;
+    }
+    if (cacheHoldsBlock(cache, address)) {
+        prefetcher->redundant++;
+        return;
+    }
+    prefetchFill(cache, address, 1);
+    prefetcher->issued++;
+    prefetcher->inflight_blocks[prefetcher->inflight_next] = (address >> cache->offset_bits) + 1;
+    prefetcher->inflight_ready[prefetcher->inflight_next] = cache->cycles + PREFETCH_LATENCY_CYCLES;
+    prefetcher->inflight_next = (prefetcher->inflight_next + 1) % PREFETCH_INFLIGHT;
+}
+
+void trainNextLine(Prefetcher* prefetcher, Cache* cache, unsigned int address, int kind, int event) {
+    (void)kind;
+    if (event == PREFETCH_EVENT_HIT) {
+        return;
+    }
+    unsigned int block = address >> cache->offset_bits;
+    for (int d = 1; d <= prefetcher->degree; d++) {
+        issuePrefetch(cache, address, (block + d) << cache->offset_bits);
+    }
+}
+
+void trainStride(Prefetcher* prefetcher, Cache* cache, unsigned int address, int kind, int event) {
+    (void)event;
+    if (kind == REF_INSTRUCTION) {
+        return;
+    }
+    StrideEntry* entry = &prefetcher->stride_table[(prefetcher->pc * 0x9e3779b1u) >> (32 - STRIDE_TABLE_BITS)];
+    if (!entry->valid || entry->pc != prefetcher->pc) {
+        entry->valid = 1;
+        entry->pc = prefetcher->pc;
+        entry->last_address = address;
+        entry->stride = 0;
+        entry->confidence = 0;
+        return;
+    }
+    int stride = (int)(address - entry->last_address);
+    if (stride == entry->stride) {
+        if (entry->confidence < STRIDE_CONFIDENCE_MAX) {
+            entry->confidence++;
+        }
+    }
+    else if (entry->confidence > 0) {
+        entry->confidence--;
+    }
+    else {
+        entry->stride = stride;
+    }
+    entry->last_address = address;
+    if (entry->confidence < STRIDE_CONFIDENT || entry->stride == 0) {
+        return;
+    }
+    // Strides within a block would only ask for the block in hand; the
+    // targets wrap in unsigned arithmetic so large strides cannot overflow
+    int step = entry->stride;
+    if (step > -cache->block_size && step < cache->block_size) {
+        step = step > 0 ? cache->block_size : -cache->block_size;
+    }
+    for (int d = 1; d <= prefetcher->degree; d++) {
+        issuePrefetch(cache, address, address + (unsigned int)step * (unsigned int)d);
+    }
+}
+
+int probeStream(Prefetcher* prefetcher, Cache* cache, unsigned int address) {
+    unsigned int block = address >> cache->offset_bits;
+    for (int s = 0; s < STREAM_BUFFERS; s++) {
+        StreamBuffer* stream = &prefetcher->streams[s];
+        if (stream->count == 0 || stream->head_block != block) {
+            continue;
+        }
+        recordPrefetchUse(prefetcher, cache, stream->ready_at[stream->head] - cache->cycles);
+        prefetchFill(cache, address, 0);
+        stream->head = (stream->head + 1) % MAX_PREFETCH_DEGREE;
+        stream->head_block++;
+        stream->count--;
+        stream->last_use = ++prefetcher->stream_clock;
+        unsigned int next = stream->head_block + stream->count;
+        if ((((next << cache->offset_bits) ^ address) >> PREFETCH_PAGE_BITS) == 0) {
+            stream->ready_at[(stream->head + stream->count) % MAX_PREFETCH_DEGREE] = cache->cycles + PREFETCH_LATENCY_CYCLES;
+            stream->count++;
+            prefetcher->issued++;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+void trainStream(Prefetcher* prefetcher, Cache* cache, unsigned int address, int kind, int event) {
+    (void)kind;
+    if (event != PREFETCH_EVENT_MISS) {
+        return;
+    }
+    StreamBuffer* stream = &prefetcher->streams[0];
+    for (int s = 1; s < STREAM_BUFFERS; s++) {
+        if (prefetcher->streams[s].last_use < stream->last_use) {
+            stream = &prefetcher->streams[s];
+        }
+    }
+    prefetcher->useless += stream->count;
+    unsigned int block = address >> cache->offset_bits;
+    stream->head_block = block + 1;
+    stream->head = 0;
+    stream->count = 0;
+    stream->last_use = ++prefetcher->stream_clock;
+    for (int d = 0; d < prefetcher->degree; d++) {
+        if (((((block + 1 + d) << cache->offset_bits) ^ address) >> PREFETCH_PAGE_BITS) != 0) {
+            break;
+        }
+        stream->ready_at[d] = cache->cycles + PREFETCH_LATENCY_CYCLES;
+        stream->count++;
+        prefetcher->issued++;
+    }
+}
+
+// Attach a prefetcher to the cache; degree is how many blocks it runs ahead
+int enablePrefetcher(Cache* cache, int type, int degree) {
+    Prefetcher* prefetcher = (Prefetcher*)calloc(1, sizeof(Prefetcher));
+    if (prefetcher == NULL) {
+        return 0;
+    }
+    prefetcher->type = type;
+    prefetcher->degree = degree;
+    prefetcher->prefetched = (unsigned short*)alignedCalloc(cache->total_rows * sizeof(unsigned short));
+    prefetcher->pollution_filter = (unsigned int*)calloc((size_t)1 << POLLUTION_FILTER_BITS, sizeof(unsigned int));
+    if (type == PREFETCH_STRIDE) {
+        prefetcher->stride_table = (StrideEntry*)calloc((size_t)1 << STRIDE_TABLE_BITS, sizeof(StrideEntry));
+    }
+    if (prefetcher->prefetched == NULL || prefetcher->pollution_filter == NULL ||
+        (type == PREFETCH_STRIDE && prefetcher->stride_table == NULL)) {
+        freePrefetcher(prefetcher);
+        return 0;
+    }
+    switch (type) {
+    case PREFETCH_NEXT_LINE:
+        prefetcher->train = trainNextLine;
+        break;
+    case PREFETCH_STRIDE:
+        prefetcher->train = trainStride;
+        break;
+    default:
+        prefetcher->train = trainStream;
+        prefetcher->probe = probeStream;
+        break;
+    }
+    cache->prefetcher = prefetcher;
+    resetPrefetcher(cache);
+    return 1;
+}
+
+// Demand lookup of one block with the prefetcher watching. The lookup itself
+// goes through cache->access, so it is counted (and classified) as usual.
+void prefetchedCacheAccess(Cache* cache, unsigned int address, int kind) {
+    Prefetcher* prefetcher = cache->prefetcher;
+    unsigned int block = address >> cache->offset_bits;
+    unsigned int set_index = block & cache->index_mask;
+    unsigned int tag = block >> cache->index_bits;
+    unsigned int* set_tags = cache->tags + (size_t)set_index * cache->associativity;
+    int way = findCacheWay(set_tags, cache->valid[set_index], tag, cache->associativity);
+    int event = PREFETCH_EVENT_HIT;
+    if (way >= 0) {
+        if ((prefetcher->prefetched[set_index] >> way) & 1) {
+            prefetcher->prefetched[set_index] &= (unsigned short)~(1u << way);
+            recordPrefetchUse(prefetcher, cache, prefetchWait(prefetcher, cache, block));
+            event = PREFETCH_EVENT_FIRST_USE;
+        }
+    }
+    else if (prefetcher->probe != NULL && prefetcher->probe(prefetcher, cache, address)) {
+        event = PREFETCH_EVENT_FIRST_USE;
+    }
+    else {
+        event = PREFETCH_EVENT_MISS;
+        unsigned int* filtered = &prefetcher->pollution_filter[pollutionSlot(block)];
+        if (*filtered == block + 1) {
+            prefetcher->pollution_misses++;
+            *filtered = 0;
+        }
+    }
+
+    cache->access(cache, address, kind == REF_WRITE);
+
+    if (event == PREFETCH_EVENT_MISS) {
+        // The fill may have evicted a prefetched block nobody used
+        way = findCacheWay(set_tags, cache->valid[set_index], tag, cache->associativity);
+        if (way >= 0 && ((prefetcher->prefetched[set_index] >> way) & 1)) {
+            prefetcher->prefetched[set_index] &= (unsigned short)~(1u << way);
+            prefetcher->useless++;
+        }
+    }
+    prefetcher->train(prefetcher, cache, address, kind, event);
+}
+
+// simulateReference for a cache with a prefetcher
+void simulatePrefetchedReference(Cache* cache, const TraceReference* ref) {
+    if (ref->kind == REF_INSTRUCTION) {
+        cache->prefetcher->pc = ref->address;
+    }
+    prefetchedCacheAccess(cache, ref->address, ref->kind);
+    unsigned int extra = extraBlocks(ref, cache->offset_bits);
+    if (extra != 0) {
+        unsigned int block = ref->address >> cache->offset_bits;
+        cache->split_references++;
+        for (unsigned int b = 1; b <= extra; b++) {
+            prefetchedCacheAccess(cache, (block + b) << cache->offset_bits, ref->kind);
+        }
+    }
+}
+
+// Pull the set address will look up into the host's caches
+static inline void prefetchCacheSet(const Cache* cache, unsigned int address) {
+    unsigned int set_index = (address >> cache->offset_bits) & cache->index_mask;
+    __builtin_prefetch(cache->tags + (size_t)set_index * cache->associativity, 1);
+    __builtin_prefetch(&cache->set_state[set_index], 1);
+    __builtin_prefetch(&cache->valid[set_index], 1);
+}
+
+// Simulate references on one cache, picking the prefetching path once per
+// batch so caches without a prefetcher keep the plain lookup loop. When the
+// sets outgrow the host's caches (host_prefetch > 0), the set of the reference
+// host_prefetch ahead is prefetched before each lookup, so its host misses
+// overlap the lookups in between. References are still simulated one at a
+// time in order, so the results do not change.
+static inline void simulateCacheReferences(Cache* cache, const TraceReference* refs, int count) {
+    if (cache->prefetcher != NULL) {
+        for (int j = 0; j < count; j++) {
+            simulatePrefetchedReference(cache, &refs[j]);
+        }
+        return;
+    }
+    int j = 0;
+    int distance = cache->host_prefetch;
+    if (distance > 0 && count > distance) {
+        for (int k = 0; k < distance; k++) {
+            prefetchCacheSet(cache, refs[k].address);
+        }
+        for (; j < count - distance; j++) {
+            prefetchCacheSet(cache, refs[j + distance].address);
+            simulateReference(cache, &refs[j]);
+        }
+    }
+    for (; j < count; j++) {
+        // Simulate cache access and calculate CPI
+        simulateReference(cache, &refs[j]);
+    }
+}
+
+// The caches simulated by simulateCacheBatch
+typedef struct {
+    Cache* caches;
+    int num_caches;
+} CacheGroup;
+
+void simulateCacheBatch(void* context, TraceReference* batch, int count) {
+    CacheGroup* group = (CacheGroup*)context;
+    for (int c = 0; c < group->num_caches; c++) {
+        simulateCacheReferences(&group->caches[c], batch, count);
+    }
+}
+
+// Compressed and piped traces. A trace file may be gzip, xz or zstd
+// compressed, told apart by its magic bytes, and "-" reads a trace from
+// standard input. Such traces cannot be memory-mapped, so they go through the
+// pipeline, whose I/O thread reads them with readTraceStream instead of
+// read(). The decompressors are loaded with dlopen the first time a trace
+// needs one, so building needs none of their headers and only traces whose
+// library is missing fail.
+// A zstd file made of several frames (pzstd, or compressed pieces put end to
+// end) is decoded by up to MAX_DECOMPRESS_THREADS worker threads, a frame at a
+// time, at most ZSTD_FRAME_WINDOW frames ahead of the reader; frames come out
+// in order. Single-frame files, frames above ZSTD_MAX_FRAME_CONTENT or
+// without a recorded size, and piped zstd input are decoded as one stream.
+#define TRACE_CODEC_NONE 0
+#define TRACE_CODEC_GZIP 1
+#define TRACE_CODEC_XZ 2
+#define TRACE_CODEC_ZSTD 3
+#define STREAM_INPUT_SIZE (1 << 20)
+#define STREAM_MAGIC_SIZE 6
+#define ZSTD_FRAME_WINDOW 32
+#define ZSTD_MAX_FRAME_CONTENT (256ull << 20)
+#define ZSTD_MIN_FRAME_OUTPUT 4096
+
+const char* trace_codec_names[] = { "plain", "gzip", "xz", "zstd" };
+
+// Worker threads for zstd frames, set from -decompress-threads; 0 uses one
+// per online CPU up to MAX_DECOMPRESS_THREADS
+static int decompress_threads = 0;
+
+// The stable zlib, liblzma and zstd streaming APIs. The stream structs and
+// constants come from zlib.h, lzma.h and zstd.h when the build has them and
+// are declared here otherwise, following the libraries' ABI, which has not
+// changed since zlib 1.2 and liblzma 5.0. The functions are always looked up
+// with dlopen, so the libraries are needed only by traces that use them.
+#if defined(HAVE_ZLIB_H)
+typedef z_stream GzipStream;
+#define GZIP_ABI_VERSION ZLIB_VERSION
+#else
+#define GZIP_ABI_VERSION "1.2.11"       // zlib only checks the major version
+#define Z_OK 0
+#define Z_STREAM_END 1
+#define Z_BUF_ERROR (-5)
+#define Z_NO_FLUSH 0
+
+typedef struct {
+    const unsigned char* next_in;
+    unsigned int avail_in;
+    unsigned long total_in;
+    unsigned char* next_out;
+    unsigned int avail_out;
+    unsigned long total_out;
+    const char* msg;
+    void* state;
+    void* zalloc;
+    void* zfree;
+    void* opaque;
+    int data_type;
+    unsigned long adler;
+    unsigned long reserved;
+} GzipStream;
+#endif
+
+#if defined(HAVE_LZMA_H)
+typedef lzma_stream XzStream;
+#else
+#define LZMA_OK 0
+#define LZMA_STREAM_END 1
+#define LZMA_BUF_ERROR 10
+#define LZMA_RUN 0
+#define LZMA_FINISH 3
+#define LZMA_CONCATENATED 0x08
+
+typedef struct {
+    const uint8_t* next_in;
+    size_t avail_in;
+    uint64_t total_in;
+    uint8_t* next_out;
+    size_t avail_out;
+    uint64_t total_out;
+    const void* allocator;
+    void* internal;
+    void* reserved_ptr[4];
+    uint64_t reserved_int[2];
+    size_t reserved_size[2];
+    int reserved_enum[2];
+} XzStream;
+#endif
+
+#if defined(HAVE_ZSTD_H)
+typedef ZSTD_inBuffer ZstdInBuffer;
+typedef ZSTD_outBuffer ZstdOutBuffer;
+#else
+#define ZSTD_CONTENTSIZE_UNKNOWN (0ULL - 1)
+#define ZSTD_CONTENTSIZE_ERROR (0ULL - 2)
+
+typedef struct {
+    const void* src;
+    size_t size;
+    size_t pos;
+} ZstdInBuffer;
+
+typedef struct {
+    void* dst;
+    size_t size;
+    size_t pos;
+} ZstdOutBuffer;
+#endif
+
+// The layouts the declarations above have on LP64 hosts. A build with the
+// headers checks the libraries' own structs against the same numbers.
+#if defined(__LP64__)
+_Static_assert(sizeof(GzipStream) == 112 && offsetof(GzipStream, avail_out) == 32 && offsetof(GzipStream, adler) == 96,
+               "GzipStream does not match zlib's z_stream");
+_Static_assert(sizeof(XzStream) == 136 && offsetof(XzStream, avail_out) == 32 && offsetof(XzStream, internal) == 56,
+               "XzStream does not match liblzma's lzma_stream");
+#endif
+_Static_assert(sizeof(ZstdInBuffer) == 3 * sizeof(size_t) && sizeof(ZstdOutBuffer) == 3 * sizeof(size_t),
+               "ZstdInBuffer and ZstdOutBuffer do not match zstd's buffers");
+
+static struct {
+    int state;                  // 0 not loaded yet, 1 loaded, -1 unavailable
+    int (*inflateInit2_)(GzipStream* strm, int window_bits, const char* version, int stream_size);
+    int (*inflate)(GzipStream* strm, int flush);
+    int (*inflateReset)(GzipStream* strm);
+    int (*inflateEnd)(GzipStream* strm);
+} zlib_api;
+
+static struct {
+    int state;
+    int (*stream_decoder)(XzStream* strm, uint64_t memlimit, uint32_t flags);
+    int (*code)(XzStream* strm, int action);
+    void (*end)(XzStream* strm);
+} lzma_api;
+
+static struct {
+    int state;
+    void* (*createDStream)(void);
+    size_t (*freeDStream)(void* stream);
+    size_t (*initDStream)(void* stream);
+    size_t (*decompressStream)(void* stream, ZstdOutBuffer* output, ZstdInBuffer* input);
+    unsigned (*isError)(size_t code);
+    const char* (*getErrorName)(size_t code);
+    size_t (*findFrameCompressedSize)(const void* src, size_t size);
+    unsigned long long (*getFrameContentSize)(const void* src, size_t size);
+} zstd_api;
+
+// Resolve count functions of the library soname into targets, once. Returns
+// 1 when all of them are there.
+static int loadLibrary(int* state, const char* soname, const char* const* names, void** targets[], int count) {
+    if (*state == 0) {
+        *state = -1;
+        void* library = dlopen(soname, RTLD_NOW);
+        if (library != NULL) {
+            int found = 0;
+            for (int i = 0; i < count; i++) {
+                *targets[i] = dlsym(library, names[i]);
+                found += *targets[i] != NULL;
+            }
+            *state = found == count ? 1 : -1;
+        }
+    }
+    return *state > 0;
+}
+
+int loadCodec(int codec) {
+    if (codec == TRACE_CODEC_GZIP) {
+        const char* names[] = { "inflateInit2_", "inflate", "inflateReset", "inflateEnd" };
+        void** targets[] = { (void**)&zlib_api.inflateInit2_, (void**)&zlib_api.inflate, (void**)&zlib_api.inflateReset,
+                             (void**)&zlib_api.inflateEnd };
+        return loadLibrary(&zlib_api.state, "libz.so.1", names, targets, 4);
+    }
+    if (codec == TRACE_CODEC_XZ) {
+        const char* names[] = { "lzma_stream_decoder", "lzma_code", "lzma_end" };
+        void** targets[] = { (void**)&lzma_api.stream_decoder, (void**)&lzma_api.code, (void**)&lzma_api.end };
+        return loadLibrary(&lzma_api.state, "liblzma.so.5", names, targets, 3);
+    }
+    if (codec == TRACE_CODEC_ZSTD) {
+        const char* names[] = { "ZSTD_createDStream", "ZSTD_freeDStream", "ZSTD_initDStream", "ZSTD_decompressStream",
+                                "ZSTD_isError", "ZSTD_getErrorName", "ZSTD_findFrameCompressedSize",
+                                "ZSTD_getFrameContentSize" };
+        void** targets[] = { (void**)&zstd_api.createDStream, (void**)&zstd_api.freeDStream, (void**)&zstd_api.initDStream,
+                             (void**)&zstd_api.decompressStream, (void**)&zstd_api.isError, (void**)&zstd_api.getErrorName,
+                             (void**)&zstd_api.findFrameCompressedSize, (void**)&zstd_api.getFrameContentSize };
+        return loadLibrary(&zstd_api.state, "libzstd.so.1", names, targets, 8);
+    }
+    return 1;
+}
+
+int traceCodec(const unsigned char* magic, size_t size) {
+    if (size >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        return TRACE_CODEC_GZIP;
+    }
+    if (size >= 6 && memcmp(magic, "\xfd" "7zXZ\0", 6) == 0) {
+        return TRACE_CODEC_XZ;
+    }
+    if (size >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+        return TRACE_CODEC_ZSTD;
+    }
+    return TRACE_CODEC_NONE;
+}
+
+#define TRACE_MAPPED 0
+#define TRACE_COMPRESSED 1
+#define TRACE_PIPED 2
+
+// How path is read: mapped, or streamed because it is compressed or because it
+// is standard input, a pipe or another file that can be read only once
+int traceInputKind(const char* path) {
+    struct stat st;
+    if (strcmp(path, "-") == 0) {
+        return TRACE_PIPED;
+    }
+    if (stat(path, &st) != 0) {
+        return TRACE_MAPPED; // reported when it fails to open
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return TRACE_PIPED;
+    }
+    unsigned char magic[STREAM_MAGIC_SIZE];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return TRACE_MAPPED;
+    }
+    ssize_t n = read(fd, magic, sizeof(magic));
+    close(fd);
+    return n > 0 && traceCodec(magic, (size_t)n) != TRACE_CODEC_NONE ? TRACE_COMPRESSED : TRACE_MAPPED;
+}
+
+// Frames of a memory-mapped zstd file and the workers decoding them
+typedef struct {
+    const unsigned char* data;
+    size_t size;
+    size_t* offsets;            // start of every frame, then the end of the last
+    int num_frames;
+    int num_threads;
+    pthread_t threads[MAX_DECOMPRESS_THREADS];
+    atomic_int next_frame;      // next frame a worker claims
+    pthread_mutex_t lock;       // guards consumed, stop and ready
+    pthread_cond_t changed;     // a frame was decoded or consumed, or stop was set
+    int consumed;               // frames the reader is done with
+    int stop;
+    int ready[ZSTD_FRAME_WINDOW]; // frame + 1 once decoded into the slot, -(frame + 1) on error
+    unsigned char* output[ZSTD_FRAME_WINDOW];
+    size_t output_size[ZSTD_FRAME_WINDOW];
+    int current;                // frame being read
+    size_t current_pos;
+} ZstdFrames;
+
+typedef struct {
+    int fd;
+    int codec;
+    unsigned char* input;       // compressed bytes read and not yet decoded
+    size_t input_size;
+    size_t input_pos;
+    int input_end;
+    int finished;
+    int member_done;            // the last gzip member or zstd frame ended with the input read so far
+    GzipStream gzip;
+    XzStream xz;
+    void* zstd;
+    ZstdFrames* frames;         // NULL unless zstd frames are decoded in parallel
+    char error[128];
+} TraceStream;
+
+// Decode one whole zstd frame into output, growing it as needed. An empty
+// frame leaves output NULL; so does a failure, with nothing left to free.
+static int decodeZstdFrame(void* dstream, const unsigned char* src, size_t size, unsigned char** output, size_t* output_size) {
+    unsigned long long content = zstd_api.getFrameContentSize(src, size);
+    *output = NULL;
+    *output_size = 0;
+    if (content == 0) {
+        return 1;
+    }
+    size_t capacity = content != ZSTD_CONTENTSIZE_UNKNOWN && content != ZSTD_CONTENTSIZE_ERROR ? (size_t)content : 4 * size;
+    capacity = capacity > ZSTD_MIN_FRAME_OUTPUT ? capacity : ZSTD_MIN_FRAME_OUTPUT;
+    *output = (unsigned char*)malloc(capacity);
+    zstd_api.initDStream(dstream);
+    ZstdInBuffer in = { src, size, 0 };
+    while (*output != NULL) {
+        if (*output_size == capacity) {
+            unsigned char* grown = (unsigned char*)realloc(*output, 2 * capacity);
+            if (grown == NULL) {
+                break;
+            }
+            *output = grown;
+            capacity *= 2;
+        }
+        ZstdOutBuffer out = { *output + *output_size, capacity - *output_size, 0 };
+        size_t status = zstd_api.decompressStream(dstream, &out, &in);
+        *output_size += out.pos;
+        if (zstd_api.isError(status)) {
+            break;
+        }
+        if (status == 0) {
+            return 1;
+        }
+        if (in.pos == in.size && out.pos < out.size) {
+            break; // truncated frame
+        }
+    }
+    free(*output);
+    *output = NULL;
+    *output_size = 0;
+    return 0;
+}
+
+void* zstdFrameWorkerMain(void* arg) {
+    ZstdFrames* frames = (ZstdFrames*)arg;
+    void* dstream = zstd_api.createDStream();
+    while (dstream != NULL) {
+        int frame = atomic_fetch_add(&frames->next_frame, 1);
+        if (frame >= frames->num_frames) {
+            break;
+        }
+        // Wait for the slot the frame decodes into
+        pthread_mutex_lock(&frames->lock);
+        while (frame >= frames->consumed + ZSTD_FRAME_WINDOW && !frames->stop) {
+            pthread_cond_wait(&frames->changed, &frames->lock);
+        }
+        int stop = frames->stop;
+        pthread_mutex_unlock(&frames->lock);
+        if (stop) {
+            break;
+        }
+        int slot = frame % ZSTD_FRAME_WINDOW;
+        size_t start = frames->offsets[frame];
+        int decoded = decodeZstdFrame(dstream, frames->data + start, frames->offsets[frame + 1] - start,
+                                      &frames->output[slot], &frames->output_size[slot]);
+        pthread_mutex_lock(&frames->lock);
+        frames->ready[slot] = decoded ? frame + 1 : -(frame + 1);
+        pthread_cond_broadcast(&frames->changed);
+        pthread_mutex_unlock(&frames->lock);
+    }
+    if (dstream != NULL) {
+        zstd_api.freeDStream(dstream);
+    }
+    return NULL;
+}
+
+void closeZstdFrames(ZstdFrames* frames) {
+    pthread_mutex_lock(&frames->lock);
+    frames->stop = 1;
+    pthread_cond_broadcast(&frames->changed);
+    pthread_mutex_unlock(&frames->lock);
+    for (int t = 0; t < frames->num_threads; t++) {
+        pthread_join(frames->threads[t], NULL);
+    }
+    pthread_mutex_destroy(&frames->lock);
+    pthread_cond_destroy(&frames->changed);
+    for (int slot = 0; slot < ZSTD_FRAME_WINDOW; slot++) {
+        free(frames->output[slot]);
+    }
+    munmap((void*)frames->data, frames->size);
+    free(frames->offsets);
+    free(frames);
+}
+
+// Map a zstd file and split it into frames. Returns NULL when it is better
+// decoded as one stream.
+ZstdFrames* openZstdFrames(int fd) {
+    struct stat st;
+    int threads = decompress_threads > 0 ? decompress_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    threads = threads < MAX_DECOMPRESS_THREADS ? threads : MAX_DECOMPRESS_THREADS;
+    if (threads < 2 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    const unsigned char* data = (const unsigned char*)map;
+
+    int num_frames = 0;
+    int capacity = 64;
+    size_t* offsets = (size_t*)malloc((capacity + 1) * sizeof(size_t));
+    size_t pos = 0;
+    int usable = offsets != NULL;
+    while (usable && pos < size) {
+        size_t frame_size = zstd_api.findFrameCompressedSize(data + pos, size - pos);
+        unsigned long long content = zstd_api.getFrameContentSize(data + pos, size - pos);
+        if (zstd_api.isError(frame_size) || content == ZSTD_CONTENTSIZE_UNKNOWN || content > ZSTD_MAX_FRAME_CONTENT) {
+            usable = 0; // ZSTD_CONTENTSIZE_ERROR is a skippable frame and decodes to nothing
+            break;
+        }
+        if (num_frames == capacity) {
+            capacity *= 2;
+            size_t* grown = (size_t*)realloc(offsets, (capacity + 1) * sizeof(size_t));
+            if (grown == NULL) {
+                usable = 0;
+                break;
+            }
+            offsets = grown;
+        }
+        offsets[num_frames++] = pos;
+        pos += frame_size;
+    }
+    if (!usable || num_frames < 2) {
+        free(offsets);
+        munmap(map, size);
+        return NULL;
+    }
+    offsets[num_frames] = size;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    ZstdFrames* frames = (ZstdFrames*)calloc(1, sizeof(ZstdFrames));
+    if (frames == NULL) {
+        free(offsets);
+        munmap(map, size);
+        return NULL;
+    }
+    frames->data = data;
+    frames->size = size;
+    frames->offsets = offsets;
+    frames->num_frames = num_frames;
+    pthread_mutex_init(&frames->lock, NULL);
+    pthread_cond_init(&frames->changed, NULL);
+    int wanted = threads < num_frames ? threads : num_frames;
+    for (int t = 0; t < wanted; t++) {
+        if (pthread_create(&frames->threads[t], NULL, zstdFrameWorkerMain, frames) != 0) {
+            break;
+        }
+        frames->num_threads++;
+    }
+    if (frames->num_threads == 0) {
+        // The caller decodes the file as one stream instead
+        closeZstdFrames(frames);
+        return NULL;
+    }
+    return frames;
+}
+
+ssize_t readZstdFrames(TraceStream* stream, char* buffer, size_t size) {
+    ZstdFrames* frames = stream->frames;
+    size_t produced = 0;
+    while (produced < size && frames->current < frames->num_frames) {
+        int slot = frames->current % ZSTD_FRAME_WINDOW;
+        pthread_mutex_lock(&frames->lock);
+        while (frames->ready[slot] != frames->current + 1 && frames->ready[slot] != -(frames->current + 1)) {
+            pthread_cond_wait(&frames->changed, &frames->lock);
+        }
+        int state = frames->ready[slot];
+        pthread_mutex_unlock(&frames->lock);
+        if (state < 0) {
+            snprintf(stream->error, sizeof(stream->error), "corrupt zstd frame %d", frames->current);
+            return produced > 0 ? (ssize_t)produced : -1;
+        }
+        size_t available = frames->output_size[slot] - frames->current_pos;
+        size_t copy = available < size - produced ? available : size - produced;
+        if (copy > 0) {
+            memcpy(buffer + produced, frames->output[slot] + frames->current_pos, copy);
+        }
+        produced += copy;
+        frames->current_pos += copy;
+        if (frames->current_pos == frames->output_size[slot]) {
+            free(frames->output[slot]);
+            frames->output[slot] = NULL;
+            frames->current++;
+            frames->current_pos = 0;
+            pthread_mutex_lock(&frames->lock);
+            frames->ready[slot] = 0;
+            frames->consumed = frames->current;
+            pthread_cond_broadcast(&frames->changed);
+            pthread_mutex_unlock(&frames->lock);
+        }
+    }
+    return (ssize_t)produced;
+}
+
+// Open path ("-" for standard input) and set up the decoder its magic bytes
+// call for. Returns 0 with stream->error set on failure.
+int openTraceStream(TraceStream* stream, const char* path) {
+    memset(stream, 0, sizeof(*stream));
+    stream->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (stream->fd < 0) {
+        snprintf(stream->error, sizeof(stream->error), "cannot open it");
+        return 0;
+    }
+    posix_fadvise(stream->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    stream->input = (unsigned char*)malloc(STREAM_INPUT_SIZE);
+
+    // Read the magic bytes; a pipe may deliver them a few at a time
+    while (stream->input_size < STREAM_MAGIC_SIZE) {
+        ssize_t n = read(stream->fd, stream->input + stream->input_size, STREAM_MAGIC_SIZE - stream->input_size);
+        if (n <= 0) {
+            stream->input_end = 1;
+            break;
+        }
+        stream->input_size += (size_t)n;
+    }
+    stream->codec = traceCodec(stream->input, stream->input_size);
+    if (!loadCodec(stream->codec)) {
+        snprintf(stream->error, sizeof(stream->error), "it is %s compressed and the %s library could not be loaded",
+                 trace_codec_names[stream->codec], trace_codec_names[stream->codec]);
+        return 0;
+    }
+
+    switch (stream->codec) {
+    case TRACE_CODEC_GZIP:
+        // 15 + 32: the largest window, with gzip or zlib headers detected
+        if (zlib_api.inflateInit2_(&stream->gzip, 15 + 32, GZIP_ABI_VERSION, (int)sizeof(GzipStream)) != Z_OK) {
+            snprintf(stream->error, sizeof(stream->error), "cannot start the gzip decoder");
+            return 0;
+        }
+        break;
+    case TRACE_CODEC_XZ:
+        memset(&stream->xz, 0, sizeof(stream->xz));
+        if (lzma_api.stream_decoder(&stream->xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+            snprintf(stream->error, sizeof(stream->error), "cannot start the xz decoder");
+            return 0;
+        }
+        break;
+    case TRACE_CODEC_ZSTD:
+        if (stream->fd != STDIN_FILENO) {
+            stream->frames = openZstdFrames(stream->fd);
+        }
+        if (stream->frames == NULL) {
+            stream->zstd = zstd_api.createDStream();
+            if (stream->zstd == NULL) {
+                snprintf(stream->error, sizeof(stream->error), "cannot start the zstd decoder");
+                return 0;
+            }
+            zstd_api.initDStream(stream->zstd);
+        }
+        break;
+    default:
+        break;
+    }
+    return 1;
+}
+
+void closeTraceStream(TraceStream* stream) {
+    if (stream->codec == TRACE_CODEC_GZIP && zlib_api.state > 0) {
+        zlib_api.inflateEnd(&stream->gzip);
+    }
+    else if (stream->codec == TRACE_CODEC_XZ && lzma_api.state > 0) {
+        lzma_api.end(&stream->xz);
+    }
+    if (stream->frames != NULL) {
+        closeZstdFrames(stream->frames);
+    }
+    if (stream->zstd != NULL) {
+        zstd_api.freeDStream(stream->zstd);
+    }
+    if (stream->fd > STDIN_FILENO) {
+        close(stream->fd);
+    }
+    free(stream->input);
+}
+
+// Fill buffer with up to size bytes of the decompressed trace. Returns the
+// number of bytes, 0 at the end of the trace and -1 on a decoding error.
+ssize_t readTraceStream(TraceStream* stream, char* buffer, size_t size) {
+    if (stream->frames != NULL) {
+        return readZstdFrames(stream, buffer, size);
+    }
+    size_t produced = 0;
+    while (produced < size && !stream->finished && stream->error[0] == '\0') {
+        if (stream->input_pos == stream->input_size && !stream->input_end) {
+            ssize_t n = read(stream->fd, stream->input, STREAM_INPUT_SIZE);
+            stream->input_pos = 0;
+            stream->input_size = n > 0 ? (size_t)n : 0;
+            stream->input_end = n <= 0;
+        }
+        size_t available = stream->input_size - stream->input_pos;
+        unsigned char* input = stream->input + stream->input_pos;
+
+        if (stream->codec == TRACE_CODEC_NONE) {
+            size_t copy = available < size - produced ? available : size - produced;
+            memcpy(buffer + produced, input, copy);
+            produced += copy;
+            stream->input_pos += copy;
+            stream->finished = stream->input_end && stream->input_pos == stream->input_size;
+        }
+        else if (available == 0 && stream->input_end && stream->member_done) {
+            stream->finished = 1;
+        }
+        else if (stream->codec == TRACE_CODEC_GZIP) {
+            stream->gzip.next_in = input;
+            stream->gzip.avail_in = (unsigned int)available;
+            stream->gzip.next_out = (unsigned char*)buffer + produced;
+            stream->gzip.avail_out = (unsigned int)(size - produced);
+            int status = zlib_api.inflate(&stream->gzip, Z_NO_FLUSH);
+            produced = size - stream->gzip.avail_out;
+            stream->input_pos = stream->input_size - stream->gzip.avail_in;
+            if (status == Z_STREAM_END) {
+                // Another gzip member may follow
+                stream->member_done = 1;
+                zlib_api.inflateReset(&stream->gzip);
+            }
+            else if (stream->input_pos > stream->input_size - available) {
+                stream->member_done = 0;
+            }
+            else if (status != Z_OK && !(status == Z_BUF_ERROR && available == 0 && !stream->input_end)) {
+                snprintf(stream->error, sizeof(stream->error), status == Z_BUF_ERROR ? "truncated gzip data" : "corrupt gzip data");
+                break;
+            }
+        }
+        else if (stream->codec == TRACE_CODEC_XZ) {
+            stream->xz.next_in = input;
+            stream->xz.avail_in = available;
+            stream->xz.next_out = (uint8_t*)buffer + produced;
+            stream->xz.avail_out = size - produced;
+            int status = lzma_api.code(&stream->xz, stream->input_end ? LZMA_FINISH : LZMA_RUN);
+            produced = size - stream->xz.avail_out;
+            stream->input_pos = stream->input_size - stream->xz.avail_in;
+            if (status == LZMA_STREAM_END) {
+                stream->finished = 1;
+            }
+            else if (status != LZMA_OK) {
+                snprintf(stream->error, sizeof(stream->error), status == LZMA_BUF_ERROR ? "truncated xz data" : "corrupt xz data");
+                break;
+            }
+        }
+        else {
+            ZstdInBuffer in = { input, available, 0 };
+            ZstdOutBuffer out = { buffer + produced, size - produced, 0 };
+            size_t status = zstd_api.decompressStream(stream->zstd, &out, &in);
+            produced += out.pos;
+            stream->input_pos += in.pos;
+            if (zstd_api.isError(status)) {
+                snprintf(stream->error, sizeof(stream->error), "corrupt zstd data: %s", zstd_api.getErrorName(status));
+                break;
+            }
+            if (in.pos > 0 || out.pos > 0) {
+                stream->member_done = status == 0;
+            }
+            else if (stream->input_end) {
+                // No progress at the end of the input: it stops inside a frame
+                snprintf(stream->error, sizeof(stream->error), "truncated zstd data");
+                break;
+            }
+        }
+    }
+    // Hand over what decoded before an error; the error is returned next
+    return produced == 0 && stream->error[0] != '\0' ? -1 : (ssize_t)produced;
+}
+
+// Three-stage trace pipeline, used instead of the mmap reader with -io
+// pipeline. An I/O thread reads the trace files in fixed blocks, decompressing
+// them when needed (see readTraceStream), a decoder
+// thread parses the blocks into reference batches, and the calling thread
+// simulates the batches. Stages hand slots over single-producer
+// single-consumer rings with PIPELINE_SLOTS entries; a full ring blocks its
+// producer, which bounds memory and applies back-pressure upstream. A stage
+// that has to wait yields PIPELINE_SPIN_YIELDS times and then sleeps on the
+// ring's condition variable, so a stalled stage does not hold a core. A
+// blocked producer waits for half the ring to drain, and refills it in one
+// go instead of being woken for every slot.
+#define PIPELINE_BLOCK_SIZE (1 << 20)
+#define PIPELINE_SLOTS 8
+#define PIPELINE_SPIN_YIELDS 16
+#define STAGE_IO 0
+#define STAGE_DECODE 1
+#define STAGE_SIMULATE 2
+
+typedef struct {
+    _Alignas(HOST_CACHE_LINE) atomic_size_t head; // next slot the consumer takes
+    _Alignas(HOST_CACHE_LINE) atomic_size_t tail; // next slot the producer fills
+    _Alignas(HOST_CACHE_LINE) atomic_int done;
+    atomic_int sleeping;        // a stage waits on changed; only one can at a time
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} PipelineRing;
+
+typedef struct {
+    char* data;
+    size_t size;
+    int file_start;             // first block of a trace file
+    int file_end;               // last block of a trace file
+} IoBlock;
+
+typedef struct {
+    TraceReference* refs;
+    int count;
+} RefBatch;
+
+typedef struct {
+    char** trace_files;
+    int num_trace_files;
+    TraceTotals* totals;
+    PipelineRing io_ring;
+    IoBlock io_blocks[PIPELINE_SLOTS];
+    PipelineRing batch_ring;
+    RefBatch batches[PIPELINE_SLOTS];
+} TracePipeline;
+
+void initPipelineRing(PipelineRing* ring) {
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->done, 0);
+    atomic_init(&ring->sleeping, 0);
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->changed, NULL);
+}
+
+void destroyPipelineRing(PipelineRing* ring) {
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->changed);
+}
+
+// Whether the waiting side of the ring can go on: the producer needs half
+// the slots free, the consumer an entry past head or the end of the stream
+static inline int ringReady(PipelineRing* ring, size_t head, int producer) {
+    if (producer) {
+        return atomic_load(&ring->tail) - atomic_load(&ring->head) <= PIPELINE_SLOTS / 2;
+    }
+    return atomic_load(&ring->tail) != head || atomic_load(&ring->done);
+}
+
+// Yield a few times, then sleep until the other side moves the ring. The
+// sleeper announces itself before its last check and the other side checks
+// for a sleeper after its update, both sequentially consistent, so at least
+// one of them sees the other and no wakeup is lost.
+static void waitRing(PipelineRing* ring, size_t head, int producer) {
+    for (int spin = 0; spin < PIPELINE_SPIN_YIELDS; spin++) {
+        if (ringReady(ring, head, producer)) {
+            return;
+        }
+        sched_yield();
+    }
+    pthread_mutex_lock(&ring->lock);
+    atomic_store(&ring->sleeping, 1);
+    while (!ringReady(ring, head, producer)) {
+        pthread_cond_wait(&ring->changed, &ring->lock);
+    }
+    atomic_store(&ring->sleeping, 0);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static inline void wakeRing(PipelineRing* ring) {
+    if (atomic_load(&ring->sleeping)) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_signal(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+// Producer: wait for a free slot, returns its index
+static inline int acquireRingSlot(PipelineRing* ring, StageStats* stats) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == PIPELINE_SLOTS) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        waitRing(ring, 0, 1);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stats->blocked_seconds += elapsedSeconds(&start, &end);
+    }
+    return (int)(tail % PIPELINE_SLOTS);
+}
+
+static inline void publishRingSlot(PipelineRing* ring) {
+    atomic_fetch_add(&ring->tail, 1);
+    wakeRing(ring);
+}
+
+// Producer: no more slots will be published
+static inline void finishRing(PipelineRing* ring) {
+    atomic_store(&ring->done, 1);
+    wakeRing(ring);
+}
+
+// Consumer: wait for a filled slot, returns its index or -1 once the
+// producer has finished and the ring is empty
+static inline int takeRingSlot(PipelineRing* ring, StageStats* stats) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        waitRing(ring, head, 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        stats->starved_seconds += elapsedSeconds(&start, &end);
+        // done is set after the last publish, so an empty ring now is the end
+        if (atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+            return -1;
+        }
+    }
+    return (int)(head % PIPELINE_SLOTS);
+}
+
+static inline void releaseRingSlot(PipelineRing* ring) {
+    size_t head = atomic_fetch_add(&ring->head, 1) + 1;
+    if (atomic_load(&ring->tail) - head <= PIPELINE_SLOTS / 2) {
+        wakeRing(ring);
+    }
+}
+
+void* pipelineIoMain(void* arg) {
+    TracePipeline* pipeline = (TracePipeline*)arg;
+    StageStats* stats = &pipeline->totals->stages[STAGE_IO];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < pipeline->num_trace_files; ++i) {
+        TraceStream stream;
+        if (!openTraceStream(&stream, pipeline->trace_files[i])) {
+            printf("Error opening trace file %s: %s\n", pipeline->trace_files[i], stream.error);
+            closeTraceStream(&stream);
+            continue; // Skip to the next trace file if unable to open
+        }
+
+        int file_start = 1;
+        int file_end = 0;
+        while (!file_end) {
+            IoBlock* block = &pipeline->io_blocks[acquireRingSlot(&pipeline->io_ring, stats)];
+            block->size = 0;
+            while (block->size < PIPELINE_BLOCK_SIZE) {
+                ssize_t n = readTraceStream(&stream, block->data + block->size, PIPELINE_BLOCK_SIZE - block->size);
+                if (n < 0) {
+                    printf("Error reading trace file %s: %s\n", pipeline->trace_files[i], stream.error);
+                }
+                if (n <= 0) {
+                    file_end = 1;
+                    break;
+                }
+                block->size += (size_t)n;
+            }
+            block->file_start = file_start;
+            block->file_end = file_end;
+            file_start = 0;
+            pipeline->totals->trace_bytes += block->size;
+            stats->items++;
+            publishRingSlot(&pipeline->io_ring);
+        }
+        closeTraceStream(&stream);
+    }
+
+    finishRing(&pipeline->io_ring);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->total_seconds = elapsedSeconds(&start, &end);
+    return NULL;
+}
+
+// Length of the prefix of data that holds only complete lines or records
+size_t completeTracePrefix(TraceReader* reader) {
+    const unsigned char* data = (const unsigned char*)reader->data;
+    if (!reader->binary) {
+        size_t end = reader->size;
+        while (end > reader->pos && data[end - 1] != '\n') {
+            end--;
+        }
+        return end;
+    }
+    if (!(reader->flags & BINARY_TRACE_DELTA)) {
+        return reader->pos + (reader->size - reader->pos) / 5 * 5;
+    }
+    size_t pos = reader->pos;
+    size_t complete = pos;
+    while (pos < reader->size) {
+        pos++; // header byte
+        while (pos < reader->size && (data[pos] & 0x80)) {
+            pos++;
+        }
+        if (pos >= reader->size) {
+            break;
+        }
+        complete = ++pos;
+    }
+    return complete;
+}
+
+void* pipelineDecodeMain(void* arg) {
+    TracePipeline* pipeline = (TracePipeline*)arg;
+    StageStats* stats = &pipeline->totals->stages[STAGE_DECODE];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Undecoded bytes: the tail of the previous block plus the current block
+    char* staging = (char*)malloc(2 * PIPELINE_BLOCK_SIZE);
+    size_t staged = 0;
+    int format_known = 0;
+    TraceReader view;
+    memset(&view, 0, sizeof(view));
+    view.fd = -1;
+    view.data = staging;
+
+    int slot;
+    while ((slot = takeRingSlot(&pipeline->io_ring, stats)) >= 0) {
+        IoBlock* block = &pipeline->io_blocks[slot];
+        if (block->file_start) {
+            staged = 0;
+            format_known = 0;
+            view.binary = 0;
+            view.flags = 0;
+            memset(view.last_address, 0, sizeof(view.last_address));
+        }
+        if (staged > PIPELINE_BLOCK_SIZE) {
+            staged = 0; // a "line" longer than a block is not trace data
+        }
+        memcpy(staging + staged, block->data, block->size);
+        staged += block->size;
+        int file_end = block->file_end;
+        releaseRingSlot(&pipeline->io_ring);
+
+        view.pos = 0;
+        if (!format_known && (staged >= BINARY_TRACE_HEADER_SIZE || file_end)) {
+            format_known = 1;
+            if (staged >= BINARY_TRACE_HEADER_SIZE && memcmp(staging, BINARY_TRACE_MAGIC, 8) == 0) {
+                const unsigned char* header = (const unsigned char*)staging + 8;
+                view.binary = 1;
+                view.flags = header[0] | (header[1] << 8) | (header[2] << 16) | ((unsigned int)header[3] << 24);
+                view.pos = BINARY_TRACE_HEADER_SIZE;
+            }
+        }
+        if (!format_known) {
+            continue;
+        }
+
+        view.size = staged;
+        view.size = file_end ? staged : completeTracePrefix(&view);
+        while (view.pos < view.size) {
+            RefBatch* batch = &pipeline->batches[acquireRingSlot(&pipeline->batch_ring, stats)];
+            batch->count = view.binary ? readBinaryTraceBatch(&view, batch->refs, TRACE_BATCH_SIZE)
+                                       : readTextTraceBatch(&view, batch->refs, TRACE_BATCH_SIZE);
+            if (batch->count > 0) {
+                stats->items++;
+                publishRingSlot(&pipeline->batch_ring);
+            }
+        }
+
+        memmove(staging, staging + view.pos, staged - view.pos);
+        staged -= view.pos;
+    }
+
+    free(staging);
+    finishRing(&pipeline->batch_ring);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->total_seconds = elapsedSeconds(&start, &end);
+    return NULL;
+}
+
+void replayTracesPipelined(char* trace_files[], int num_trace_files, TraceTotals* totals, BatchConsumer consume, void* context) {
+    TracePipeline* pipeline = (TracePipeline*)alignedCalloc(sizeof(TracePipeline));
+    pipeline->trace_files = trace_files;
+    pipeline->num_trace_files = num_trace_files;
+    pipeline->totals = totals;
+    initPipelineRing(&pipeline->io_ring);
+    initPipelineRing(&pipeline->batch_ring);
+    for (int i = 0; i < PIPELINE_SLOTS; i++) {
+        pipeline->io_blocks[i].data = (char*)malloc(PIPELINE_BLOCK_SIZE);
+        pipeline->batches[i].refs = (TraceReference*)malloc(TRACE_BATCH_SIZE * sizeof(TraceReference));
+    }
+    totals->pipelined = 1;
+
+    pthread_t io_thread, decode_thread;
+    pthread_create(&io_thread, NULL, pipelineIoMain, pipeline);
+    pthread_create(&decode_thread, NULL, pipelineDecodeMain, pipeline);
+
+    StageStats* stats = &totals->stages[STAGE_SIMULATE];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int slot;
+    while ((slot = takeRingSlot(&pipeline->batch_ring, stats)) >= 0) {
+        RefBatch* batch = &pipeline->batches[slot];
+        accountTraceBatch(totals, batch->refs, batch->count);
+        consume(context, batch->refs, batch->count);
+        stats->items++;
+        releaseRingSlot(&pipeline->batch_ring);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->total_seconds += elapsedSeconds(&start, &end);
+
+    pthread_join(io_thread, NULL);
+    pthread_join(decode_thread, NULL);
+    StageStats* decode = &totals->stages[STAGE_DECODE];
+    totals->parse_seconds += decode->total_seconds - decode->starved_seconds - decode->blocked_seconds;
+
+    for (int i = 0; i < PIPELINE_SLOTS; i++) {
+        free(pipeline->io_blocks[i].data);
+        free(pipeline->batches[i].refs);
+    }
+    destroyPipelineRing(&pipeline->io_ring);
+    destroyPipelineRing(&pipeline->batch_ring);
+    free(pipeline);
+}
+
+void printStageUtilization(TraceTotals* totals) {
+    const char* names[] = { "Read", "Decode", "Simulate" };
+    const char* units[] = { "blocks", "batches", "batches" };
+    printf("\n***** PIPELINE STAGE UTILIZATION *****\n");
+    printf("%10s %10s %10s %10s %12s\n", "Stage", "Busy", "Starved", "Blocked", "Items");
+    for (int i = 0; i < 3; i++) {
+        StageStats* stage = &totals->stages[i];
+        double total = stage->total_seconds > 0 ? stage->total_seconds : 1.0;
+        double busy = stage->total_seconds - stage->starved_seconds - stage->blocked_seconds;
+        printf("%10s %9.1f%% %9.1f%% %9.1f%% %8lld %s\n", names[i], busy * 100.0 / total,
+               stage->starved_seconds * 100.0 / total, stage->blocked_seconds * 100.0 / total, stage->items, units[i]);
+    }
+}
+
+// Per-trace state of an interleaved replay: each trace is a process whose
+// decoded references wait in its own batch until its next time slice
+typedef struct {
+    TraceReader reader;
+    TraceReference* batch;
+    int count;
+    int pos;
+    int done;
+} TraceProcess;
+
+// Refill a process's batch; returns 0 at the end of its trace
+int refillTraceProcess(TraceProcess* process, TraceTotals* totals) {
+    struct timespec parse_start, parse_end;
+    if (host_profile != NULL) {
+        switchProfilePhase(host_profile, PROFILE_PARSE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &parse_start);
+    process->count = readTraceBatch(&process->reader, process->batch, TRACE_BATCH_SIZE);
+    clock_gettime(CLOCK_MONOTONIC, &parse_end);
+    totals->parse_seconds += elapsedSeconds(&parse_start, &parse_end);
+    if (host_profile != NULL) {
+        // Everything between refills is the scheduler handing slices to the consumer
+        switchProfilePhase(host_profile, PROFILE_LOOKUP);
+    }
+    process->pos = 0;
+    if (process->count == 0) {
+        process->done = 1;
+        closeTraceReader(&process->reader);
+        return 0;
+    }
+    return 1;
+}
+
+// Replay the traces as processes scheduled round robin, each running
+// slice_instructions instructions (with their data references) per turn. Every
+// trace stays open with its own cursor and batch, so a switch costs nothing
+// and memory grows by one batch per trace. Every reference carries the index
+// of its trace in `process`.
+void replayTracesInterleaved(char* trace_files[], int num_trace_files, int slice_instructions, TraceTotals* totals, BatchConsumer consume, void* context) {
+    TraceProcess* processes = (TraceProcess*)calloc(num_trace_files, sizeof(TraceProcess));
+    int active = 0;
+    for (int i = 0; i < num_trace_files; i++) {
+        TraceProcess* process = &processes[i];
+        process->batch = (TraceReference*)malloc(TRACE_BATCH_SIZE * sizeof(TraceReference));
+        if (!openTraceReader(&process->reader, trace_files[i])) {
+            printf("Error opening trace file %s\n", trace_files[i]);
+            process->done = 1;
+            continue;
+        }
+        process->reader.release_chunk = INTERLEAVED_RELEASE_CHUNK;
+        totals->trace_bytes += process->reader.size;
+        if (refillTraceProcess(process, totals)) {
+            active++;
+        }
+    }
+
+    int last = -1;
+    for (int current = 0; active > 0; current = (current + 1) % num_trace_files) {
+        TraceProcess* process = &processes[current];
+        if (process->done) {
+            continue;
+        }
+        if (last >= 0 && last != current) {
+            totals->context_switches++;
+        }
+        last = current;
+
+        // Run until the instruction after the slice, or the end of the trace
+        int instructions = 0;
+        while (1) {
+            int start = process->pos;
+            int end = start;
+            while (end < process->count) {
+                if (process->batch[end].kind == REF_INSTRUCTION) {
+                    if (instructions == slice_instructions) {
+                        break;
+                    }
+                    instructions++;
+                }
+                process->batch[end].process = (unsigned short)current;
+                end++;
+            }
+            if (end > start) {
+                accountTraceBatch(totals, process->batch + start, end - start);
+                consume(context, process->batch + start, end - start);
+            }
+            process->pos = end;
+            if (end < process->count) {
+                break;
+            }
+            if (!refillTraceProcess(process, totals)) {
+                active--;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < num_trace_files; i++) {
+        free(processes[i].batch);
+    }
+    free(processes);
+}
+
+// Checkpoints (-checkpoint, -restore) hold the complete state of every
+// cache: tags, valid and dirty bits, replacement state, statistics, the
+// write buffer, and the miss classifier and prefetcher when attached. They
+// also hold the run's totals and the trace cursor, the trace being read and
+// the offset of its next reference. The serial replay writes one every
+// interval instructions and once the last trace has been read. The file is
+// replaced through a rename, so a crash leaves the previous one intact.
+// A restored run takes the caches it configures out of the checkpoint by
+// geometry, policy and options. A sweep over a shared prefix can therefore
+// be forked into runs of single configurations. The run continues at the
+// cursor: the rest of that trace, including anything appended to it since,
+// then the trace files listed after it. The traces up to the cursor must be
+// the ones the checkpoint was taken over.
+// Structs are stored as they are in memory, so a checkpoint is read back by
+// the same build of the simulator; the header records their sizes.
+#define CHECKPOINT_MAGIC "CSCHKPT1"
+
+typedef struct {
+    const char* path;           // written to, NULL when not checkpointing
+    long long interval;         // instructions between checkpoints, 0 for only the last
+    long long next_at;
+    int written;
+    CacheGroup* group;
+    char** trace_files;
+    int start_trace;            // cursor restored with -restore
+    size_t start_pos;
+    unsigned int start_last_address[3];
+} TraceCheckpoint;
+
+// Set by main when checkpointing or restoring, used by replayTraces
+static TraceCheckpoint* trace_checkpoint = NULL;
+
+// Per-cache header of a checkpoint, what a cache is matched on
+typedef struct {
+    int cache_size_kb;
+    int block_size;
+    int associativity;
+    int policy;
+    int write_back;
+    int write_allocate;
+    int write_buffer_entries;
+    int classified;
+    int prefetcher;
+    int prefetch_degree;
+} CheckpointCacheKey;
+
+void checkpointCacheKey(Cache* cache, CheckpointCacheKey* key) {
+    memset(key, 0, sizeof(*key));
+    key->cache_size_kb = cache->cache_size_kb;
+    key->block_size = cache->block_size;
+    key->associativity = cache->associativity;
+    key->policy = cache->policy;
+    key->write_back = cache->write_back;
+    key->write_allocate = cache->write_allocate;
+    key->write_buffer_entries = cache->write_buffer.entries;
+    key->classified = cache->classifier != NULL;
+    if (cache->prefetcher != NULL) {
+        key->prefetcher = cache->prefetcher->type;
+        key->prefetch_degree = cache->prefetcher->degree;
+    }
+}
+
+static inline int writeBlock(FILE* file, const void* data, size_t size) {
+    return size == 0 || fwrite(data, size, 1, file) == 1;
+}
+
+// Read size bytes into data, or skip them when data is NULL
+static inline int readBlock(FILE* file, void* data, size_t size) {
+    if (data == NULL) {
+        return fseek(file, (long)size, SEEK_CUR) == 0;
+    }
+    return size == 0 || fread(data, size, 1, file) == 1;
+}
+
+// Whether page p of the first-touch bitmap has any bit set
+static int touchedPageUsed(MissClassifier* classifier, int p) {
+    const unsigned long long* words = classifier->touched + (size_t)p * SHADOW_TOUCHED_PAGE_WORDS;
+    for (int w = 0; w < SHADOW_TOUCHED_PAGE_WORDS; w++) {
+        if (words[w] != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int writeCacheState(FILE* file, Cache* cache) {
+    CheckpointCacheKey key;
+    checkpointCacheKey(cache, &key);
+    size_t ways = (size_t)cache->total_rows * cache->associativity;
+    drainWriteLog(cache);
+    int ok = writeBlock(file, &key, sizeof(key)) && writeBlock(file, cache, sizeof(Cache)) &&
+             writeBlock(file, cache->tags, ways * sizeof(unsigned int)) &&
+             writeBlock(file, cache->valid, cache->total_rows * sizeof(unsigned short)) &&
+             writeBlock(file, cache->dirty, cache->total_rows * sizeof(unsigned short)) &&
+             writeBlock(file, cache->set_state, cache->total_rows * sizeof(unsigned long long));
+    MissClassifier* classifier = cache->classifier;
+    if (ok && classifier != NULL) {
+        // Only the pages of the first-touch bitmap with a bit set
+        int num_pages = (int)(classifier->touched_bytes / 8 / SHADOW_TOUCHED_PAGE_WORDS);
+        int pages = 0;
+        for (int p = 0; p < num_pages; p++) {
+            pages += touchedPageUsed(classifier, p);
+        }
+        ok = writeBlock(file, classifier, sizeof(MissClassifier)) && writeBlock(file, &pages, sizeof(pages));
+        for (int p = 0; ok && p < num_pages; p++) {
+            if (touchedPageUsed(classifier, p)) {
+                ok = writeBlock(file, &p, sizeof(p)) &&
+                     writeBlock(file, classifier->touched + (size_t)p * SHADOW_TOUCHED_PAGE_WORDS,
+                                SHADOW_TOUCHED_PAGE_WORDS * sizeof(unsigned long long));
+            }
+        }
+        size_t buckets = (size_t)classifier->bucket_mask + 1;
+        ok = ok && writeBlock(file, classifier->bucket_blocks, buckets * SHADOW_BUCKET_WAYS * sizeof(unsigned int)) &&
+             writeBlock(file, classifier->bucket_valid, buckets * sizeof(unsigned short)) &&
+             writeBlock(file, classifier->crossings, buckets * sizeof(unsigned int)) &&
+             writeBlock(file, classifier->links, (classifier->sentinel + (size_t)1) * sizeof(ShadowLink));
+    }
+    Prefetcher* prefetcher = cache->prefetcher;
+    if (ok && prefetcher != NULL) {
+        ok = writeBlock(file, prefetcher, sizeof(Prefetcher)) &&
+             writeBlock(file, prefetcher->prefetched, cache->total_rows * sizeof(unsigned short)) &&
+             writeBlock(file, prefetcher->pollution_filter, ((size_t)1 << POLLUTION_FILTER_BITS) * sizeof(unsigned int));
+        if (ok && prefetcher->stride_table != NULL) {
+            ok = writeBlock(file, prefetcher->stride_table, ((size_t)1 << STRIDE_TABLE_BITS) * sizeof(StrideEntry));
+        }
+    }
+    return ok;
+}
+
+// Checkpoint the group's caches with the cursor at reader's position in
+// trace number trace
+int saveCheckpoint(TraceCheckpoint* checkpoint, int trace, TraceReader* reader, TraceTotals* totals) {
+    size_t path_length = strlen(checkpoint->path);
+    char* temp_path = (char*)malloc(path_length + 5);
+    if (temp_path == NULL) {
+        return 0;
+    }
+    memcpy(temp_path, checkpoint->path, path_length);
+    memcpy(temp_path + path_length, ".tmp", 5);
+    FILE* file = fopen(temp_path, "wb");
+    if (file == NULL) {
+        printf("Unable to write checkpoint %s\n", temp_path);
+        free(temp_path);
+        return 0;
+    }
+    unsigned int sizes[4] = { sizeof(Cache), sizeof(MissClassifier), sizeof(Prefetcher), sizeof(TraceTotals) };
+    size_t pos = reader->pos;
+    int ok = writeBlock(file, CHECKPOINT_MAGIC, 8) && writeBlock(file, sizes, sizeof(sizes)) &&
+             writeBlock(file, totals, sizeof(TraceTotals)) && writeBlock(file, &trace, sizeof(trace)) &&
+             writeBlock(file, &pos, sizeof(pos)) && writeBlock(file, reader->last_address, sizeof(reader->last_address));
+    for (int t = 0; ok && t <= trace; t++) {
+        int length = (int)strlen(checkpoint->trace_files[t]);
+        ok = writeBlock(file, &length, sizeof(length)) && writeBlock(file, checkpoint->trace_files[t], length);
+    }
+    CacheGroup* group = checkpoint->group;
+    ok = ok && writeBlock(file, &group->num_caches, sizeof(group->num_caches));
+    for (int c = 0; ok && c < group->num_caches; c++) {
+        ok = writeCacheState(file, &group->caches[c]);
+    }
+    ok = fclose(file) == 0 && ok;
+    if (ok) {
+        ok = rename(temp_path, checkpoint->path) == 0;
+    }
+    if (!ok) {
+        printf("Unable to write checkpoint %s\n", checkpoint->path);
+        remove(temp_path);
+    }
+    free(temp_path);
+    checkpoint->written += ok;
+    return ok;
+}
+
+// Read one cache of a checkpoint into the first unrestored cache of the
+// group with the same key, or skip it when there is none
+int readCacheState(FILE* file, CacheGroup* group, int* restored) {
+    CheckpointCacheKey key;
+    Cache stored;
+    if (!readBlock(file, &key, sizeof(key)) || !readBlock(file, &stored, sizeof(Cache))) {
+        return 0;
+    }
+    Cache* cache = NULL;
+    for (int c = 0; c < group->num_caches && cache == NULL; c++) {
+        CheckpointCacheKey candidate;
+        checkpointCacheKey(&group->caches[c], &candidate);
+        if (!restored[c] && memcmp(&candidate, &key, sizeof(key)) == 0) {
+            cache = &group->caches[c];
+            restored[c] = 1;
+        }
+    }
+    size_t ways = (size_t)stored.total_rows * stored.associativity;
+    int ok = readBlock(file, cache ? cache->tags : NULL, ways * sizeof(unsigned int)) &&
+             readBlock(file, cache ? cache->valid : NULL, stored.total_rows * sizeof(unsigned short)) &&
+             readBlock(file, cache ? cache->dirty : NULL, stored.total_rows * sizeof(unsigned short)) &&
+             readBlock(file, cache ? cache->set_state : NULL, stored.total_rows * sizeof(unsigned long long));
+
+    if (ok && key.classified) {
+        MissClassifier stored_classifier;
+        MissClassifier* classifier = cache ? cache->classifier : NULL;
+        int pages;
+        ok = readBlock(file, &stored_classifier, sizeof(MissClassifier)) && readBlock(file, &pages, sizeof(pages));
+        if (classifier != NULL) {
+            resetMissClassifier(classifier);
+            classifier->used = stored_classifier.used;
+            classifier->last_block = stored_classifier.last_block;
+        }
+        int num_pages = (int)(stored_classifier.touched_bytes / 8 / SHADOW_TOUCHED_PAGE_WORDS);
+        for (int i = 0; ok && i < pages; i++) {
+            int p;
+            ok = readBlock(file, &p, sizeof(p)) && p >= 0 && p < num_pages;
+            ok = ok && readBlock(file, classifier ? classifier->touched + (size_t)p * SHADOW_TOUCHED_PAGE_WORDS : NULL,
+                                 SHADOW_TOUCHED_PAGE_WORDS * sizeof(unsigned long long));
+        }
+        size_t buckets = (size_t)stored_classifier.bucket_mask + 1;
+        ok = ok && readBlock(file, classifier ? classifier->bucket_blocks : NULL, buckets * SHADOW_BUCKET_WAYS * sizeof(unsigned int)) &&
+             readBlock(file, classifier ? classifier->bucket_valid : NULL, buckets * sizeof(unsigned short)) &&
+             readBlock(file, classifier ? classifier->crossings : NULL, buckets * sizeof(unsigned int)) &&
+             readBlock(file, classifier ? classifier->links : NULL, (stored_classifier.sentinel + (size_t)1) * sizeof(ShadowLink));
+    }
+
+    if (ok && key.prefetcher != PREFETCH_NONE) {
+        Prefetcher stored_prefetcher;
+        Prefetcher* prefetcher = cache ? cache->prefetcher : NULL;
+        ok = readBlock(file, &stored_prefetcher, sizeof(Prefetcher)) &&
+             readBlock(file, prefetcher ? prefetcher->prefetched : NULL, stored.total_rows * sizeof(unsigned short)) &&
+             readBlock(file, prefetcher ? prefetcher->pollution_filter : NULL, ((size_t)1 << POLLUTION_FILTER_BITS) * sizeof(unsigned int));
+        if (ok && key.prefetcher == PREFETCH_STRIDE) {
+            ok = readBlock(file, prefetcher ? prefetcher->stride_table : NULL, ((size_t)1 << STRIDE_TABLE_BITS) * sizeof(StrideEntry));
+        }
+        if (ok && prefetcher != NULL) {
+            Prefetcher live = *prefetcher;
+            *prefetcher = stored_prefetcher;
+            prefetcher->train = live.train;
+            prefetcher->probe = live.probe;
+            prefetcher->prefetched = live.prefetched;
+            prefetcher->pollution_filter = live.pollution_filter;
+            prefetcher->stride_table = live.stride_table;
+        }
+    }
+
+    if (ok && cache != NULL) {
+        // Everything but the allocations, the access function and the host
+        // prefetch distance, which follows this run's -host-prefetch
+        Cache live = *cache;
+        *cache = stored;
+        cache->access = live.access;
+        cache->tags = live.tags;
+        cache->valid = live.valid;
+        cache->dirty = live.dirty;
+        cache->set_state = live.set_state;
+        cache->classifier = live.classifier;
+        cache->prefetcher = live.prefetcher;
+        cache->host_prefetch = hostPrefetchDistance(cache);
+    }
+    return ok;
+}
+
+// Load the state of the group's caches, the totals and the trace cursor
+int restoreCheckpoint(TraceCheckpoint* checkpoint, const char* path, int num_trace_files, TraceTotals* totals) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Unable to open checkpoint %s\n", path);
+        return 0;
+    }
+    char magic[8];
+    unsigned int sizes[4];
+    unsigned int expected_sizes[4] = { sizeof(Cache), sizeof(MissClassifier), sizeof(Prefetcher), sizeof(TraceTotals) };
+    if (!readBlock(file, magic, 8) || memcmp(magic, CHECKPOINT_MAGIC, 8) != 0 ||
+        !readBlock(file, sizes, sizeof(sizes)) || memcmp(sizes, expected_sizes, sizeof(sizes)) != 0) {
+        printf("%s is not a checkpoint of this build of the simulator.\n", path);
+        fclose(file);
+        return 0;
+    }
+    TraceTotals stored_totals;
+    int ok = readBlock(file, &stored_totals, sizeof(TraceTotals)) &&
+             readBlock(file, &checkpoint->start_trace, sizeof(checkpoint->start_trace)) &&
+             readBlock(file, &checkpoint->start_pos, sizeof(checkpoint->start_pos)) &&
+             readBlock(file, checkpoint->start_last_address, sizeof(checkpoint->start_last_address));
+    const char* error = NULL;
+    if (ok && checkpoint->start_trace >= num_trace_files) {
+        error = "The checkpoint was taken over more trace files than are listed.";
+    }
+    for (int t = 0; ok && error == NULL && t <= checkpoint->start_trace; t++) {
+        int length;
+        ok = readBlock(file, &length, sizeof(length)) && length >= 0;
+        char* name = ok ? (char*)malloc((size_t)length + 1) : NULL;
+        ok = ok && name != NULL && readBlock(file, name, length);
+        if (ok) {
+            name[length] = '\0';
+            if (strcmp(name, checkpoint->trace_files[t]) != 0) {
+                error = "The checkpoint was taken over different trace files.";
+            }
+        }
+        free(name);
+    }
+    CacheGroup* group = checkpoint->group;
+    int num_stored = 0;
+    int* restored = (int*)calloc(group->num_caches, sizeof(int));
+    ok = ok && restored != NULL && readBlock(file, &num_stored, sizeof(num_stored));
+    for (int c = 0; ok && error == NULL && c < num_stored; c++) {
+        ok = readCacheState(file, group, restored);
+    }
+    for (int c = 0; ok && error == NULL && c < group->num_caches; c++) {
+        if (!restored[c]) {
+            error = "The checkpoint holds no cache with this configuration and its options.";
+        }
+    }
+    fclose(file);
+    free(restored);
+    if (!ok && error == NULL) {
+        error = "The checkpoint is truncated or corrupt.";
+    }
+    if (error != NULL) {
+        printf("%s\n", error);
+        return 0;
+    }
+    totals->inst_counter = stored_totals.inst_counter;
+    totals->instruction_bytes = stored_totals.instruction_bytes;
+    totals->src_dst_bytes = stored_totals.src_dst_bytes;
+    totals->writes = stored_totals.writes;
+    return 1;
+}
+
+// Decode each trace file once and hand every batch to consume
+// (interleaved round robin with -n, otherwise one file after another)
+void replayTraces(char* trace_files[], int num_trace_files, TraceTotals* totals, BatchConsumer consume, void* context) {
+    if (trace_time_slice > 0 && num_trace_files > 1) {
+        replayTracesInterleaved(trace_files, num_trace_files, trace_time_slice, totals, consume, context);
+        return;
+    }
+    if (trace_io_mode == TRACE_IO_PIPELINE) {
+        replayTracesPipelined(trace_files, num_trace_files, totals, consume, context);
+        return;
+    }
+    TraceReference* batch = (TraceReference*)malloc(TRACE_BATCH_SIZE * sizeof(TraceReference));
+    TraceCheckpoint* checkpoint = trace_checkpoint;
+
+    for (int i = checkpoint != NULL ? checkpoint->start_trace : 0; i < num_trace_files; ++i) {
+        TraceReader reader;
+        int opened = openTraceReader(&reader, trace_files[i]);
+        if (!opened) {
+            printf("Error opening trace file %s\n", trace_files[i]);
+        }
+        else if (checkpoint != NULL && i == checkpoint->start_trace && checkpoint->start_pos > 0) {
+            // Resume where the checkpoint left the trace
+            if (checkpoint->start_pos > reader.size) {
+                printf("Trace file %s is shorter than when it was checkpointed\n", trace_files[i]);
+                closeTraceReader(&reader);
+                opened = 0;
+            }
+            else {
+                reader.pos = checkpoint->start_pos;
+                memcpy(reader.last_address, checkpoint->start_last_address, sizeof(reader.last_address));
+            }
+        }
+        if (!opened) {
+            // Nothing of this trace ran, so the final checkpoint restarts it
+            if (checkpoint != NULL && checkpoint->path != NULL && i == num_trace_files - 1) {
+                memset(&reader, 0, sizeof(reader));
+                saveCheckpoint(checkpoint, i, &reader, totals);
+            }
+            continue; // Skip to the next trace file if unable to open
+        }
+        totals->trace_bytes += reader.size;
+
+        // Decode a batch of references, then simulate them
+        while (1) {
+            struct timespec parse_start, parse_end;
+            if (host_profile != NULL) {
+                switchProfilePhase(host_profile, PROFILE_PARSE);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &parse_start);
+            int count = readTraceBatch(&reader, batch, TRACE_BATCH_SIZE);
+            clock_gettime(CLOCK_MONOTONIC, &parse_end);
+            totals->parse_seconds += elapsedSeconds(&parse_start, &parse_end);
+            if (count == 0) {
+                break;
+            }
+
+            accountTraceBatch(totals, batch, count);
+            if (host_profile != NULL) {
+                switchProfilePhase(host_profile, PROFILE_LOOKUP);
+            }
+            consume(context, batch, count);
+            if (checkpoint != NULL && checkpoint->interval > 0 && totals->inst_counter >= checkpoint->next_at) {
+                saveCheckpoint(checkpoint, i, &reader, totals);
+                checkpoint->next_at = totals->inst_counter + checkpoint->interval;
+            }
+        }
+        if (checkpoint != NULL && checkpoint->path != NULL && i == num_trace_files - 1) {
+            saveCheckpoint(checkpoint, i, &reader, totals);
+        }
+
+        closeTraceReader(&reader);
+    }
+
+    free(batch);
+}
+
+// Sampled simulation (-sample) and warmup exclusion (-warmup), as a batch
+// consumer that sits in front of the real one and splits the reference
+// stream at instruction boundaries.
+//  - -warmup N: the first N instructions run through the caches but their
+//    statistics are dropped, so cold-start misses do not skew the results
+//  - -sample U:P: SMARTS-style systematic sampling. The last U instructions
+//    of every period of P are a measured unit; the rest keep the caches warm
+//    (functional warming) without being measured. The units give the hit
+//    rate and CPI with a 95% confidence interval, next to the same numbers
+//    for every instruction, which warming runs through the caches anyway.
+//  - -sample U:P:W: the same units, but only the W instructions before each
+//    unit warm the caches and everything else is skipped, which is what
+//    makes sampling faster. Results then cover the simulated instructions.
+// The hit rate is a ratio of sums over units of different sizes, so its
+// interval uses the ratio estimator; every unit has U instructions, so the
+// CPI is a plain mean. A consumer with state of its own outside the caches
+// (-m vm) can take the skipped references, to keep that state current, and
+// drop its statistics when the warmup ends.
+#define SAMPLE_WARMUP 0                 // -warmup instructions, not measured
+#define SAMPLE_SKIP 1                   // not simulated at all
+#define SAMPLE_WARMING 2                // simulated, not part of a unit
+#define SAMPLE_UNIT 3
+#define SAMPLE_ALL 4                    // everything after the warmup, no sampling
+#define SAMPLE_CONFIDENCE_Z 1.96
+
+typedef struct {
+    long long start_hits;
+    long long start_accesses;
+    double start_cycles;
+    double hits;                // sums over completed units
+    double accesses;
+    double hits_squared;
+    double accesses_squared;
+    double hits_accesses;
+    double cycles;
+    double cycles_squared;      // unit CPI squared
+} UnitSums;
+
+typedef struct {
+    BatchConsumer consume;      // the simulation being sampled
+    void* context;
+    BatchConsumer skip;         // given the skipped references, NULL to drop them
+    void (*clear)(void* context); // drops the consumer's statistics, may be NULL
+    CacheGroup* group;
+    long long warmup;
+    long long unit;             // 0 without sampling
+    long long period;
+    long long warming;          // instructions simulated before a unit, 0 for all
+    int phase;
+    long long phase_end;        // instruction that starts the next phase
+    long long period_start;
+    long long instructions;
+    long long units;
+    UnitSums* sums;             // per cache
+    TraceTotals excluded;       // warmup and skipped references
+} TraceSampler;
+
+static inline long long cacheAccesses(Cache* cache) {
+    return cache->cache_hits + cache->compulsory_misses + cache->capacity_misses + cache->conflict_misses;
+}
+
+// Drop everything the warmup measured
+void clearSampledStatistics(TraceSampler* sampler) {
+    for (int c = 0; c < sampler->group->num_caches; c++) {
+        drainWriteLog(&sampler->group->caches[c]);
+        clearCacheStatistics(&sampler->group->caches[c]);
+    }
+    if (sampler->clear != NULL) {
+        sampler->clear(sampler->context);
+    }
+}
+
+// Start the phase that follows the current one at instruction s->instructions
+void nextSamplePhase(TraceSampler* sampler) {
+    CacheGroup* group = sampler->group;
+    if (sampler->phase == SAMPLE_WARMUP) {
+        clearSampledStatistics(sampler);
+        sampler->period_start = sampler->instructions;
+    }
+    else if (sampler->phase == SAMPLE_UNIT) {
+        for (int c = 0; c < group->num_caches; c++) {
+            Cache* cache = &group->caches[c];
+            UnitSums* sums = &sampler->sums[c];
+            drainWriteLog(cache);
+            double hits = (double)(cache->cache_hits - sums->start_hits);
+            double accesses = (double)(cacheAccesses(cache) - sums->start_accesses);
+            double cpi = (cache->cycles - sums->start_cycles) / sampler->unit;
+            sums->hits += hits;
+            sums->accesses += accesses;
+            sums->hits_squared += hits * hits;
+            sums->accesses_squared += accesses * accesses;
+            sums->hits_accesses += hits * accesses;
+            sums->cycles += cpi;
+            sums->cycles_squared += cpi * cpi;
+        }
+        sampler->units++;
+        sampler->period_start += sampler->period;
+    }
+
+    long long unit_start = sampler->period_start + sampler->period - sampler->unit;
+    long long warm_start = sampler->warming > 0 ? unit_start - sampler->warming : sampler->period_start;
+    if (sampler->unit == 0) {
+        sampler->phase = SAMPLE_ALL;
+        sampler->phase_end = LLONG_MAX;
+    }
+    else if (sampler->instructions < warm_start) {
+        sampler->phase = SAMPLE_SKIP;
+        sampler->phase_end = warm_start;
+    }
+    else if (sampler->instructions < unit_start) {
+        sampler->phase = SAMPLE_WARMING;
+        sampler->phase_end = unit_start;
+    }
+    else {
+        for (int c = 0; c < group->num_caches; c++) {
+            Cache* cache = &group->caches[c];
+            drainWriteLog(cache);
+            sampler->sums[c].start_hits = cache->cache_hits;
+            sampler->sums[c].start_accesses = cacheAccesses(cache);
+            sampler->sums[c].start_cycles = cache->cycles;
+        }
+        sampler->phase = SAMPLE_UNIT;
+        sampler->phase_end = sampler->period_start + sampler->period;
+    }
+}
+
+// Hand references [first, end) of the batch on according to the phase
+static inline void flushSampledReferences(TraceSampler* sampler, TraceReference* batch, int first, int end) {
+    if (end == first) {
+        return;
+    }
+    if (sampler->phase == SAMPLE_WARMUP || sampler->phase == SAMPLE_SKIP) {
+        accountTraceBatch(&sampler->excluded, batch + first, end - first);
+    }
+    if (sampler->phase != SAMPLE_SKIP) {
+        sampler->consume(sampler->context, batch + first, end - first);
+    }
+    else if (sampler->skip != NULL) {
+        sampler->skip(sampler->context, batch + first, end - first);
+    }
+}
+
+void sampleTraceBatch(void* context, TraceReference* batch, int count) {
+    TraceSampler* sampler = (TraceSampler*)context;
+    int first = 0;
+    for (int j = 0; j < count; j++) {
+        if (batch[j].kind != REF_INSTRUCTION) {
+            continue;
+        }
+        // A phase changes at the fetch of its first instruction, so the data
+        // references of an instruction stay with it
+        while (sampler->instructions == sampler->phase_end) {
+            flushSampledReferences(sampler, batch, first, j);
+            first = j;
+            nextSamplePhase(sampler);
+        }
+        sampler->instructions++;
+    }
+    flushSampledReferences(sampler, batch, first, count);
+}
+
+int createTraceSampler(TraceSampler* sampler, CacheGroup* group, BatchConsumer consume, void* context,
+                       long long warmup, long long unit, long long period, long long warming) {
+    memset(sampler, 0, sizeof(*sampler));
+    sampler->sums = (UnitSums*)calloc(group->num_caches, sizeof(UnitSums));
+    if (sampler->sums == NULL) {
+        return 0;
+    }
+    sampler->consume = consume;
+    sampler->context = context;
+    sampler->group = group;
+    sampler->warmup = warmup;
+    sampler->unit = unit;
+    sampler->period = period;
+    sampler->warming = warming;
+    sampler->phase = SAMPLE_WARMUP;
+    sampler->phase_end = warmup;
+    return 1;
+}
+
+// Take the warmup and skipped references out of the run's totals, so the
+// CPI and per-instruction traffic cover what was measured
+void finishTraceSampler(TraceSampler* sampler, TraceTotals* totals) {
+    if (sampler->phase == SAMPLE_WARMUP) {
+        // The traces ended during the warmup: nothing was measured
+        clearSampledStatistics(sampler);
+    }
+    else if (sampler->phase == SAMPLE_UNIT && sampler->instructions == sampler->phase_end) {
+        // The traces ended with the last instruction of a unit, which only
+        // closes when the next instruction arrives
+        nextSamplePhase(sampler);
+    }
+    totals->inst_counter -= sampler->excluded.inst_counter;
+    totals->instruction_bytes -= sampler->excluded.instruction_bytes;
+    totals->src_dst_bytes -= sampler->excluded.src_dst_bytes;
+    totals->writes -= sampler->excluded.writes;
+}
+
+// Interval statistics (-interval, -stats): every interval of instructions,
+// each cache's hits, misses by class, CPI and occupancy (valid blocks) over
+// that interval. Like the sampler, the recorder is a batch consumer in front
+// of the simulation that cuts batches at instruction boundaries. At each
+// boundary it takes the difference of the cumulative counters, so the lookup
+// loop is untouched. Records go over a single-producer single-consumer ring
+// to a writer thread, which formats CSV or appends them to a binary file
+// (STATS_BINARY_MAGIC, the record size, then IntervalRecord structs). The
+// simulation only waits when the writer falls a whole ring behind.
+#define STATS_RING_SIZE 4096
+#define STATS_FORMAT_CSV 0
+#define STATS_FORMAT_BINARY 1
+#define STATS_BINARY_MAGIC "CSSTATS1"
+#define STATS_WRITER_PAUSE_NS 1000000   // writer sleep when the ring is empty
+
+typedef struct {
+    long long interval;
+    long long end_instruction;  // instructions replayed when the interval ended
+    int cache;                  // configuration index, in sweep order
+    int cache_size_kb;
+    int block_size;
+    int associativity;
+    int policy;
+    long long instructions;
+    long long accesses;
+    long long hits;
+    long long compulsory_misses;
+    long long capacity_misses;
+    long long conflict_misses;
+    double cycles;
+    long long occupied_blocks;
+    long long total_blocks;
+} IntervalRecord;
+
+typedef struct {
+    _Alignas(HOST_CACHE_LINE) atomic_size_t head;
+    _Alignas(HOST_CACHE_LINE) atomic_size_t tail;
+    _Alignas(HOST_CACHE_LINE) atomic_int done;
+    IntervalRecord* records;
+    FILE* file;
+    int format;
+    int failed;                 // a write failed; set by the writer, read after the join
+    pthread_t thread;
+} StatsSink;
+
+typedef struct {
+    BatchConsumer consume;      // the simulation being recorded
+    void* context;
+    CacheGroup* group;
+    long long length;
+    long long instructions;
+    long long interval_start;
+    long long intervals;
+    IntervalRecord* start;      // per cache, counters when the interval began
+    StatsSink sink;
+} IntervalRecorder;
+
+// Returns 0 when the record could not be written
+int writeIntervalRecord(StatsSink* sink, IntervalRecord* record) {
+    if (sink->format == STATS_FORMAT_BINARY) {
+        return fwrite(record, sizeof(*record), 1, sink->file) == 1;
+    }
+    long long misses = record->compulsory_misses + record->capacity_misses + record->conflict_misses;
+    return fprintf(sink->file, "%lld,%lld,%d,%d,%d,%s,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%.4f,%.4f,%.4f\n",
+            record->interval, record->end_instruction, record->cache_size_kb, record->block_size,
+            record->associativity, policy_names[record->policy], record->instructions, record->accesses,
+            record->hits, misses, record->compulsory_misses, record->capacity_misses, record->conflict_misses,
+            record->accesses > 0 ? record->hits * 100.0 / record->accesses : 0.0,
+            record->instructions > 0 ? record->cycles / record->instructions : 0.0,
+            record->occupied_blocks * 100.0 / record->total_blocks) >= 0;
+}
+
+void* statsWriterMain(void* arg) {
+    StatsSink* sink = (StatsSink*)arg;
+    size_t head = atomic_load_explicit(&sink->head, memory_order_relaxed);
+    while (1) {
+        size_t tail = atomic_load_explicit(&sink->tail, memory_order_acquire);
+        if (tail == head) {
+            if (atomic_load_explicit(&sink->done, memory_order_acquire) &&
+                atomic_load_explicit(&sink->tail, memory_order_acquire) == head) {
+                break;
+            }
+            struct timespec pause = { 0, STATS_WRITER_PAUSE_NS };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        // After a failed write the records are still taken off the ring, so
+        // the simulation never waits on a writer that has given up
+        for (; head != tail; head++) {
+            if (!sink->failed && !writeIntervalRecord(sink, &sink->records[head & (STATS_RING_SIZE - 1)])) {
+                sink->failed = 1;
+            }
+        }
+        atomic_store_explicit(&sink->head, head, memory_order_release);
+    }
+    return NULL;
+}
+
+void pushIntervalRecord(StatsSink* sink, IntervalRecord* record) {
+    size_t tail = atomic_load_explicit(&sink->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&sink->head, memory_order_acquire) == STATS_RING_SIZE) {
+        sched_yield();
+    }
+    sink->records[tail & (STATS_RING_SIZE - 1)] = *record;
+    atomic_store_explicit(&sink->tail, tail + 1, memory_order_release);
+}
+
+// The cumulative counters of a cache, in the fields of an interval record
+void readIntervalCounters(Cache* cache, IntervalRecord* counters) {
+    drainWriteLog(cache);
+    counters->accesses = cacheAccesses(cache);
+    counters->hits = cache->cache_hits;
+    counters->compulsory_misses = cache->compulsory_misses;
+    counters->capacity_misses = cache->capacity_misses;
+    counters->conflict_misses = cache->conflict_misses;
+    counters->cycles = cache->cycles;
+}
+
+// Close the current interval at instruction recorder->instructions
+void endInterval(IntervalRecorder* recorder) {
+    long long instructions = recorder->instructions - recorder->interval_start;
+    if (instructions == 0) {
+        return;
+    }
+    for (int c = 0; c < recorder->group->num_caches; c++) {
+        Cache* cache = &recorder->group->caches[c];
+        IntervalRecord* start = &recorder->start[c];
+        IntervalRecord now;
+        readIntervalCounters(cache, &now);
+        IntervalRecord record;
+        memset(&record, 0, sizeof(record));
+        record.interval = recorder->intervals;
+        record.end_instruction = recorder->instructions;
+        record.cache = c;
+        record.cache_size_kb = cache->cache_size_kb;
+        record.block_size = cache->block_size;
+        record.associativity = cache->associativity;
+        record.policy = cache->policy;
+        record.instructions = instructions;
+        record.accesses = now.accesses - start->accesses;
+        record.hits = now.hits - start->hits;
+        record.compulsory_misses = now.compulsory_misses - start->compulsory_misses;
+        record.capacity_misses = now.capacity_misses - start->capacity_misses;
+        record.conflict_misses = now.conflict_misses - start->conflict_misses;
+        record.cycles = now.cycles - start->cycles;
+        record.occupied_blocks = 0;
+        for (int set = 0; set < cache->total_rows; set++) {
+            record.occupied_blocks += __builtin_popcount(cache->valid[set]);
+        }
+        record.total_blocks = (long long)cache->total_rows * cache->associativity;
+        pushIntervalRecord(&recorder->sink, &record);
+        *start = now;
+    }
+    recorder->intervals++;
+    recorder->interval_start = recorder->instructions;
+}
+
+void recordIntervalBatch(void* context, TraceReference* batch, int count) {
+    IntervalRecorder* recorder = (IntervalRecorder*)context;
+    long long next_end = recorder->interval_start + recorder->length;
+    int first = 0;
+    for (int j = 0; j < count; j++) {
+        if (batch[j].kind != REF_INSTRUCTION) {
+            continue;
+        }
+        if (recorder->instructions == next_end) {
+            recorder->consume(recorder->context, batch + first, j - first);
+            first = j;
+            endInterval(recorder);
+            next_end = recorder->interval_start + recorder->length;
+        }
+        recorder->instructions++;
+    }
+    if (count > first) {
+        recorder->consume(recorder->context, batch + first, count - first);
+    }
+}
+
+// Open the sink and start its writer. The recorder starts counting at
+// instructions already replayed, which is not 0 after -restore.
+int createIntervalRecorder(IntervalRecorder* recorder, CacheGroup* group, BatchConsumer consume, void* context,
+                           long long length, long long instructions, const char* path, int format) {
+    memset(recorder, 0, sizeof(*recorder));
+    recorder->consume = consume;
+    recorder->context = context;
+    recorder->group = group;
+    recorder->length = length;
+    recorder->instructions = instructions;
+    recorder->interval_start = instructions;
+    recorder->start = (IntervalRecord*)calloc(group->num_caches, sizeof(IntervalRecord));
+    recorder->sink.records = (IntervalRecord*)malloc(STATS_RING_SIZE * sizeof(IntervalRecord));
+    recorder->sink.file = fopen(path, format == STATS_FORMAT_BINARY ? "wb" : "w");
+    recorder->sink.format = format;
+    if (recorder->start == NULL || recorder->sink.records == NULL || recorder->sink.file == NULL) {
+        if (recorder->sink.file != NULL) {
+            fclose(recorder->sink.file);
+        }
+        free(recorder->start);
+        free(recorder->sink.records);
+        return 0;
+    }
+    for (int c = 0; c < group->num_caches; c++) {
+        readIntervalCounters(&group->caches[c], &recorder->start[c]);
+    }
+    int ok;
+    if (format == STATS_FORMAT_BINARY) {
+        unsigned int record_size = sizeof(IntervalRecord);
+        ok = fwrite(STATS_BINARY_MAGIC, 8, 1, recorder->sink.file) == 1 &&
+             fwrite(&record_size, sizeof(record_size), 1, recorder->sink.file) == 1;
+    }
+    else {
+        ok = fprintf(recorder->sink.file, "interval,end_instruction,size_kb,block,assoc,policy,instructions,accesses,hits,"
+                                          "misses,compulsory,capacity,conflict,hit_rate,cpi,occupancy\n") >= 0;
+    }
+    atomic_init(&recorder->sink.head, 0);
+    atomic_init(&recorder->sink.tail, 0);
+    atomic_init(&recorder->sink.done, 0);
+    if (!ok || pthread_create(&recorder->sink.thread, NULL, statsWriterMain, &recorder->sink) != 0) {
+        fclose(recorder->sink.file);
+        free(recorder->start);
+        free(recorder->sink.records);
+        return 0;
+    }
+    return 1;
+}
+
+// Close the last, partial interval and wait for the writer to finish;
+// returns 0 when any record could not be written
+int finishIntervalRecorder(IntervalRecorder* recorder) {
+    endInterval(recorder);
+    atomic_store_explicit(&recorder->sink.done, 1, memory_order_release);
+    pthread_join(recorder->sink.thread, NULL);
+    int ok = fclose(recorder->sink.file) == 0 && !recorder->sink.failed;
+    free(recorder->start);
+    free(recorder->sink.records);
+    return ok;
+}
+
+// -m vm: the traces run as processes, switched round robin every -n
+// instructions, on a machine with -p MB of physical memory of which -u percent
+// belongs to the system. Every reference is translated before it reaches the
+// caches, which then see physical addresses:
+//  - a TLB tagged with the process, so context switches do not flush it
+//  - on a TLB miss, a walk of the process's two-level radix page table
+//    (10 + 10 bits of virtual page number), whose second-level tables are
+//    allocated the first time a process touches their 4 MB of address space
+//  - on a page fault, a free user frame, or the victim of a clock (second
+//    chance) sweep over all user frames; the victim's mapping and TLB entry
+//    are dropped
+// The statistics start after -warmup. A -sample run still translates the
+// references it skips, so they cover every instruction after the warmup.
+#define PAGE_OFFSET_BITS 12
+#define PAGE_SIZE (1u << PAGE_OFFSET_BITS)
+#define PAGE_TABLE_BITS 10
+#define PAGE_TABLE_ENTRIES (1u << PAGE_TABLE_BITS)
+#define PAGE_WALK_LEVELS 2
+#define PAGE_WALK_CYCLES_PER_LEVEL 20
+#define DEFAULT_TLB_ENTRIES 64
+#define DEFAULT_TLB_ASSOCIATIVITY 4
+#define FRAME_FREE 0xffffu
+
+typedef struct {
+    unsigned int** tables;      // [vpn >> PAGE_TABLE_BITS], entries hold frame + 1, 0 when not present
+    int num_tables;
+    long long instructions;
+    long long references;
+    long long page_faults;
+    long long tlb_misses;
+    long long resident_pages;
+} ProcessSpace;
+
+typedef struct {
+    unsigned short owner;       // process, FRAME_FREE when unused
+    unsigned char referenced;   // clock bit
+    unsigned int vpn;
+} FrameEntry;
+
+typedef struct {
+    int tlb_entries;
+    int tlb_associativity;
+    unsigned int tlb_set_mask;
+    unsigned int* tlb_pages;    // [set * associativity + way]: vpn
+    unsigned short* tlb_processes;
+    unsigned int* tlb_frames;
+    unsigned short* tlb_valid;
+    unsigned long long* tlb_state; // LRU recency per set
+
+    ProcessSpace* processes;
+    int num_processes;
+    FrameEntry* frames;
+    unsigned int num_frames;
+    unsigned int first_frame;   // frames below belong to the system
+    unsigned int used_frames;
+    unsigned int clock_hand;
+
+    // Statistics
+    long long tlb_hits;
+    long long tlb_misses;
+    long long page_faults;
+    long long evictions;
+    long long context_switches;
+    long long page_splits;
+
+    CacheGroup* caches;         // fed with the translated references
+    TraceReference* physical;
+} VirtualMemory;
+
+// 4 KB pages in -p MB of physical memory, and those -u percent of them the
+// system keeps
+int physicalPages(int physical_memory_mb) {
+    return physical_memory_mb * (1024 / (PAGE_SIZE / 1024));
+}
+
+int systemPages(int physical_memory_mb, int percent_mem_used) {
+    return physicalPages(physical_memory_mb) * ((double)percent_mem_used / 100);
+}
+
+int createVirtualMemory(VirtualMemory* vm, int num_processes, int physical_pages, int system_pages, int tlb_entries, int tlb_associativity) {
+    memset(vm, 0, sizeof(*vm));
+    vm->tlb_entries = tlb_entries;
+    vm->tlb_associativity = tlb_associativity;
+    vm->tlb_set_mask = (unsigned int)(tlb_entries / tlb_associativity) - 1;
+    vm->tlb_pages = (unsigned int*)calloc(tlb_entries, sizeof(unsigned int));
+    vm->tlb_processes = (unsigned short*)calloc(tlb_entries, sizeof(unsigned short));
+    vm->tlb_frames = (unsigned int*)calloc(tlb_entries, sizeof(unsigned int));
+    vm->tlb_valid = (unsigned short*)calloc(tlb_entries / tlb_associativity, sizeof(unsigned short));
+    vm->tlb_state = (unsigned long long*)calloc(tlb_entries / tlb_associativity, sizeof(unsigned long long));
+    vm->processes = (ProcessSpace*)calloc(num_processes, sizeof(ProcessSpace));
+    vm->num_processes = num_processes;
+    vm->num_frames = (unsigned int)(physical_pages - system_pages);
+    vm->first_frame = (unsigned int)system_pages;
+    vm->frames = (FrameEntry*)malloc(vm->num_frames * sizeof(FrameEntry));
+    vm->physical = (TraceReference*)malloc(2 * TRACE_BATCH_SIZE * sizeof(TraceReference));
+    if (vm->tlb_pages == NULL || vm->tlb_processes == NULL || vm->tlb_frames == NULL || vm->tlb_valid == NULL || vm->tlb_state == NULL ||
+        vm->processes == NULL || vm->frames == NULL || vm->physical == NULL) {
+        return 0;
+    }
+    for (int set = 0; set <= (int)vm->tlb_set_mask; set++) {
+        vm->tlb_state[set] = initialWayOrder(tlb_associativity);
+    }
+    for (unsigned int f = 0; f < vm->num_frames; f++) {
+        vm->frames[f].owner = FRAME_FREE;
+    }
+    for (int p = 0; p < num_processes; p++) {
+        vm->processes[p].tables = (unsigned int**)calloc((size_t)1 << (32 - PAGE_OFFSET_BITS - PAGE_TABLE_BITS), sizeof(unsigned int*));
+        if (vm->processes[p].tables == NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void freeVirtualMemory(VirtualMemory* vm) {
+    if (vm->processes != NULL) {
+        for (int p = 0; p < vm->num_processes; p++) {
+            ProcessSpace* space = &vm->processes[p];
+            if (space->tables == NULL) {
+                continue;
+            }
+            for (unsigned int t = 0; t < (1u << (32 - PAGE_OFFSET_BITS - PAGE_TABLE_BITS)); t++) {
+                free(space->tables[t]);
+            }
+            free(space->tables);
+        }
+    }
+    free(vm->processes);
+    free(vm->tlb_pages);
+    free(vm->tlb_processes);
+    free(vm->tlb_frames);
+    free(vm->tlb_valid);
+    free(vm->tlb_state);
+    free(vm->frames);
+    free(vm->physical);
+}
+
+// Way of the TLB set holding the translation of vpn for process, -1 if none
+static inline int findTlbWay(VirtualMemory* vm, unsigned int set, int process, unsigned int vpn) {
+    size_t base = (size_t)set * vm->tlb_associativity;
+    unsigned int valid = vm->tlb_valid[set];
+    for (int way = 0; way < vm->tlb_associativity; way++) {
+        if ((valid >> way & 1) && vm->tlb_pages[base + way] == vpn && vm->tlb_processes[base + way] == process) {
+            return way;
+        }
+    }
+    return -1;
+}
+
+// Spread the processes' identical low pages over the sets
+static inline unsigned int tlbSet(VirtualMemory* vm, int process, unsigned int vpn) {
+    return (vpn ^ ((unsigned int)process * 0x9e3779b1u >> 16)) & vm->tlb_set_mask;
+}
+
+// Page table entry of vpn, allocating its second-level table when needed
+static inline unsigned int* pageTableEntry(ProcessSpace* space, unsigned int vpn) {
+    unsigned int** table = &space->tables[vpn >> PAGE_TABLE_BITS];
+    if (*table == NULL) {
+        *table = (unsigned int*)calloc(PAGE_TABLE_ENTRIES, sizeof(unsigned int));
+        space->num_tables++;
+    }
+    return &(*table)[vpn & (PAGE_TABLE_ENTRIES - 1)];
+}
+
+void invalidateTlbEntry(VirtualMemory* vm, int process, unsigned int vpn) {
+    unsigned int set = tlbSet(vm, process, vpn);
+    int way = findTlbWay(vm, set, process, vpn);
+    if (way >= 0) {
+        vm->tlb_valid[set] &= (unsigned short)~(1u << way);
+    }
+}
+
+// A user frame for a faulting page: a free one, or the clock victim
+unsigned int allocateFrame(VirtualMemory* vm) {
+    if (vm->used_frames < vm->num_frames) {
+        return vm->used_frames++;
+    }
+    while (vm->frames[vm->clock_hand].referenced) {
+        vm->frames[vm->clock_hand].referenced = 0;
+        vm->clock_hand = (vm->clock_hand + 1) % vm->num_frames;
+    }
+    unsigned int frame = vm->clock_hand;
+    vm->clock_hand = (vm->clock_hand + 1) % vm->num_frames;
+
+    FrameEntry* victim = &vm->frames[frame];
+    ProcessSpace* owner = &vm->processes[victim->owner];
+    *pageTableEntry(owner, victim->vpn) = 0;
+    owner->resident_pages--;
+    invalidateTlbEntry(vm, victim->owner, victim->vpn);
+    vm->evictions++;
+    return frame;
+}
+
+// Physical address of a reference
+static inline unsigned int translateAddress(VirtualMemory* vm, TraceReference* ref) {
+    int process = ref->process;
+    unsigned int vpn = ref->address >> PAGE_OFFSET_BITS;
+    unsigned int set = tlbSet(vm, process, vpn);
+    size_t base = (size_t)set * vm->tlb_associativity;
+    unsigned int frame;
+
+    int way = findTlbWay(vm, set, process, vpn);
+    if (way >= 0) {
+        replacementHit(&vm->tlb_state[set], way, vm->tlb_associativity, POLICY_LRU);
+        vm->tlb_hits++;
+        frame = vm->tlb_frames[base + way];
+    }
+    else {
+        ProcessSpace* space = &vm->processes[process];
+        vm->tlb_misses++;
+        space->tlb_misses++;
+        unsigned int* entry = pageTableEntry(space, vpn);
+        if (*entry == 0) {
+            frame = allocateFrame(vm);
+            vm->frames[frame].owner = (unsigned short)process;
+            vm->frames[frame].vpn = vpn;
+            *entry = frame + 1;
+            vm->page_faults++;
+            space->page_faults++;
+            space->resident_pages++;
+        }
+        else {
+            frame = *entry - 1;
+        }
+        way = chooseFillWay(&vm->tlb_state[set], vm->tlb_valid[set], vm->tlb_associativity, POLICY_LRU);
+        replacementFill(&vm->tlb_state[set], way, vm->tlb_associativity, POLICY_LRU);
+        vm->tlb_valid[set] |= (unsigned short)(1u << way);
+        vm->tlb_pages[base + way] = vpn;
+        vm->tlb_processes[base + way] = (unsigned short)process;
+        vm->tlb_frames[base + way] = frame;
+    }
+    vm->frames[frame].referenced = 1;
+    return ((vm->first_frame + frame) << PAGE_OFFSET_BITS) | (ref->address & (PAGE_SIZE - 1));
+}
+
+// A reference that crosses into the next page is translated as two, so
+// the physical batch holds up to twice as many references; returns how many
+int translateVirtualBatch(VirtualMemory* vm, TraceReference* batch, int count) {
+    int physical_count = 0;
+    for (int j = 0; j < count; j++) {
+        ProcessSpace* space = &vm->processes[batch[j].process];
+        space->references++;
+        space->instructions += batch[j].kind == REF_INSTRUCTION;
+        TraceReference* ref = &vm->physical[physical_count++];
+        *ref = batch[j];
+        ref->address = translateAddress(vm, &batch[j]);
+        if (extraBlocks(&batch[j], PAGE_OFFSET_BITS) != 0) {
+            TraceReference tail = batch[j];
+            tail.address = (batch[j].address | (PAGE_SIZE - 1)) + 1;
+            tail.length = (unsigned char)(referenceEnd(&batch[j]) - tail.address + 1);
+            ref->length = (unsigned char)(tail.address - batch[j].address);
+            vm->page_splits++;
+            vm->physical[physical_count] = tail;
+            vm->physical[physical_count++].address = translateAddress(vm, &tail);
+        }
+    }
+    return physical_count;
+}
+
+void simulateVirtualBatch(void* context, TraceReference* batch, int count) {
+    VirtualMemory* vm = (VirtualMemory*)context;
+    simulateCacheBatch(vm->caches, vm->physical, translateVirtualBatch(vm, batch, count));
+}
+
+// References a sampled run skips still move the TLB and the page tables
+void skipVirtualBatch(void* context, TraceReference* batch, int count) {
+    translateVirtualBatch((VirtualMemory*)context, batch, count);
+}
+
+// Drop the statistics, keeping the TLB, page tables and frames
+void clearVirtualMemoryStatistics(void* context) {
+    VirtualMemory* vm = (VirtualMemory*)context;
+    vm->tlb_hits = 0;
+    vm->tlb_misses = 0;
+    vm->page_faults = 0;
+    vm->evictions = 0;
+    vm->page_splits = 0;
+    for (int p = 0; p < vm->num_processes; p++) {
+        vm->processes[p].instructions = 0;
+        vm->processes[p].references = 0;
+        vm->processes[p].page_faults = 0;
+        vm->processes[p].tlb_misses = 0;
+    }
+}
+
+void printVirtualMemoryResults(VirtualMemory* vm, char* trace_files[], int slice_instructions) {
+    long long lookups = vm->tlb_hits + vm->tlb_misses;
+    long long table_bytes = 0;
+    for (int p = 0; p < vm->num_processes; p++) {
+        table_bytes += (long long)PAGE_TABLE_ENTRIES * sizeof(unsigned int) * (1 + vm->processes[p].num_tables);
+    }
+
+    printf("\n***** VIRTUAL MEMORY SIMULATION *****\n");
+    printf("Processes: %d\t Time Slice: %d instructions\t Context Switches: %lld\n", vm->num_processes, slice_instructions, vm->context_switches);
+    printf("Page Size: %u bytes\t User Frames: %u\t Frames Used: %u\n", PAGE_SIZE, vm->num_frames, vm->used_frames);
+    printf("TLB: %d entries, %d-way, LRU, tagged by process\n", vm->tlb_entries, vm->tlb_associativity);
+    printf("TLB Hits: %lld\t TLB Misses: %lld\n", vm->tlb_hits, vm->tlb_misses);
+    printf("TLB Hit Rate: %.4f%%\n", lookups > 0 ? vm->tlb_hits * 100.0 / lookups : 0.0);
+    printf("Page Table Walks: %lld\t Walk Cycles: %lld (%d levels x %d cycles)\n", vm->tlb_misses,
+           vm->tlb_misses * PAGE_WALK_LEVELS * PAGE_WALK_CYCLES_PER_LEVEL, PAGE_WALK_LEVELS, PAGE_WALK_CYCLES_PER_LEVEL);
+    printf("Page Faults: %lld\t Pages Evicted: %lld\n", vm->page_faults, vm->evictions);
+    printf("References Crossing Pages: %lld\n", vm->page_splits);
+    printf("Page Table Memory: %lld bytes\n", table_bytes);
+    printf("%8s %12s %12s %12s %12s %12s  %s\n", "Process", "Instructions", "References", "TLBMisses", "PageFaults", "Resident", "Trace");
+    for (int p = 0; p < vm->num_processes; p++) {
+        ProcessSpace* space = &vm->processes[p];
+        printf("%8d %12lld %12lld %12lld %12lld %12lld  %s\n", p, space->instructions, space->references,
+               space->tlb_misses, space->page_faults, space->resident_pages, trace_files[p]);
+    }
+}
+
+// Mattson stack-distance engine. One pass yields LRU hit counts for every
+// capacity at a fixed block size:
+//  - fully associative: the distance of an access is the number of distinct
+//    blocks touched since the previous access to the same block. A hash map
+//    keeps each block's last access time and a Fenwick tree over time marks
+//    the most recent access of every block, so a distance is one range count,
+//    O(log n).
+//  - set associative: for every power-of-two set count each set keeps its
+//    MAX_ASSOCIATIVITY most recent blocks. The position of a block in its set
+//    stack is the smallest associativity that hits, which covers every
+//    associativity at that set count at once.
+#define STACK_MIN_TIMELINE (1u << 20)
+#define STACK_EMPTY_KEY 0xffffffffu
+#define STACK_NUM_CAPACITIES 11 // 8 KB ... 8 MB
+
+typedef struct {
+    int set_bits;
+    unsigned int* blocks;        // [set * MAX_ASSOCIATIVITY + position], most recent first
+    unsigned char* depth;        // valid entries per set
+    long long hits[MAX_ASSOCIATIVITY];
+} StackLevel;
+
+typedef struct {
+    int block_size;
+    int offset_bits;
+    long long accesses;
+
+    // Fully associative stack
+    unsigned int* keys;          // block numbers, STACK_EMPTY_KEY when free
+    unsigned int* last_time;
+    unsigned int table_mask;
+    unsigned int num_blocks;
+    unsigned int* fenwick;       // 1-based, counts live marks per time slot
+    unsigned int timeline;       // Fenwick size
+    unsigned int now;
+    long long fa_hits[STACK_NUM_CAPACITIES];
+
+    // Set associative stacks, one per set count
+    int min_set_bits;
+    int num_levels;
+    StackLevel* levels;
+} StackDistanceEngine;
+
+static inline unsigned int hashBlock(unsigned int block) {
+    return block * 0x9e3779b1u;
+}
+
+static inline void fenwickAdd(unsigned int* tree, unsigned int size, unsigned int index, int delta) {
+    for (index++; index <= size; index += index & (0u - index)) {
+        tree[index] += delta;
+    }
+}
+
+// Sum of marks in time slots [0, index)
+static inline unsigned int fenwickPrefix(unsigned int* tree, unsigned int index) {
+    unsigned int sum = 0;
+    for (; index > 0; index -= index & (0u - index)) {
+        sum += tree[index];
+    }
+    return sum;
+}
+
+int createStackDistanceEngine(StackDistanceEngine* engine, int block_size) {
+    memset(engine, 0, sizeof(*engine));
+    engine->block_size = block_size;
+    engine->offset_bits = log2Int(block_size);
+
+    engine->table_mask = (1u << 16) - 1;
+    engine->keys = (unsigned int*)malloc((engine->table_mask + 1) * sizeof(unsigned int));
+    engine->last_time = (unsigned int*)malloc((engine->table_mask + 1) * sizeof(unsigned int));
+    engine->timeline = STACK_MIN_TIMELINE;
+    engine->fenwick = (unsigned int*)calloc(engine->timeline + 1, sizeof(unsigned int));
+    if (engine->keys == NULL || engine->last_time == NULL || engine->fenwick == NULL) {
+        return 0;
+    }
+    memset(engine->keys, 0xff, (engine->table_mask + 1) * sizeof(unsigned int));
+
+    // Set counts whose capacities reach 8 KB..8 MB for some associativity
+    int max_set_bits = log2Int(MAX_CACHE_SIZE * 1024 / block_size);
+    engine->min_set_bits = log2Int(MIN_CACHE_SIZE * 1024 / (block_size * MAX_ASSOCIATIVITY));
+    if (engine->min_set_bits < 0) {
+        engine->min_set_bits = 0;
+    }
+    engine->num_levels = max_set_bits - engine->min_set_bits + 1;
+    engine->levels = (StackLevel*)calloc(engine->num_levels, sizeof(StackLevel));
+    if (engine->levels == NULL) {
+        return 0;
+    }
+    for (int l = 0; l < engine->num_levels; l++) {
+        StackLevel* level = &engine->levels[l];
+        size_t sets = (size_t)1 << (engine->min_set_bits + l);
+        level->set_bits = engine->min_set_bits + l;
+        level->blocks = (unsigned int*)alignedCalloc(sets * MAX_ASSOCIATIVITY * sizeof(unsigned int));
+        level->depth = (unsigned char*)alignedCalloc(sets);
+        if (level->blocks == NULL || level->depth == NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void freeStackDistanceEngine(StackDistanceEngine* engine) {
+    free(engine->keys);
+    free(engine->last_time);
+    free(engine->fenwick);
+    if (engine->levels != NULL) {
+        for (int l = 0; l < engine->num_levels; l++) {
+            free(engine->levels[l].blocks);
+            free(engine->levels[l].depth);
+        }
+        free(engine->levels);
+    }
+}
+
+// Slot of block in the hash map, or of the free slot where it belongs
+static inline unsigned int findBlockSlot(StackDistanceEngine* engine, unsigned int block) {
+    unsigned int slot = hashBlock(block) & engine->table_mask;
+    while (engine->keys[slot] != block && engine->keys[slot] != STACK_EMPTY_KEY) {
+        slot = (slot + 1) & engine->table_mask;
+    }
+    return slot;
+}
+
+void growBlockTable(StackDistanceEngine* engine) {
+    unsigned int old_size = engine->table_mask + 1;
+    unsigned int* old_keys = engine->keys;
+    unsigned int* old_times = engine->last_time;
+    engine->table_mask = old_size * 2 - 1;
+    engine->keys = (unsigned int*)malloc(old_size * 2 * sizeof(unsigned int));
+    engine->last_time = (unsigned int*)malloc(old_size * 2 * sizeof(unsigned int));
+    memset(engine->keys, 0xff, old_size * 2 * sizeof(unsigned int));
+    for (unsigned int i = 0; i < old_size; i++) {
+        if (old_keys[i] != STACK_EMPTY_KEY) {
+            unsigned int slot = findBlockSlot(engine, old_keys[i]);
+            engine->keys[slot] = old_keys[i];
+            engine->last_time[slot] = old_times[i];
+        }
+    }
+    free(old_keys);
+    free(old_times);
+}
+
+static int compareTimes(const void* a, const void* b) {
+    unsigned int x = **(unsigned int* const*)a;
+    unsigned int y = **(unsigned int* const*)b;
+    return (x > y) - (x < y);
+}
+
+// The timeline is full: renumber the live blocks 0..num_blocks-1 in access
+// order and rebuild the Fenwick tree, keeping every relative distance
+void compactTimeline(StackDistanceEngine* engine) {
+    unsigned int** live = (unsigned int**)malloc(engine->num_blocks * sizeof(unsigned int*));
+    unsigned int count = 0;
+    for (unsigned int i = 0; i <= engine->table_mask; i++) {
+        if (engine->keys[i] != STACK_EMPTY_KEY) {
+            live[count++] = &engine->last_time[i];
+        }
+    }
+    qsort(live, count, sizeof(unsigned int*), compareTimes);
+    for (unsigned int i = 0; i < count; i++) {
+        *live[i] = i;
+    }
+    free(live);
+
+    if (engine->timeline < count * 2) {
+        engine->timeline = count * 2;
+    }
+    free(engine->fenwick);
+    engine->fenwick = (unsigned int*)calloc(engine->timeline + 1, sizeof(unsigned int));
+    for (unsigned int i = 0; i < count; i++) {
+        fenwickAdd(engine->fenwick, engine->timeline, i, 1);
+    }
+    engine->now = count;
+}
+
+static inline void accessStackLevel(StackLevel* level, unsigned int block) {
+    unsigned int set = block & ((1u << level->set_bits) - 1);
+    unsigned int* stack = level->blocks + (size_t)set * MAX_ASSOCIATIVITY;
+    int depth = level->depth[set];
+    int position = 0;
+    while (position < depth && stack[position] != block) {
+        position++;
+    }
+    if (position < depth) {
+        level->hits[position]++;
+    }
+    else if (depth < MAX_ASSOCIATIVITY) {
+        level->depth[set] = (unsigned char)(depth + 1);
+    }
+    else {
+        position = MAX_ASSOCIATIVITY - 1; // the least recent block falls off
+    }
+    memmove(stack + 1, stack, position * sizeof(unsigned int));
+    stack[0] = block;
+}
+
+void stackDistanceAccess(StackDistanceEngine* engine, unsigned int address) {
+    unsigned int block = address >> engine->offset_bits;
+    engine->accesses++;
+
+    for (int l = 0; l < engine->num_levels; l++) {
+        accessStackLevel(&engine->levels[l], block);
+    }
+
+    if (engine->now == engine->timeline) {
+        compactTimeline(engine);
+    }
+    unsigned int slot = findBlockSlot(engine, block);
+    if (engine->keys[slot] == block) {
+        unsigned int last = engine->last_time[slot];
+        unsigned int distance = fenwickPrefix(engine->fenwick, engine->now) - fenwickPrefix(engine->fenwick, last + 1);
+        fenwickAdd(engine->fenwick, engine->timeline, last, -1);
+
+        // Hit in every fully associative capacity larger than the distance
+        for (int c = 0; c < STACK_NUM_CAPACITIES; c++) {
+            unsigned int capacity_blocks = (unsigned int)(MIN_CACHE_SIZE * 1024 / engine->block_size) << c;
+            if (distance < capacity_blocks) {
+                engine->fa_hits[c]++;
+                break;
+            }
+        }
+    }
+    else {
+        engine->keys[slot] = block;
+        engine->num_blocks++;
+    }
+    engine->last_time[slot] = engine->now;
+    fenwickAdd(engine->fenwick, engine->timeline, engine->now, 1);
+    engine->now++;
+
+    if (engine->num_blocks * 2 > engine->table_mask) {
+        growBlockTable(engine);
+    }
+}
+
+// The engines fed by stackDistanceBatch, one per block size
+typedef struct {
+    StackDistanceEngine* engines;
+    int num_engines;
+} StackEngineGroup;
+
+void stackDistanceBatch(void* context, TraceReference* batch, int count) {
+    StackEngineGroup* group = (StackEngineGroup*)context;
+    for (int e = 0; e < group->num_engines; e++) {
+        StackDistanceEngine* engine = &group->engines[e];
+        for (int j = 0; j < count; j++) {
+            stackDistanceAccess(engine, batch[j].address);
+            unsigned int extra = extraBlocks(&batch[j], engine->offset_bits);
+            for (unsigned int b = 1; b <= extra; b++) {
+                stackDistanceAccess(engine, ((batch[j].address >> engine->offset_bits) + b) << engine->offset_bits);
+            }
+        }
+    }
+}
+
+// Miss rate of an LRU cache of cache_size_kb with the given associativity
+double stackMissRate(StackDistanceEngine* engine, int cache_size_kb, int associativity) {
+    long long sets = (long long)cache_size_kb * 1024 / (engine->block_size * associativity);
+    int level = log2Int((unsigned int)sets) - engine->min_set_bits;
+    if (sets <= 0 || level < 0 || level >= engine->num_levels) {
+        return -1.0;
+    }
+    long long hits = 0;
+    for (int p = 0; p < associativity; p++) {
+        hits += engine->levels[level].hits[p];
+    }
+    return 100.0 - hits * 100.0 / engine->accesses;
+}
+
+double stackFullyAssociativeMissRate(StackDistanceEngine* engine, int capacity_index) {
+    long long hits = 0;
+    for (int c = 0; c <= capacity_index; c++) {
+        hits += engine->fa_hits[c];
+    }
+    return 100.0 - hits * 100.0 / engine->accesses;
+}
+
+void printMissRateCurve(StackDistanceEngine* engine) {
+    printf("\n***** LRU MISS RATE CURVE (Block Size: %d bytes) *****\n", engine->block_size);
+    printf("%8s", "SizeKB");
+    for (int a = 1; a <= MAX_ASSOCIATIVITY; a *= 2) {
+        printf(" %8d-way", a);
+    }
+    printf(" %12s\n", "Full");
+    for (int c = 0; c < STACK_NUM_CAPACITIES; c++) {
+        int cache_size_kb = MIN_CACHE_SIZE << c;
+        printf("%8d", cache_size_kb);
+        for (int a = 1; a <= MAX_ASSOCIATIVITY; a *= 2) {
+            printf(" %11.4f%%", stackMissRate(engine, cache_size_kb, a));
+        }
+        printf(" %11.4f%%\n", stackFullyAssociativeMissRate(engine, c));
+    }
+}
+
+// Parallel sweep executor. The decoder thread (the caller) appends fixed-size
+// chunks of decoded references to a shared DecodedTrace; chunks are never
+// modified once published. Each worker owns a deque of cache configurations
+// and runs one configuration at a time over every chunk in order, waiting for
+// chunks that are not decoded yet. A worker whose deque is empty steals from
+// the top of another worker's deque. A configuration only ever sees the same
+// references in the same order, so results match a serial run exactly.
+#define SWEEP_CHUNK_REFS (1 << 16)
+
+typedef struct {
+    TraceReference** chunks;
+    int* chunk_counts;
+    int num_chunks;
+    int capacity;
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    TraceReference* filling;    // chunk being filled by the decoder
+    int filling_count;
+} DecodedTrace;
+
+typedef struct {
+    int* items;
+    int top;
+    int bottom;
+    pthread_mutex_t lock;
+} ConfigDeque;
+
+typedef struct {
+    DecodedTrace* trace;
+    Cache* caches;
+    ConfigDeque* deques;
+    int num_workers;
+    int worker;
+    pthread_t thread;
+} SweepWorker;
+
+// Append a decoded chunk; the trace takes ownership of refs
+void publishDecodedChunk(DecodedTrace* trace, TraceReference* refs, int count) {
+    pthread_mutex_lock(&trace->lock);
+    if (trace->num_chunks == trace->capacity) {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 64;
+        trace->chunks = (TraceReference**)realloc(trace->chunks, trace->capacity * sizeof(TraceReference*));
+        trace->chunk_counts = (int*)realloc(trace->chunk_counts, trace->capacity * sizeof(int));
+    }
+    trace->chunks[trace->num_chunks] = refs;
+    trace->chunk_counts[trace->num_chunks] = count;
+    trace->num_chunks++;
+    pthread_cond_broadcast(&trace->ready);
+    pthread_mutex_unlock(&trace->lock);
+}
+
+// Batch consumer on the decoding thread: copy references into the chunk being
+// filled and publish it once full
+void collectDecodedBatch(void* context, TraceReference* batch, int count) {
+    DecodedTrace* trace = (DecodedTrace*)context;
+    for (int j = 0; j < count; j++) {
+        if (trace->filling == NULL) {
+            trace->filling = (TraceReference*)malloc(SWEEP_CHUNK_REFS * sizeof(TraceReference));
+            trace->filling_count = 0;
+        }
+        trace->filling[trace->filling_count++] = batch[j];
+        if (trace->filling_count == SWEEP_CHUNK_REFS) {
+            publishDecodedChunk(trace, trace->filling, trace->filling_count);
+            trace->filling = NULL;
+        }
+    }
+}
+
+// Chunk index of the decoded trace, waiting for the decoder if needed.
+// Returns NULL once the trace has no such chunk.
+TraceReference* waitDecodedChunk(DecodedTrace* trace, int index, int* count) {
+    TraceReference* chunk = NULL;
+    pthread_mutex_lock(&trace->lock);
+    while (index >= trace->num_chunks && !trace->done) {
+        pthread_cond_wait(&trace->ready, &trace->lock);
+    }
+    if (index < trace->num_chunks) {
+        chunk = trace->chunks[index];
+        *count = trace->chunk_counts[index];
+    }
+    pthread_mutex_unlock(&trace->lock);
+    return chunk;
+}
+
+// Owner end of the deque
+int popConfig(ConfigDeque* deque) {
+    int config = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        config = deque->items[--deque->bottom];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return config;
+}
+
+// Thief end of the deque
+int stealConfig(ConfigDeque* deque) {
+    int config = -1;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        config = deque->items[deque->top++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return config;
+}
+
+void* sweepWorkerMain(void* arg) {
+    SweepWorker* worker = (SweepWorker*)arg;
+    while (1) {
+        int config = popConfig(&worker->deques[worker->worker]);
+        for (int v = 1; config < 0 && v < worker->num_workers; v++) {
+            config = stealConfig(&worker->deques[(worker->worker + v) % worker->num_workers]);
+        }
+        if (config < 0) {
+            break;
+        }
+
+        Cache* cache = &worker->caches[config];
+        int count;
+        TraceReference* chunk;
+        for (int c = 0; (chunk = waitDecodedChunk(worker->trace, c, &count)) != NULL; c++) {
+            simulateCacheReferences(cache, chunk, count);
+        }
+    }
+    return NULL;
+}
+
+// Simulate every cache over the traces with num_workers threads
+void simulateTracesParallel(Cache* caches, int num_caches, int num_workers, char* trace_files[], int num_trace_files, TraceTotals* totals) {
+    DecodedTrace trace;
+    memset(&trace, 0, sizeof(trace));
+    pthread_mutex_init(&trace.lock, NULL);
+    pthread_cond_init(&trace.ready, NULL);
+
+    // Deal the configurations round-robin; stealing evens out the rest
+    ConfigDeque* deques = (ConfigDeque*)calloc(num_workers, sizeof(ConfigDeque));
+    SweepWorker* workers = (SweepWorker*)calloc(num_workers, sizeof(SweepWorker));
+    for (int w = 0; w < num_workers; w++) {
+        deques[w].items = (int*)malloc(num_caches * sizeof(int));
+        pthread_mutex_init(&deques[w].lock, NULL);
+    }
+    for (int c = 0; c < num_caches; c++) {
+        ConfigDeque* deque = &deques[c % num_workers];
+        deque->items[deque->bottom++] = c;
+    }
+    for (int w = 0; w < num_workers; w++) {
+        workers[w].trace = &trace;
+        workers[w].caches = caches;
+        workers[w].deques = deques;
+        workers[w].num_workers = num_workers;
+        workers[w].worker = w;
+        pthread_create(&workers[w].thread, NULL, sweepWorkerMain, &workers[w]);
+    }
+
+    // Decode on this thread while the workers simulate
+    replayTraces(trace_files, num_trace_files, totals, collectDecodedBatch, &trace);
+    if (trace.filling_count > 0) {
+        publishDecodedChunk(&trace, trace.filling, trace.filling_count);
+    }
+    else {
+        free(trace.filling);
+    }
+
+    pthread_mutex_lock(&trace.lock);
+    trace.done = 1;
+    pthread_cond_broadcast(&trace.ready);
+    pthread_mutex_unlock(&trace.lock);
+
+    for (int w = 0; w < num_workers; w++) {
+        pthread_join(workers[w].thread, NULL);
+        pthread_mutex_destroy(&deques[w].lock);
+        free(deques[w].items);
+    }
+    for (int c = 0; c < trace.num_chunks; c++) {
+        free(trace.chunks[c]);
+    }
+    free(trace.chunks);
+    free(trace.chunk_counts);
+    pthread_mutex_destroy(&trace.lock);
+    pthread_cond_destroy(&trace.ready);
+    free(deques);
+    free(workers);
+}
+
+// Set-sharded simulation of a single cache. Replacement state is per set, so
+// sets never interact: the decoding thread routes every reference to the
+// worker owning its set (contiguous ranges of set indexes) over a lock-free
+// single-producer single-consumer queue. Each worker simulates through a copy
+// of the Cache that shares the tag arrays but keeps its own counters; the
+// counters are summed at the end, which gives exactly the serial totals. The
+// exception is write buffer stalls: each shard drains its own buffer against
+// its own clock, like a banked buffer.
+#define SHARD_QUEUE_SIZE (1u << 16)
+#define SHARD_ITEM_WRITE 4u             // in the block offset, like the miss class
+
+typedef struct {
+    _Alignas(HOST_CACHE_LINE) atomic_size_t head; // next slot the consumer reads
+    _Alignas(HOST_CACHE_LINE) atomic_size_t tail; // next slot the producer writes
+    _Alignas(HOST_CACHE_LINE) atomic_int done;
+    unsigned int* items;
+} SpscQueue;
+
+typedef struct {
+    Cache view;
+    SpscQueue queue;
+    unsigned int* staged;       // producer-side buffer for the current batch
+    int num_staged;
+    pthread_t thread;
+} ShardWorker;
+
+typedef struct {
+    Cache* cache;
+    ShardWorker* workers;
+    int num_shards;
+} ShardGroup;
+
+// Producer side: append count items, waiting while the queue is full
+void pushShardQueue(SpscQueue* queue, const unsigned int* items, int count) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    int pushed = 0;
+    while (pushed < count) {
+        size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+        size_t space = SHARD_QUEUE_SIZE - (tail - head);
+        if (space == 0) {
+            sched_yield();
+            continue;
+        }
+        size_t n = (size_t)(count - pushed) < space ? (size_t)(count - pushed) : space;
+        for (size_t i = 0; i < n; i++) {
+            queue->items[(tail + i) & (SHARD_QUEUE_SIZE - 1)] = items[pushed + i];
+        }
+        tail += n;
+        pushed += (int)n;
+        atomic_store_explicit(&queue->tail, tail, memory_order_release);
+    }
+}
+
+void* shardWorkerMain(void* arg) {
+    ShardWorker* worker = (ShardWorker*)arg;
+    SpscQueue* queue = &worker->queue;
+    Cache* cache = &worker->view;
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    while (1) {
+        size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        if (tail == head) {
+            if (atomic_load_explicit(&queue->done, memory_order_acquire) &&
+                atomic_load_explicit(&queue->tail, memory_order_acquire) == head) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        for (; head != tail; head++) {
+            unsigned int item = queue->items[head & (SHARD_QUEUE_SIZE - 1)];
+            int hit = cache->access(cache, item & ~SHARD_ITEM_WRITE, (item & SHARD_ITEM_WRITE) != 0);
+            if (!hit && (item & 3u) != MISS_CLASS_COMPULSORY) {
+                // The view has no classifier and counted the miss as
+                // compulsory; the router classified it in program order and
+                // passed the class in the block offset bits
+                cache->compulsory_misses--;
+                if ((item & 3u) == MISS_CLASS_CAPACITY) {
+                    cache->capacity_misses++;
+                }
+                else {
+                    cache->conflict_misses++;
+                }
+            }
+        }
+        atomic_store_explicit(&queue->head, head, memory_order_release);
+    }
+    return NULL;
+}
+
+
+// Stage one block lookup for the worker owning its set
+static inline void routeShardBlock(ShardGroup* group, unsigned int address, int write) {
+    Cache* cache = group->cache;
+    unsigned int set_index = (address >> cache->offset_bits) & cache->index_mask;
+    int shard = (int)(((unsigned long long)set_index * group->num_shards) >> cache->index_bits);
+    ShardWorker* worker = &group->workers[shard];
+    unsigned int item = address & ~(SHARD_ITEM_WRITE | 3u);
+    if (cache->classifier != NULL) {
+        item |= (unsigned int)classifyReference(cache->classifier, address >> cache->offset_bits);
+    }
+    if (write) {
+        item |= SHARD_ITEM_WRITE;
+    }
+    worker->staged[worker->num_staged++] = item;
+    if (worker->num_staged == TRACE_BATCH_SIZE) {
+        // Split references can stage more lookups than the batch has references
+        pushShardQueue(&worker->queue, worker->staged, worker->num_staged);
+        worker->num_staged = 0;
+    }
+}
+
+void routeShardBatch(void* context, TraceReference* batch, int count) {
+    ShardGroup* group = (ShardGroup*)context;
+    Cache* cache = group->cache;
+    for (int j = 0; j < count; j++) {
+        int write = batch[j].kind == REF_WRITE;
+        routeShardBlock(group, batch[j].address, write);
+        unsigned int extra = extraBlocks(&batch[j], cache->offset_bits);
+        if (extra != 0) {
+            unsigned int block = batch[j].address >> cache->offset_bits;
+            cache->split_references++;
+            for (unsigned int b = 1; b <= extra; b++) {
+                routeShardBlock(group, (block + b) << cache->offset_bits, write);
+            }
+        }
+    }
+    for (int w = 0; w < group->num_shards; w++) {
+        ShardWorker* worker = &group->workers[w];
+        pushShardQueue(&worker->queue, worker->staged, worker->num_staged);
+        worker->num_staged = 0;
+    }
+}
+
+// Simulate one cache over the traces, its sets split across num_shards threads
+void simulateTracesSharded(Cache* cache, int num_shards, char* trace_files[], int num_trace_files, TraceTotals* totals) {
+    if (num_shards > cache->total_rows) {
+        num_shards = cache->total_rows;
+    }
+    ShardWorker* workers = (ShardWorker*)alignedCalloc(num_shards * sizeof(ShardWorker));
+    for (int w = 0; w < num_shards; w++) {
+        ShardWorker* worker = &workers[w];
+        worker->view = *cache;
+        clearCacheStatistics(&worker->view);
+        worker->view.classifier = NULL; // classified by the router
+        worker->queue.items = (unsigned int*)malloc(SHARD_QUEUE_SIZE * sizeof(unsigned int));
+        worker->staged = (unsigned int*)malloc(TRACE_BATCH_SIZE * sizeof(unsigned int));
+        atomic_init(&worker->queue.head, 0);
+        atomic_init(&worker->queue.tail, 0);
+        atomic_init(&worker->queue.done, 0);
+        pthread_create(&worker->thread, NULL, shardWorkerMain, worker);
+    }
+
+    ShardGroup group = { cache, workers, num_shards };
+    replayTraces(trace_files, num_trace_files, totals, routeShardBatch, &group);
+
+    for (int w = 0; w < num_shards; w++) {
+        atomic_store_explicit(&workers[w].queue.done, 1, memory_order_release);
+    }
+    for (int w = 0; w < num_shards; w++) {
+        ShardWorker* worker = &workers[w];
+        pthread_join(worker->thread, NULL);
+        drainWriteLog(&worker->view);
+        addCacheStatistics(cache, &worker->view);
+        free(worker->queue.items);
+        free(worker->staged);
+    }
+    free(workers);
+}
+
+// End-of-run values shown in the results block and in sweep rows
+typedef struct {
+    long long total_cache_accesses;
+    long long total_misses;
+    double hit_rate;
+    double miss_rate;
+    double cpi;
+    double unused_kb;
+    double waste;
+    double percentage_unused;
+    long long memory_read_bytes; // a block fetched for every miss that allocates
+    long long memory_write_bytes; // whole blocks written back, DATA_ACCESS_LENGTH per store sent on
+    double memory_bytes_per_instruction;
+    double prefetch_accuracy;   // useful / issued prefetches
+    double prefetch_coverage;   // misses removed / misses there would have been
+} CacheResults;
+
+// "Cache Calculated Values" derived from the geometry
+int cacheOverheadBytes(Cache* cache) {
+    int total_block = cache->total_rows * cache->associativity;
+    return (total_block * (cache->tag_bits + 1)) / 8;
+}
+
+double cacheCost(Cache* cache) {
+    double imp_mem_size = (cacheOverheadBytes(cache) + cache->cache_size_kb * 1024) / 1024.00;
+    return imp_mem_size * 0.15;
+}
+
+void computeCacheResults(Cache* cache, TraceTotals* totals, CacheResults* results) {
+    drainWriteLog(cache);
+    int total_block = cache->total_rows * cache->associativity;
+    int overhead = cacheOverheadBytes(cache);
+
+    // Calculate cache hit rate, miss rate, CPI, unused cache space, etc.
+    results->total_misses = cache->compulsory_misses + cache->capacity_misses + cache->conflict_misses;
+    results->total_cache_accesses = results->total_misses + cache->cache_hits;
+    results->hit_rate = results->total_cache_accesses > 0 ? ((double)cache->cache_hits * 100) / results->total_cache_accesses : 0.0;
+    results->miss_rate = results->total_cache_accesses > 0 ? 100 - results->hit_rate : 0.0;
+    // Calculate unused KB
+    results->unused_kb = ((total_block - (double)cache->compulsory_misses) * ((double)cache->block_size + overhead)) / 1024.0;
+    // Calculate waste
+    results->waste = cacheCost(cache) * results->unused_kb;
+    // Calculate percentage of unused cache space
+    results->percentage_unused = (results->unused_kb / ((double)total_block * ((double)cache->block_size + overhead) / 1024.0)) * 100.0;
+    // Calculate cpi
+    results->cpi = totals->inst_counter > 0 ? cache->cycles / totals->inst_counter : 0.0;
+    results->memory_read_bytes = (results->total_misses - cache->write_arounds) * cache->block_size;
+    results->prefetch_accuracy = 0.0;
+    results->prefetch_coverage = 0.0;
+    if (cache->prefetcher != NULL) {
+        Prefetcher* prefetcher = cache->prefetcher;
+        results->memory_read_bytes += prefetcher->issued * cache->block_size;
+        if (prefetcher->issued > 0) {
+            results->prefetch_accuracy = prefetcher->useful * 100.0 / prefetcher->issued;
+        }
+        if (prefetcher->useful + results->total_misses > 0) {
+            results->prefetch_coverage = prefetcher->useful * 100.0 / (prefetcher->useful + results->total_misses);
+        }
+    }
+    if (cache->write_back) {
+        results->memory_write_bytes = cache->writebacks * cache->block_size + cache->write_arounds * DATA_ACCESS_LENGTH;
+    }
+    else {
+        results->memory_write_bytes = totals->writes * DATA_ACCESS_LENGTH;
+    }
+    results->memory_bytes_per_instruction = totals->inst_counter > 0 ?
+        (double)(results->memory_read_bytes + results->memory_write_bytes) / totals->inst_counter : 0.0;
+}
+
+void printCacheResults(Cache* cache, TraceTotals* totals) {
+    CacheResults results;
+    computeCacheResults(cache, totals, &results);
+
+    // Print simulation results
+    printf("\n");
+    printf("***** CACHE SIMULATION RESULTS *****\n");
+    printf("Total Cache Accesses: %lld\n", results.total_cache_accesses);
+    printf("Split References: %lld (crossing a block boundary)\n", cache->split_references);
+    printf("Instruction Bytes: %lld\t SrcDst Bytes: %lld\n", totals->instruction_bytes, totals->src_dst_bytes);
+    printf("Cache Hits: %lld\n", cache->cache_hits);
+    printf("Cache Misses: %lld\n", results.total_misses);
+    printf("--- Compulsory Misses: %lld\n", cache->compulsory_misses);
+    if (cache->classifier != NULL) {
+        printf("--- Capacity Misses: %lld\n", cache->capacity_misses);
+    }
+    printf("--- Conflict Misses: %lld\n", cache->conflict_misses);
+    printf("\n***** CACHE HIT & MISS RATE *****\n");
+    printf("Hit Rate: %.4f%%\n", results.hit_rate);
+    printf("Miss Rate: %.4f%%\n", results.miss_rate);
+    printf("CPI:\t%.2f Cycles/Instruction  (%lld)\n", results.cpi, totals->inst_counter);
+    printf("Unused Cache Space: %f%% \t Waste: $%.2f\n", results.percentage_unused, results.waste);
+    printf("Unused Cache Blocks: %lf\n", results.unused_kb);
+
+    printf("\n***** WRITE TRAFFIC *****\n");
+    printf("Writes: %lld\t Dirty Writebacks: %lld\n", totals->writes, cache->writebacks);
+    printf("Memory Read Bytes: %lld\t Memory Write Bytes: %lld\n", results.memory_read_bytes, results.memory_write_bytes);
+    printf("Memory Traffic: %.2f bytes/instruction\n", results.memory_bytes_per_instruction);
+    printf("Write Buffer: %lld merged, %lld stalls (%.0f cycles)\n", cache->write_buffer_merges, cache->write_buffer_stalls, cache->write_stall_cycles);
+
+    if (cache->prefetcher != NULL) {
+        Prefetcher* prefetcher = cache->prefetcher;
+        printf("\n***** PREFETCHER *****\n");
+        printf("Prefetcher: %s, degree %d\n", prefetcher_descriptions[prefetcher->type], prefetcher->degree);
+        printf("Prefetches Issued: %lld\t Dropped: %lld (already cached)\n", prefetcher->issued, prefetcher->redundant);
+        printf("Useful Prefetches: %lld\t Useless Prefetches: %lld\n", prefetcher->useful, prefetcher->useless);
+        printf("Accuracy: %.4f%%\n", results.prefetch_accuracy);
+        printf("Coverage: %.4f%% (misses removed)\n", results.prefetch_coverage);
+        printf("Timeliness: %.4f%% on time, %lld late (%.0f cycles waited)\n",
+               prefetcher->useful > 0 ? (prefetcher->useful - prefetcher->late) * 100.0 / prefetcher->useful : 0.0,
+               prefetcher->late, prefetcher->late_cycles);
+        printf("Pollution Misses: %lld (demand misses on blocks a prefetch evicted)\n", prefetcher->pollution_misses);
+    }
+}
+
+void printSweepHeader() {
+    printf("\n***** CACHE SWEEP RESULTS *****\n");
+    printf("%8s %6s %6s %6s %12s %12s %12s %12s %12s %12s %12s %12s %9s %9s %6s %10s %12s %14s %12s %9s %8s %8s\n",
+           "SizeKB", "Block", "Assoc", "Policy", "Accesses", "InstrBytes", "SrcDstBytes", "Hits", "Misses",
+           "Compulsory", "Capacity", "Conflict", "HitRate", "MissRate", "CPI", "Unused%", "Waste", "UnusedKB",
+           "Writebacks", "MemB/Inst", "PfAcc%", "PfCov%");
+}
+
+void printSweepRow(Cache* cache, TraceTotals* totals) {
+    CacheResults results;
+    computeCacheResults(cache, totals, &results);
+    printf("%8d %6d %6d %6s %12lld %12lld %12lld %12lld %12lld %12lld %12lld %12lld %9.4f %9.4f %6.2f %10.4f %12.2f %14.2f %12lld %9.2f %8.2f %8.2f\n",
+           cache->cache_size_kb, cache->block_size, cache->associativity, policy_names[cache->policy],
+           results.total_cache_accesses, totals->instruction_bytes, totals->src_dst_bytes, cache->cache_hits,
+           results.total_misses, cache->compulsory_misses, cache->capacity_misses, cache->conflict_misses, results.hit_rate,
+           results.miss_rate, results.cpi, results.percentage_unused, results.waste, results.unused_kb,
+           cache->writebacks, results.memory_bytes_per_instruction, results.prefetch_accuracy, results.prefetch_coverage);
+}
+
+void printSamplingResults(TraceSampler* sampler, TraceTotals* totals) {
+    printf("\n***** SAMPLING *****\n");
+    if (sampler->warmup > 0) {
+        printf("Warmup: %lld instructions excluded\n", sampler->warmup < sampler->instructions ? sampler->warmup : sampler->instructions);
+    }
+    if (sampler->unit == 0) {
+        return;
+    }
+    printf("Units: %lld of %lld instructions, one every %lld instructions\n", sampler->units, sampler->unit, sampler->period);
+    if (sampler->warming > 0) {
+        printf("Warming: %lld instructions before each unit, %lld of %lld instructions simulated\n",
+               sampler->warming, totals->inst_counter, sampler->instructions - sampler->warmup);
+    }
+    else {
+        printf("Warming: functional, every instruction between units\n");
+    }
+    if (sampler->units < 2) {
+        printf("Too few units for a confidence interval.\n");
+        return;
+    }
+    printf("%8s %6s %6s %6s %10s %9s %10s %8s %8s %8s\n",
+           "SizeKB", "Block", "Assoc", "Policy", "HitRate", "+/-95%", "FullRun", "CPI", "+/-95%", "FullRun");
+    double n = (double)sampler->units;
+    for (int c = 0; c < sampler->group->num_caches; c++) {
+        Cache* cache = &sampler->group->caches[c];
+        UnitSums* sums = &sampler->sums[c];
+        double hit_ratio = sums->hits / sums->accesses;
+        double hit_variance = (sums->hits_squared - 2.0 * hit_ratio * sums->hits_accesses +
+                               hit_ratio * hit_ratio * sums->accesses_squared) / (n - 1.0);
+        double hit_error = SAMPLE_CONFIDENCE_Z * sqrt(hit_variance > 0.0 ? hit_variance / n : 0.0) / (sums->accesses / n);
+        double cpi = sums->cycles / n;
+        double cpi_variance = (sums->cycles_squared - n * cpi * cpi) / (n - 1.0);
+        double cpi_error = SAMPLE_CONFIDENCE_Z * sqrt(cpi_variance > 0.0 ? cpi_variance / n : 0.0);
+        CacheResults results;
+        computeCacheResults(cache, totals, &results);
+        printf("%8d %6d %6d %6s %9.4f%% %8.4f%%", cache->cache_size_kb, cache->block_size, cache->associativity,
+               policy_names[cache->policy], hit_ratio * 100.0, hit_error * 100.0);
+        if (sampler->warming > 0) {
+            printf(" %10s %8.2f %8.2f %8s\n", "-", cpi, cpi_error, "-");
+        }
+        else {
+            printf(" %9.4f%% %8.2f %8.2f %8.2f\n", results.hit_rate, cpi, cpi_error, results.cpi);
+        }
+    }
+}
+
+// Cache hierarchy (-l1i, -l1d, -l2, -l3): split or unified L1 in front of
+// optional unified L2 and L3 levels. Instruction fetches go to L1I when it is
+// configured, everything else (and fetches without an L1I) to L1D.
+//  - nine: a miss fills every level it missed in, each level evicts on its own
+//  - inclusive: as nine, and a block evicted from L2 or L3 is also removed
+//    from the levels above it, so every upper level is a subset of the ones
+//    below
+//  - exclusive: misses fill only L1; L2 and L3 hold the victims of the level
+//    above, and a block found in L2 or L3 moves up to L1
+// Every instruction takes HIERARCHY_EXECUTION_CYCLES plus the latency of each
+// level its references look up, plus the memory latency when all of them miss.
+#define LEVEL_L1I 0
+#define LEVEL_L1D 1
+#define LEVEL_L2 2
+#define LEVEL_L3 3
+#define NUM_LEVELS 4
+
+#define INCLUSION_NINE 0
+#define INCLUSION_INCLUSIVE 1
+#define INCLUSION_EXCLUSIVE 2
+
+#define HIERARCHY_EXECUTION_CYCLES 2
+#define DEFAULT_MEMORY_LATENCY 100
+
+const char* level_names[] = { "L1I", "L1D", "L2", "L3" };
+const char* level_options[] = { "-l1i", "-l1d", "-l2", "-l3" };
+const int default_level_latencies[] = { 1, 1, 10, 40 };
+const char* inclusion_names[] = { "nine", "inclusive", "exclusive" };
 
 typedef struct {
-    int valid;
-    unsigned int tag;
-} CacheEntry;
+    int present;
+    Cache cache;
+    int latency;
+
+    // Statistics
+    long long accesses;
+    long long hits;
+    long long misses;
+    long long evictions;
+    long long back_invalidations;
+} CacheLevel;
+
+typedef struct {
+    CacheLevel levels[NUM_LEVELS];
+    int inclusion;
+    int memory_latency;
+    long long memory_accesses;
+    double cycles;
+} CacheHierarchy;
+
+// Parse "<size KB>:<block size>:<associativity>:<policy>[:<latency>]" into
+// the given level
+int parseLevelSpec(const char* arg, CacheLevel* level, int default_latency) {
+    int cache_size_kb;
+    int block_size;
+    int associativity;
+    int latency = default_latency;
+    char policy_name[16];
+    char extra;
+    int consumed = 0;
+    if (sscanf(arg, "%d:%d:%d:%15[a-zA-Z]%n", &cache_size_kb, &block_size, &associativity, policy_name, &consumed) != 4) {
+        return 0;
+    }
+    // Either nothing or exactly one ":latency" may follow the policy
+    if (arg[consumed] != '\0' && sscanf(arg + consumed, ":%d%c", &latency, &extra) != 1) {
+        return 0;
+    }
+    int policy = parsePolicy(policy_name);
+    if (cache_size_kb < MIN_CACHE_SIZE || cache_size_kb > MAX_CACHE_SIZE ||
+        block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+        associativity < MIN_ASSOCIATIVITY || associativity > MAX_ASSOCIATIVITY ||
+        policy < 0 || latency < 0 ||
+        !validCacheGeometry(cache_size_kb, block_size, associativity) ||
+        (policy == POLICY_PLRU && log2Int(associativity) < 0)) {
+        return 0;
+    }
+    if (level->present) {
+        freeCache(&level->cache);
+    }
+    if (!createCache(&level->cache, cache_size_kb, block_size, associativity, policy)) {
+        return 0;
+    }
+    level->present = 1;
+    level->latency = latency;
+    return 1;
+}
+
+// Check the level combination; returns an error message or NULL
+const char* checkHierarchy(CacheHierarchy* hierarchy) {
+    CacheLevel* levels = hierarchy->levels;
+    if (!levels[LEVEL_L1D].present) {
+        return "A cache hierarchy needs at least -l1d.";
+    }
+    if (levels[LEVEL_L3].present && !levels[LEVEL_L2].present) {
+        return "-l3 needs -l2.";
+    }
+    for (int l = LEVEL_L2; l < NUM_LEVELS; l++) {
+        if (!levels[l].present) {
+            continue;
+        }
+        for (int upper = 0; upper < l; upper++) {
+            if (!levels[upper].present) {
+                continue;
+            }
+            int upper_block = levels[upper].cache.block_size;
+            int block = levels[l].cache.block_size;
+            if (hierarchy->inclusion == INCLUSION_EXCLUSIVE && block != upper_block) {
+                return "An exclusive hierarchy needs the same block size at every level.";
+            }
+            if (hierarchy->inclusion == INCLUSION_INCLUSIVE && block < upper_block) {
+                return "An inclusive hierarchy needs block sizes that do not shrink towards memory.";
+            }
+        }
+    }
+    return NULL;
+}
+
+void freeHierarchy(CacheHierarchy* hierarchy) {
+    for (int l = 0; l < NUM_LEVELS; l++) {
+        if (hierarchy->levels[l].present) {
+            freeCache(&hierarchy->levels[l].cache);
+            hierarchy->levels[l].present = 0;
+        }
+    }
+}
+
+// Inclusive eviction of a block from level: remove every piece of it from
+// the levels above
+void backInvalidate(CacheHierarchy* hierarchy, int level, unsigned int address) {
+    CacheLevel* lower = &hierarchy->levels[level];
+    for (int l = 0; l < level; l++) {
+        CacheLevel* upper = &hierarchy->levels[l];
+        if (!upper->present) {
+            continue;
+        }
+        for (int offset = 0; offset < lower->cache.block_size; offset += upper->cache.block_size) {
+            upper->back_invalidations += invalidateCache(&upper->cache, address + offset);
+        }
+    }
+}
+
+// First configured level below level, or NUM_LEVELS for memory
+int levelBelow(CacheHierarchy* hierarchy, int level) {
+    for (int l = level < LEVEL_L2 ? LEVEL_L2 : level + 1; l < NUM_LEVELS; l++) {
+        if (hierarchy->levels[l].present) {
+            return l;
+        }
+    }
+    return NUM_LEVELS;
+}
+
+// Insert a block into level, passing the displaced block on as the inclusion
+// policy requires
+void fillLevel(CacheHierarchy* hierarchy, int level, unsigned int address) {
+    unsigned int evicted;
+    CacheLevel* target = &hierarchy->levels[level];
+    if (!fillCache(&target->cache, address, &evicted)) {
+        return;
+    }
+    target->evictions++;
+    if (hierarchy->inclusion == INCLUSION_INCLUSIVE && level >= LEVEL_L2) {
+        backInvalidate(hierarchy, level, evicted);
+    }
+    else if (hierarchy->inclusion == INCLUSION_EXCLUSIVE) {
+        // Split L1s can both hold a block that is fetched and also read as
+        // data; it only moves down once neither of them has it
+        int sibling = level == LEVEL_L1I ? LEVEL_L1D : LEVEL_L1I;
+        if (level <= LEVEL_L1D && hierarchy->levels[sibling].present && cacheHoldsBlock(&hierarchy->levels[sibling].cache, evicted)) {
+            return;
+        }
+        int below = levelBelow(hierarchy, level);
+        if (below < NUM_LEVELS) {
+            fillLevel(hierarchy, below, evicted);
+        }
+    }
+}
+
+void accessHierarchy(CacheHierarchy* hierarchy, TraceReference* ref) {
+    CacheLevel* levels = hierarchy->levels;
+    int path[3];
+    int depth = 0;
+    path[depth++] = ref->kind == REF_INSTRUCTION && levels[LEVEL_L1I].present ? LEVEL_L1I : LEVEL_L1D;
+    for (int l = LEVEL_L2; l < NUM_LEVELS; l++) {
+        if (levels[l].present) {
+            path[depth++] = l;
+        }
+    }
+
+    // Walk down until a level hits
+    int hit_depth = depth;
+    for (int d = 0; d < depth; d++) {
+        CacheLevel* level = &levels[path[d]];
+        level->accesses++;
+        hierarchy->cycles += level->latency;
+        if (probeCache(&level->cache, ref->address)) {
+            level->hits++;
+            hit_depth = d;
+            break;
+        }
+        level->misses++;
+    }
+    if (hit_depth == depth) {
+        hierarchy->memory_accesses++;
+        hierarchy->cycles += hierarchy->memory_latency;
+    }
+    if (hit_depth == 0) {
+        return;
+    }
+
+    if (hierarchy->inclusion == INCLUSION_EXCLUSIVE) {
+        // The block moves up to L1; L1's victim goes down one level
+        if (hit_depth < depth) {
+            invalidateCache(&levels[path[hit_depth]].cache, ref->address);
+        }
+        fillLevel(hierarchy, path[0], ref->address);
+        return;
+    }
+    for (int d = hit_depth - 1; d >= 0; d--) {
+        fillLevel(hierarchy, path[d], ref->address);
+    }
+}
+
+// A reference that crosses blocks of the L1 it goes to makes one walk per
+// block
+void simulateHierarchyBatch(void* context, TraceReference* batch, int count) {
+    CacheHierarchy* hierarchy = (CacheHierarchy*)context;
+    for (int j = 0; j < count; j++) {
+        accessHierarchy(hierarchy, &batch[j]);
+        int l1 = batch[j].kind == REF_INSTRUCTION && hierarchy->levels[LEVEL_L1I].present ? LEVEL_L1I : LEVEL_L1D;
+        int offset_bits = hierarchy->levels[l1].cache.offset_bits;
+        unsigned int extra = extraBlocks(&batch[j], offset_bits);
+        for (unsigned int b = 1; b <= extra; b++) {
+            TraceReference piece = batch[j];
+            piece.address = ((batch[j].address >> offset_bits) + b) << offset_bits;
+            accessHierarchy(hierarchy, &piece);
+        }
+    }
+}
+
+void printHierarchyResults(CacheHierarchy* hierarchy, TraceTotals* totals) {
+    long long references = hierarchy->levels[LEVEL_L1I].accesses + hierarchy->levels[LEVEL_L1D].accesses;
+    printf("\n***** CACHE HIERARCHY RESULTS (%s) *****\n", inclusion_names[hierarchy->inclusion]);
+    printf("%5s %8s %6s %6s %6s %8s %12s %12s %12s %10s %10s %9s %12s %12s\n",
+           "Level", "SizeKB", "Block", "Assoc", "Policy", "Latency", "Accesses", "Hits", "Misses",
+           "LocalMiss", "GlobalMiss", "MPKI", "Evictions", "BackInval");
+    for (int l = 0; l < NUM_LEVELS; l++) {
+        CacheLevel* level = &hierarchy->levels[l];
+        if (!level->present) {
+            continue;
+        }
+        double local_miss = level->accesses > 0 ? level->misses * 100.0 / level->accesses : 0.0;
+        double global_miss = references > 0 ? level->misses * 100.0 / references : 0.0;
+        printf("%5s %8d %6d %6d %6s %8d %12lld %12lld %12lld %9.4f%% %9.4f%% %9.3f %12lld %12lld\n",
+               level_names[l], level->cache.cache_size_kb, level->cache.block_size, level->cache.associativity,
+               policy_names[level->cache.policy], level->latency, level->accesses, level->hits, level->misses,
+               local_miss, global_miss, totals->inst_counter > 0 ? level->misses * 1000.0 / totals->inst_counter : 0.0,
+               level->evictions, level->back_invalidations);
+    }
+    printf("Memory Accesses: %lld (latency %d cycles)\n", hierarchy->memory_accesses, hierarchy->memory_latency);
+    double cycles = hierarchy->cycles + (double)HIERARCHY_EXECUTION_CYCLES * totals->inst_counter;
+    printf("Average Access Time: %.2f cycles\n", references > 0 ? hierarchy->cycles / references : 0.0);
+    printf("CPI:\t%.2f Cycles/Instruction  (%lld)\n", totals->inst_counter > 0 ? cycles / totals->inst_counter : 0.0, totals->inst_counter);
+}
+
+int runHierarchy(CacheHierarchy* hierarchy, char* trace_files[], int num_trace_files) {
+    printf("Trace Files:\n");
+    for (int i = 0; i < num_trace_files; ++i) {
+        printf("%s\n", trace_files[i]);
+    }
+    printf("\n***** Cache Hierarchy *****\n\n");
+    for (int l = 0; l < NUM_LEVELS; l++) {
+        CacheLevel* level = &hierarchy->levels[l];
+        if (level->present) {
+            printf("%s: %d KB, %d byte blocks, %d-way, %s, %d cycles\n", l == LEVEL_L1D && !hierarchy->levels[LEVEL_L1I].present ? "L1" : level_names[l],
+                   level->cache.cache_size_kb, level->cache.block_size, level->cache.associativity,
+                   policy_descriptions[level->cache.policy], level->latency);
+        }
+    }
+    printf("Memory: %d cycles\n", hierarchy->memory_latency);
+    printf("Inclusion: %s\n", inclusion_names[hierarchy->inclusion]);
+
+    TraceTotals totals;
+    memset(&totals, 0, sizeof(totals));
+    initHexDigitTable();
+
+    struct timespec sim_start, sim_end;
+    clock_gettime(CLOCK_MONOTONIC, &sim_start);
+    replayTraces(trace_files, num_trace_files, &totals, simulateHierarchyBatch, hierarchy);
+    clock_gettime(CLOCK_MONOTONIC, &sim_end);
+
+    printHierarchyResults(hierarchy, &totals);
+
+    double sim_seconds = elapsedSeconds(&sim_start, &sim_end);
+    long long references = hierarchy->levels[LEVEL_L1I].accesses + hierarchy->levels[LEVEL_L1D].accesses;
+    printf("\n***** SIMULATION THROUGHPUT *****\n");
+    printf("Simulation Time: %.3f seconds\n", sim_seconds);
+    printf("Accesses / Second: %.0f\n", references / sim_seconds);
+    printf("Parse Throughput: %.1f MB/s\n", totals.trace_bytes / (1024.0 * 1024.0) / totals.parse_seconds);
+    if (totals.context_switches > 0) {
+        printf("Context Switches: %lld (every %d instructions)\n", totals.context_switches, trace_time_slice);
+    }
+    if (totals.pipelined) {
+        printStageUtilization(&totals);
+    }
+    return 0;
+}
+
+// -m scaling: simulate the cache with 1..max_threads set shards and report the
+// speedup over the serial run, checking that every run gives the same counters
+void runShardScaling(Cache* cache, int max_threads, char* trace_files[], int num_trace_files) {
+    long long serial_hits = 0;
+    long long serial_misses = 0;
+    double serial_seconds = 0.0;
+
+    printf("\n***** SET-SHARDED SCALING *****\n");
+    printf("%8s %12s %16s %10s %8s\n", "Threads", "Seconds", "Accesses/Sec", "Speedup", "Match");
+    for (int threads = 1; threads <= max_threads; threads++) {
+        TraceTotals totals;
+        memset(&totals, 0, sizeof(totals));
+        resetCache(cache);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (threads == 1) {
+            CacheGroup group = { cache, 1 };
+            replayTraces(trace_files, num_trace_files, &totals, simulateCacheBatch, &group);
+        }
+        else {
+            simulateTracesSharded(cache, threads, trace_files, num_trace_files, &totals);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = elapsedSeconds(&start, &end);
+        long long misses = cache->compulsory_misses + cache->capacity_misses + cache->conflict_misses;
+        if (threads == 1) {
+            serial_hits = cache->cache_hits;
+            serial_misses = misses;
+            serial_seconds = seconds;
+        }
+        printf("%8d %12.3f %16.0f %9.2fx %8s\n", threads, seconds, (cache->cache_hits + misses) / seconds,
+               serial_seconds / seconds, (cache->cache_hits == serial_hits && misses == serial_misses) ? "yes" : "NO");
+    }
+}
+
+// -m stack: one stack-distance engine per block size, all fed by one replay
+int runStackDistance(int* block_sizes, int num_block_sizes, char* trace_files[], int num_trace_files) {
+    StackDistanceEngine* engines = (StackDistanceEngine*)calloc(num_block_sizes, sizeof(StackDistanceEngine));
+    for (int b = 0; b < num_block_sizes; b++) {
+        if (log2Int(block_sizes[b]) < 0) {
+            printf("Invalid block size. It must be a power of two.\n");
+            return 1;
+        }
+        if (!createStackDistanceEngine(&engines[b], block_sizes[b])) {
+            printf("Unable to allocate memory for the stack distance engine.\n");
+            return 1;
+        }
+    }
+
+    TraceTotals totals;
+    memset(&totals, 0, sizeof(totals));
+    initHexDigitTable();
+
+    struct timespec sim_start, sim_end;
+    clock_gettime(CLOCK_MONOTONIC, &sim_start);
+    StackEngineGroup group = { engines, num_block_sizes };
+    replayTraces(trace_files, num_trace_files, &totals, stackDistanceBatch, &group);
+    clock_gettime(CLOCK_MONOTONIC, &sim_end);
+
+    for (int b = 0; b < num_block_sizes; b++) {
+        printMissRateCurve(&engines[b]);
+        freeStackDistanceEngine(&engines[b]);
+    }
+    free(engines);
+
+    printf("\n***** SIMULATION THROUGHPUT *****\n");
+    printf("Simulation Time: %.3f seconds\n", elapsedSeconds(&sim_start, &sim_end));
+    printf("Parse Throughput: %.1f MB/s\n", totals.trace_bytes / (1024.0 * 1024.0) / totals.parse_seconds);
+    return 0;
+}
+
+// Synthetic traces (generate) and the throughput benchmark (bench). The
+// generator is seeded, so a pattern, length and seed always give the same
+// references. Instructions cycle through a loop of SYNTHETIC_LOOP_INSTRUCTIONS
+// instructions of 2 to 7 bytes and each makes one data reference, a store one
+// time in SYNTHETIC_STORE_ODDS, at an address in a SYNTHETIC_DATA_BYTES region
+// picked by the pattern:
+//    sequential  consecutive words
+//    strided     every SYNTHETIC_STRIDE bytes
+//    random      uniformly random words
+//    pointer     a chase through SYNTHETIC_NODE_SIZE byte nodes linked in a
+//                single random cycle, so no two visits to a node are close
+//    zipf        Zipfian popularity over SYNTHETIC_ZIPF_ITEMS blocks spread
+//                across the region
+#define PATTERN_SEQUENTIAL 0
+#define PATTERN_STRIDED 1
+#define PATTERN_RANDOM 2
+#define PATTERN_POINTER 3
+#define PATTERN_ZIPF 4
+#define NUM_PATTERNS 5
+#define TRACE_FORMAT_TEXT 0
+#define TRACE_FORMAT_BINARY 1
+#define TRACE_FORMAT_DELTA 2
+#define NUM_TRACE_FORMATS 3
+#define SYNTHETIC_CODE_BASE 0x00401000u
+#define SYNTHETIC_DATA_BASE 0x10000000u
+#define SYNTHETIC_DATA_BYTES (16u << 20)
+#define SYNTHETIC_LOOP_INSTRUCTIONS 64
+#define SYNTHETIC_STORE_ODDS 4
+#define SYNTHETIC_STRIDE 256
+#define SYNTHETIC_NODE_SIZE 64
+#define SYNTHETIC_ZIPF_ITEMS (1u << 16)
+#define SYNTHETIC_ZIPF_EXPONENT 0.99
+#define SYNTHETIC_DEFAULT_SEED 1
+
+const char* pattern_names[] = { "sequential", "strided", "random", "pointer", "zipf" };
+const char* trace_format_names[] = { "text", "binary", "delta" };
+
+typedef struct {
+    int pattern;
+    unsigned long long state;   // splitmix64
+    long long instruction;
+    unsigned int node;          // pointer: the node last visited
+    unsigned int code[SYNTHETIC_LOOP_INSTRUCTIONS];
+    unsigned char code_length[SYNTHETIC_LOOP_INSTRUCTIONS];
+    unsigned int* next_node;    // pointer: the successor of every node
+    double* zipf_cdf;           // zipf: cumulative popularity by rank
+} SyntheticTrace;
+
+static inline unsigned long long nextSyntheticRandom(SyntheticTrace* trace) {
+    unsigned long long z = (trace->state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+int parsePattern(const char* name) {
+    for (int i = 0; i < NUM_PATTERNS; i++) {
+        if (strcasecmp(name, pattern_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int parseTraceFormat(const char* name) {
+    for (int i = 0; i < NUM_TRACE_FORMATS; i++) {
+        if (strcasecmp(name, trace_format_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int createSyntheticTrace(SyntheticTrace* trace, int pattern, unsigned long long seed) {
+    memset(trace, 0, sizeof(*trace));
+    trace->pattern = pattern;
+    trace->state = seed;
+    unsigned int pc = SYNTHETIC_CODE_BASE;
+    for (int i = 0; i < SYNTHETIC_LOOP_INSTRUCTIONS; i++) {
+        trace->code[i] = pc;
+        trace->code_length[i] = (unsigned char)(2 + nextSyntheticRandom(trace) % 6);
+        pc += trace->code_length[i];
+    }
+
+    if (pattern == PATTERN_POINTER) {
+        unsigned int nodes = SYNTHETIC_DATA_BYTES / SYNTHETIC_NODE_SIZE;
+        trace->next_node = (unsigned int*)malloc(nodes * sizeof(unsigned int));
+        if (trace->next_node == NULL) {
+            return 0;
+        }
+        // Sattolo's shuffle links every node into one cycle
+        for (unsigned int i = 0; i < nodes; i++) {
+            trace->next_node[i] = i;
+        }
+        for (unsigned int i = nodes - 1; i > 0; i--) {
+            unsigned int j = (unsigned int)(nextSyntheticRandom(trace) % i);
+            unsigned int swap = trace->next_node[i];
+            trace->next_node[i] = trace->next_node[j];
+            trace->next_node[j] = swap;
+        }
+    }
+    else if (pattern == PATTERN_ZIPF) {
+        trace->zipf_cdf = (double*)malloc(SYNTHETIC_ZIPF_ITEMS * sizeof(double));
+        if (trace->zipf_cdf == NULL) {
+            return 0;
+        }
+        double sum = 0.0;
+        for (unsigned int k = 0; k < SYNTHETIC_ZIPF_ITEMS; k++) {
+            sum += 1.0 / pow(k + 1.0, SYNTHETIC_ZIPF_EXPONENT);
+            trace->zipf_cdf[k] = sum;
+        }
+        for (unsigned int k = 0; k < SYNTHETIC_ZIPF_ITEMS; k++) {
+            trace->zipf_cdf[k] /= sum;
+        }
+    }
+    return 1;
+}
+
+void freeSyntheticTrace(SyntheticTrace* trace) {
+    free(trace->next_node);
+    free(trace->zipf_cdf);
+}
+
+static inline unsigned int syntheticDataAddress(SyntheticTrace* trace) {
+    unsigned long long i = (unsigned long long)trace->instruction;
+    switch (trace->pattern) {
+    case PATTERN_SEQUENTIAL:
+        return SYNTHETIC_DATA_BASE + (unsigned int)(i * DATA_ACCESS_LENGTH % SYNTHETIC_DATA_BYTES);
+    case PATTERN_STRIDED:
+        return SYNTHETIC_DATA_BASE + (unsigned int)(i * SYNTHETIC_STRIDE % SYNTHETIC_DATA_BYTES);
+    case PATTERN_RANDOM:
+        return SYNTHETIC_DATA_BASE +
+               (unsigned int)(nextSyntheticRandom(trace) % (SYNTHETIC_DATA_BYTES / DATA_ACCESS_LENGTH)) * DATA_ACCESS_LENGTH;
+    case PATTERN_POINTER:
+        trace->node = trace->next_node[trace->node];
+        return SYNTHETIC_DATA_BASE + trace->node * SYNTHETIC_NODE_SIZE;
+    default: {
+        // Invert the popularity CDF, then scatter the ranks with an odd
+        // multiplier so the popular blocks do not crowd into a few sets
+        double u = (nextSyntheticRandom(trace) >> 11) * (1.0 / 9007199254740992.0);
+        unsigned int low = 0;
+        unsigned int high = SYNTHETIC_ZIPF_ITEMS - 1;
+        while (low < high) {
+            unsigned int mid = (low + high) / 2;
+            if (trace->zipf_cdf[mid] < u) {
+                low = mid + 1;
+            }
+            else {
+                high = mid;
+            }
+        }
+        unsigned int item = (low * 2654435761u) & (SYNTHETIC_ZIPF_ITEMS - 1);
+        return SYNTHETIC_DATA_BASE + item * (SYNTHETIC_DATA_BYTES / SYNTHETIC_ZIPF_ITEMS);
+    }
+    }
+}
+
+// Fill refs with the references of up to max_refs / 2 more instructions, at
+// most *remaining. Returns the number of references.
+int generateSyntheticBatch(SyntheticTrace* trace, TraceReference* refs, int max_refs, long long* remaining) {
+    int count = 0;
+    while (count + 2 <= max_refs && *remaining > 0) {
+        int slot = (int)(trace->instruction % SYNTHETIC_LOOP_INSTRUCTIONS);
+        refs[count].kind = REF_INSTRUCTION;
+        refs[count].length = trace->code_length[slot];
+        refs[count].process = 0;
+        refs[count].address = trace->code[slot];
+        unsigned int address = syntheticDataAddress(trace);
+        refs[count + 1].kind = nextSyntheticRandom(trace) % SYNTHETIC_STORE_ODDS == 0 ? REF_WRITE : REF_READ;
+        refs[count + 1].length = DATA_ACCESS_LENGTH;
+        refs[count + 1].process = 0;
+        refs[count + 1].address = address;
+        count += 2;
+        trace->instruction++;
+        (*remaining)--;
+    }
+    return count;
+}
+
+// Write references in the text layout, one EIP line and one dstM/srcM line
+// per instruction. The instruction bytes and data values are filler derived
+// from the addresses; the parser skips them.
+long long writeTextTraceReferences(FILE* out, const TraceReference* refs, int count) {
+    long long bytes = 0;
+    int i = 0;
+    while (i < count) {
+        if (refs[i].kind == REF_INSTRUCTION) {
+            char code_bytes[3 * 64 + 1];
+            int used = 0;
+            unsigned int filler = refs[i].address * 2654435761u;
+            for (int b = 0; b < refs[i].length && b < 64; b++) {
+                used += sprintf(code_bytes + used, b == 0 ? "%02x" : " %02x", ((filler >> (8 * (b & 3))) ^ b) & 0xff);
+            }
+            bytes += fprintf(out, "EIP (%02d): %08x %-21smov eax,ecx\n", refs[i].length, refs[i].address, code_bytes);
+            i++;
+        }
+        unsigned int dst_address = 0;
+        unsigned int src_address = 0;
+        while (i < count && refs[i].kind != REF_INSTRUCTION) {
+            if (refs[i].kind == REF_WRITE) {
+                dst_address = refs[i].address;
+            }
+            else {
+                src_address = refs[i].address;
+            }
+            i++;
+        }
+        char dst[20];
+        char src[20];
+        sprintf(dst, dst_address != 0 ? "%08x %08x" : "00000000 --------", dst_address, dst_address ^ 0x5a5a5a5au);
+        sprintf(src, src_address != 0 ? "%08x %08x" : "00000000 --------", src_address, src_address ^ 0xa5a5a5a5u);
+        bytes += fprintf(out, "dstM: %s    srcM: %s\n\n", dst, src);
+    }
+    return ferror(out) ? -1 : bytes;
+}
+
+// Write references as binary records. last_address carries the delta state
+// from one call to the next.
+long long writeBinaryTraceReferences(FILE* out, TraceReference* refs, int count, int delta, unsigned int* last_address) {
+    unsigned char encoded[TRACE_BATCH_SIZE * BINARY_RECORD_MAX_SIZE];
+    long long bytes = 0;
+    for (int start = 0; start < count; start += TRACE_BATCH_SIZE) {
+        int end = start + TRACE_BATCH_SIZE < count ? start + TRACE_BATCH_SIZE : count;
+        size_t size = 0;
+        for (int i = start; i < end; i++) {
+            size += encodeTraceRecord(encoded + size, &refs[i], last_address, delta);
+        }
+        if (fwrite(encoded, 1, size, out) != size) {
+            return -1;
+        }
+        bytes += size;
+    }
+    return bytes;
+}
+
+// Write a whole synthetic trace in the given format, returns the file size or
+// -1 when the file could not be written
+long long writeSyntheticTrace(const char* path, int pattern, long long instructions, int format, unsigned long long seed) {
+    SyntheticTrace trace;
+    if (!createSyntheticTrace(&trace, pattern, seed)) {
+        freeSyntheticTrace(&trace);
+        return -1;
+    }
+    FILE* out = fopen(path, "wb");
+    if (out == NULL) {
+        freeSyntheticTrace(&trace);
+        return -1;
+    }
+
+    long long bytes = 0;
+    if (format != TRACE_FORMAT_TEXT) {
+        bytes = writeBinaryTraceHeader(out, format == TRACE_FORMAT_DELTA) ? BINARY_TRACE_HEADER_SIZE : -1;
+    }
+    TraceReference* batch = (TraceReference*)malloc(TRACE_BATCH_SIZE * sizeof(TraceReference));
+    unsigned int last_address[3] = { 0, 0, 0 };
+    long long remaining = instructions;
+    int count;
+    while (bytes >= 0 && (count = generateSyntheticBatch(&trace, batch, TRACE_BATCH_SIZE, &remaining)) > 0) {
+        long long written = format == TRACE_FORMAT_TEXT
+                                ? writeTextTraceReferences(out, batch, count)
+                                : writeBinaryTraceReferences(out, batch, count, format == TRACE_FORMAT_DELTA, last_address);
+        bytes = written < 0 ? -1 : bytes + written;
+    }
+    free(batch);
+    freeSyntheticTrace(&trace);
+    if (fclose(out) != 0) {
+        return -1;
+    }
+    return bytes;
+}
+
+// generate <pattern> <instructions> <trace file> [text|binary|delta] [seed]
+int generateTrace(int argc, char* argv[]) {
+    if (argc < 5 || argc > 7) {
+        printUsage();
+        return 1;
+    }
+    int pattern = parsePattern(argv[2]);
+    long long instructions = atoll(argv[3]);
+    int format = argc > 5 ? parseTraceFormat(argv[5]) : TRACE_FORMAT_TEXT;
+    unsigned long long seed = argc > 6 ? strtoull(argv[6], NULL, 0) : SYNTHETIC_DEFAULT_SEED;
+    if (pattern < 0) {
+        printf("Invalid pattern. It must be sequential, strided, random, pointer or zipf.\n");
+        return 1;
+    }
+    if (instructions <= 0) {
+        printf("Invalid instruction count. It must be above 0.\n");
+        return 1;
+    }
+    if (format < 0) {
+        printf("Invalid trace format. It must be text, binary or delta.\n");
+        return 1;
+    }
+
+    long long bytes = writeSyntheticTrace(argv[4], pattern, instructions, format, seed);
+    if (bytes < 0) {
+        printf("Error writing trace file %s\n", argv[4]);
+        return 1;
+    }
+    printf("Generated %s (%s, %s, seed %llu)\n", argv[4], pattern_names[pattern], trace_format_names[format], seed);
+    printf("Instructions: %lld\t Bytes: %lld\n", instructions, bytes);
+    return 0;
+}
+
+// bench [-i <instructions>] [-g <patterns>] [-s, -b, -a, -r lists] [-seed <seed>] [-simd <setting>]
+//       [-host-prefetch <references>] [-o <results csv>] [-label <name>]
+// For every pattern, generates the trace in each format into a temporary file
+// and times decoding it, then times simulateCacheReferences over the decoded
+// references for every geometry and policy. Each time is the best of
+// BENCH_REPETITIONS runs. Where the lookup uses a vector tag compare, the
+// scalar lookup is timed too and the row gives the speedup over it. Rows are appended to the results file with the label
+// (by default the build time) so runs of different builds can be compared; a
+// parse row counts decoded references as its accesses.
+#define BENCH_DEFAULT_INSTRUCTIONS 500000
+#define BENCH_REPETITIONS 3
+
+// Decode a whole trace file, returns the number of references or -1
+long long timeTraceDecoding(const char* path, TraceReference* refs, long long max_refs, double* seconds) {
+    TraceReader reader;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!openTraceReader(&reader, path)) {
+        return -1;
+    }
+    long long count = 0;
+    int decoded;
+    while ((decoded = readTraceBatch(&reader, refs + count, TRACE_BATCH_SIZE)) > 0) {
+        count += decoded;
+        if (count + TRACE_BATCH_SIZE > max_refs) {
+            break;
+        }
+    }
+    closeTraceReader(&reader);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *seconds = elapsedSeconds(&start, &end);
+    return count;
+}
+
+// Best of BENCH_REPETITIONS runs of the references through cache, from empty
+double timeCacheReferences(Cache* cache, const TraceReference* refs, long long count) {
+    double best = 0.0;
+    for (int rep = 0; rep < BENCH_REPETITIONS; rep++) {
+        struct timespec start, end;
+        resetCache(cache);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long long j = 0; j < count; j += TRACE_BATCH_SIZE) {
+            int batch = count - j < TRACE_BATCH_SIZE ? (int)(count - j) : TRACE_BATCH_SIZE;
+            simulateCacheReferences(cache, refs + j, batch);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = elapsedSeconds(&start, &end);
+        if (rep == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+    return best;
+}
+
+#define BENCH_RESULTS_HEADER "label,kind,pattern,format,cache_size_kb,block_size,associativity,policy," \
+                             "accesses,bytes,seconds,mb_per_second,accesses_per_second,ns_per_access,hit_rate,scalar_speedup\n"
+
+// Open the results CSV for appending, writing the header to a new file. An
+// existing file must have the same columns; returns NULL otherwise.
+FILE* openBenchResults(const char* path) {
+    FILE* results = fopen(path, "a+");
+    if (results == NULL) {
+        printf("Error opening results file %s\n", path);
+        return NULL;
+    }
+    fseek(results, 0, SEEK_END);
+    if (ftell(results) == 0) {
+        fputs(BENCH_RESULTS_HEADER, results);
+        return results;
+    }
+    char header[sizeof(BENCH_RESULTS_HEADER) + 1];
+    rewind(results);
+    if (fgets(header, sizeof(header), results) == NULL || strcmp(header, BENCH_RESULTS_HEADER) != 0) {
+        printf("Results file %s has different columns; give -o a new file\n", path);
+        fclose(results);
+        return NULL;
+    }
+    return results;
+}
+
+// format is the trace format of a parse row and the tag compare of a simulate row
+void writeBenchRow(FILE* results, const char* label, const char* kind, const char* pattern, const char* format,
+                   Cache* cache, long long accesses, long long bytes, double seconds, double hit_rate, double speedup) {
+    if (results == NULL) {
+        return;
+    }
+    fprintf(results, "%s,%s,%s,%s,", label, kind, pattern, format);
+    if (cache != NULL) {
+        fprintf(results, "%d,%d,%d,%s,", cache->cache_size_kb, cache->block_size, cache->associativity,
+                policy_names[cache->policy]);
+    }
+    else {
+        fprintf(results, ",,,,");
+    }
+    fprintf(results, "%lld,%lld,%.6f,", accesses, bytes, seconds);
+    if (bytes > 0) {
+        fprintf(results, "%.2f", bytes / (1024.0 * 1024.0) / seconds);
+    }
+    fprintf(results, ",%.0f,%.3f,", accesses / seconds, seconds * 1e9 / accesses);
+    if (hit_rate >= 0) {
+        fprintf(results, "%.6f", hit_rate);
+    }
+    fprintf(results, ",");
+    if (speedup >= 0) {
+        fprintf(results, "%.3f", speedup);
+    }
+    fprintf(results, "\n");
+}
+
+int runBenchmark(int argc, char* argv[]) {
+    long long instructions = BENCH_DEFAULT_INSTRUCTIONS;
+    unsigned long long seed = SYNTHETIC_DEFAULT_SEED;
+    int patterns[NUM_PATTERNS] = { PATTERN_SEQUENTIAL, PATTERN_STRIDED, PATTERN_RANDOM, PATTERN_POINTER, PATTERN_ZIPF };
+    int num_patterns = NUM_PATTERNS;
+    int cache_sizes_kb[MAX_SWEEP_VALUES] = { 16, 1024 };
+    int num_cache_sizes = 2;
+    int block_sizes[MAX_SWEEP_VALUES] = { 64 };
+    int num_block_sizes = 1;
+    int associativities[MAX_SWEEP_VALUES] = { 1, 8 };
+    int num_associativities = 2;
+    int policies[MAX_SWEEP_VALUES];
+    int num_policies = (int)(sizeof(policy_names) / sizeof(policy_names[0]));
+    for (int r = 0; r < num_policies; r++) {
+        policies[r] = r;
+    }
+    const char* results_path = NULL;
+    const char* label = __DATE__ " " __TIME__;
+
+    if (argc % 2 != 0) {
+        printUsage();
+        return 1;
+    }
+    for (int i = 2; i < argc; i += 2) {
+        if (strcmp(argv[i], "-i") == 0) {
+            instructions = atoll(argv[i + 1]);
+            if (instructions <= 0) {
+                printf("Invalid instruction count. It must be above 0.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-g") == 0) {
+            num_patterns = 0;
+            char* list = strdup(argv[i + 1]);
+            for (char* name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+                int pattern = parsePattern(name);
+                if (pattern < 0 || num_patterns >= NUM_PATTERNS) {
+                    num_patterns = -1;
+                    break;
+                }
+                patterns[num_patterns++] = pattern;
+            }
+            free(list);
+            if (num_patterns <= 0) {
+                printf("Invalid pattern. It must be sequential, strided, random, pointer or zipf.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-s") == 0) {
+            if (!parseGeometryList(argv[i], argv[i + 1], cache_sizes_kb, &num_cache_sizes)) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-b") == 0) {
+            if (!parseGeometryList(argv[i], argv[i + 1], block_sizes, &num_block_sizes)) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-a") == 0) {
+            if (!parseGeometryList(argv[i], argv[i + 1], associativities, &num_associativities)) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-r") == 0) {
+            if (!parseGeometryList(argv[i], argv[i + 1], policies, &num_policies)) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-seed") == 0) {
+            seed = strtoull(argv[i + 1], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-simd") == 0) {
+            if (!parseSimdSetting(argv[i + 1])) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-host-prefetch") == 0) {
+            if (!parseHostPrefetchDistance(argv[i + 1])) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-o") == 0) {
+            results_path = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-label") == 0) {
+            label = argv[i + 1];
+        }
+        else {
+            printUsage();
+            return 1;
+        }
+    }
 
-void printUsage() {
-    printf("Usage: ./cache_simulator -s <cache size KB> -b <block size> -a <associativity> -r <replacement policy> -p <physical memory MB> -u <percentage of phys mem used> -n <Instr / Time Slice> -f <trace file name(s)>\n");
-}
+    FILE* results = NULL;
+    if (results_path != NULL) {
+        results = openBenchResults(results_path);
+        if (results == NULL) {
+            return 1;
+        }
+    }
 
-void simulateCacheAccess(CacheEntry*** cache_sets, int total_rows, int block_size, unsigned int address, int associativity, int* cache_hits, int* compulsory_misses, double* cpi) {
-    unsigned int tag = address >> (int)log2(block_size);
-    int set_index = (address / block_size) % total_rows;
+    const char* temp_dir = getenv("TMPDIR");
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s/cache_simulator_bench_XXXXXX", temp_dir != NULL ? temp_dir : "/tmp");
+    int temp_fd = mkstemp(temp_path);
+    if (temp_fd < 0) {
+        printf("Error creating a temporary trace file in %s\n", temp_dir != NULL ? temp_dir : "/tmp");
+        return 1;
+    }
+    close(temp_fd);
 
-    // Check if the tag exists in any of the cache lines in the set
-    int hit = 0;
-    for (int i = 0; i < associativity; i++) {
-        if (cache_sets[set_index][i]->valid && cache_sets[set_index][i]->tag == tag) {
-            (*cache_hits)++;
-            (*cpi) += 1.0;
-            hit = 1;
-            break;
-        }
+    long long max_refs = 2 * instructions + TRACE_BATCH_SIZE;
+    TraceReference* refs = (TraceReference*)malloc(max_refs * sizeof(TraceReference));
+    if (refs == NULL) {
+        printf("Unable to allocate memory for %lld references.\n", max_refs);
+        unlink(temp_path);
+        return 1;
     }
 
-    if (!hit) {
-        (*compulsory_misses)++;
+    printf("***** BENCHMARK *****\n");
+    printf("Instructions per Pattern: %lld\t Seed: %llu\t Best of %d\t Label: %s\n", instructions, seed,
+           BENCH_REPETITIONS, label);
+    int status = 0;
+    for (int g = 0; g < num_patterns && status == 0; g++) {
+        const char* pattern = pattern_names[patterns[g]];
+        printf("\n%-10s  %-6s  %12s  %9s  %9s\n", "Pattern", "Format", "Bytes", "MB/s", "MRefs/s");
 
-        // Find the next cache line for replacement (round-robin)
-        int next_line = (*compulsory_misses) % associativity;
+        // Decode every format; the references of the last one are simulated,
+        // and all formats decode to the same references
+        long long count = 0;
+        for (int format = 0; format < NUM_TRACE_FORMATS && status == 0; format++) {
+            long long bytes = writeSyntheticTrace(temp_path, patterns[g], instructions, format, seed);
+            if (bytes < 0) {
+                printf("Error writing trace file %s\n", temp_path);
+                status = 1;
+                break;
+            }
+            double best = 0.0;
+            for (int rep = 0; rep < BENCH_REPETITIONS; rep++) {
+                double seconds;
+                count = timeTraceDecoding(temp_path, refs, max_refs, &seconds);
+                if (count < 0) {
+                    printf("Error opening trace file %s\n", temp_path);
+                    status = 1;
+                    break;
+                }
+                if (rep == 0 || seconds < best) {
+                    best = seconds;
+                }
+            }
+            if (status != 0) {
+                break;
+            }
+            printf("%-10s  %-6s  %12lld  %9.1f  %9.1f\n", pattern, trace_format_names[format], bytes,
+                   bytes / (1024.0 * 1024.0) / best, count / best / 1e6);
+            writeBenchRow(results, label, "parse", pattern, trace_format_names[format], NULL, count, bytes, best, -1.0, -1.0);
+        }
+        if (status != 0) {
+            break;
+        }
 
-        // Update the cache entry with the new tag
-        cache_sets[set_index][next_line]->valid = 1;
-        cache_sets[set_index][next_line]->tag = tag;
+        printf("\n%-10s  %8s  %5s  %5s  %-6s  %12s  %8s  %9s  %9s  %-6s  %8s\n", "Pattern", "Size KB", "Block", "Assoc",
+               "Policy", "Accesses", "Hit %", "MAcc/s", "ns/Access", "Lookup", "Speedup");
+        for (int s = 0; s < num_cache_sizes && status == 0; s++) {
+            for (int b = 0; b < num_block_sizes && status == 0; b++) {
+                for (int a = 0; a < num_associativities && status == 0; a++) {
+                    for (int r = 0; r < num_policies; r++) {
+                        if (!validCacheGeometry(cache_sizes_kb[s], block_sizes[b], associativities[a]) ||
+                            (policies[r] == POLICY_PLRU && log2Int(associativities[a]) < 0)) {
+                            continue;
+                        }
+                        Cache cache;
+                        if (!createCache(&cache, cache_sizes_kb[s], block_sizes[b], associativities[a], policies[r])) {
+                            printf("Unable to allocate memory for the cache.\n");
+                            status = 1;
+                            break;
+                        }
+                        // With a vector tag compare, time the scalar lookup as well
+                        int tag_match = cacheTagMatch(&cache, preferred_tag_match);
+                        double scalar_seconds = 0.0;
+                        if (tag_match != TAG_MATCH_SCALAR) {
+                            CacheAccessFunction access = cache.access;
+                            cache.access = selectCacheAccessWith(&cache, TAG_MATCH_SCALAR);
+                            scalar_seconds = timeCacheReferences(&cache, refs, count);
+                            cache.access = access;
+                        }
+                        double best = timeCacheReferences(&cache, refs, count);
+                        long long accesses = cacheAccesses(&cache);
+                        double hit_rate = accesses > 0 ? (double)cache.cache_hits / accesses : 0.0;
+                        double speedup = tag_match != TAG_MATCH_SCALAR ? scalar_seconds / best : 1.0;
+                        printf("%-10s  %8d  %5d  %5d  %-6s  %12lld  %8.2f  %9.1f  %9.2f  %-6s  %7.2fx\n", pattern,
+                               cache.cache_size_kb, cache.block_size, cache.associativity, policy_names[cache.policy],
+                               accesses, hit_rate * 100.0, accesses / best / 1e6, best * 1e9 / accesses,
+                               tag_match_names[tag_match], speedup);
+                        writeBenchRow(results, label, "simulate", pattern, tag_match_names[tag_match], &cache, accesses, 0,
+                                      best, hit_rate, speedup);
+                        freeCache(&cache);
+                    }
+                }
+            }
+        }
+    }
 
-        // Calculate CPI
-        int cache_access_cycles = 1;
-        int cache_miss_cycles = 4;
-        int instruction_execution_cycles = 2;
-        (*cpi) += (cache_access_cycles + cache_miss_cycles + instruction_execution_cycles);
+    if (results != NULL) {
+        fclose(results);
+        if (status == 0) {
+            printf("\nResults appended to %s\n", results_path);
+        }
     }
+    free(refs);
+    unlink(temp_path);
+    return status;
 }
 
-
 int main(int argc, char* argv[]) {
-    if (argc < 17 || argc % 2 != 1) {
+    if (argc > 1 && strcmp(argv[1], "convert") == 0) {
+        initHexDigitTable();
+        return convertTrace(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "generate") == 0) {
+        return generateTrace(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        initHexDigitTable();
+        return runBenchmark(argc, argv);
+    }
+    if (argc < 3 || argc % 2 != 1) {
         printUsage();
         return 1;
     }
 
-    FILE* file1;
-    FILE* file2;
-    FILE* file3;
-    char* trace_files[3];
+    // Every other argument can name a trace
+    char** trace_files = (char**)malloc((argc / 2) * sizeof(char*));
     int num_trace_files = 0;
-    char* fileRead[100];
 
-    int cache_size_kb = -1;
-    int block_size = -1;
-    int associativity = -1;
+    int cache_sizes_kb[MAX_SWEEP_VALUES];
+    int block_sizes[MAX_SWEEP_VALUES];
+    int associativities[MAX_SWEEP_VALUES];
+    int policies[MAX_SWEEP_VALUES];
+    int num_cache_sizes = 0;
+    int num_block_sizes = 0;
+    int num_associativities = 0;
+    int num_policies = 0;
+    char* cache_size_arg = NULL;
+    char* block_size_arg = NULL;
+    char* associativity_arg = NULL;
+    char* policy_arg = NULL;
     int physical_memory_mb = -1;
     int percent_mem_used = -1;
     int instr_time_slice = -1;
-    char* replacement_policy = NULL;
-
+    int mode = MODE_SIM;
+    int num_threads = 1;
+    int classify_misses = 0;
+    int write_back = 1;
+    int write_allocate = 1;
+    int write_buffer_entries = DEFAULT_WRITE_BUFFER_ENTRIES;
+    int prefetcher = PREFETCH_NONE;
+    int prefetch_degree = 0;
+    long long warmup_instructions = 0;
+    long long sample_unit = 0;
+    long long sample_period = 0;
+    long long sample_warming = 0;
+    const char* checkpoint_path = NULL;
+    const char* restore_path = NULL;
+    long long checkpoint_interval = 0;
+    long long stats_interval = 0;
+    int stats_per_slice = 0;
+    const char* stats_path = NULL;
+    int stats_format = STATS_FORMAT_CSV;
+    int profile_host = 0;
+    int tlb_entries = DEFAULT_TLB_ENTRIES;
+    int tlb_associativity = DEFAULT_TLB_ASSOCIATIVITY;
+    CacheHierarchy hierarchy;
+    memset(&hierarchy, 0, sizeof(hierarchy));
+    hierarchy.memory_latency = DEFAULT_MEMORY_LATENCY;
+    int use_hierarchy = 0;
 
     printf("Cache Simulator - CS 3853 - Instructor Version: 2.10\n");
     printf("Trace File(s):\n");
 
     for (int i = 1; i < argc; i += 2) {
         if (strcmp(argv[i], "-s") == 0) {
-            cache_size_kb = atoi(argv[i + 1]);
-            if (cache_size_kb < MIN_CACHE_SIZE || cache_size_kb > MAX_CACHE_SIZE) {
-                printf("Invalid cache size. It must be between 8 KB and 8 MB.\n");
+            cache_size_arg = argv[i + 1];
+            if (!parseGeometryList(argv[i], cache_size_arg, cache_sizes_kb, &num_cache_sizes)) {
                 return 1;
             }
         }
         else if (strcmp(argv[i], "-b") == 0) {
-            block_size = atoi(argv[i + 1]);
-            if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE) {
-                printf("Invalid block size. It must be between 8 bytes and 64 bytes.\n");
+            block_size_arg = argv[i + 1];
+            if (!parseGeometryList(argv[i], block_size_arg, block_sizes, &num_block_sizes)) {
                 return 1;
             }
         }
         else if (strcmp(argv[i], "-a") == 0) {
-            associativity = atoi(argv[i + 1]);
-            if (associativity < MIN_ASSOCIATIVITY || associativity > MAX_ASSOCIATIVITY) {
-                printf("Invalid associativity. It must be between 1 and 16.\n");
+            associativity_arg = argv[i + 1];
+            if (!parseGeometryList(argv[i], associativity_arg, associativities, &num_associativities)) {
                 return 1;
             }
         }
         else if (strcmp(argv[i], "-r") == 0) {
-            replacement_policy = argv[i + 1];
-            if (strcmp(replacement_policy, "rr") != 0 && strcmp(replacement_policy, "rnd") != 0) {
-                printf("Invalid replacement policy. It must be rr or rnd.\n");
+            policy_arg = strdup(argv[i + 1]);
+            if (!parseGeometryList(argv[i], argv[i + 1], policies, &num_policies)) {
                 return 1;
             }
         }
@@ -127,11 +6551,239 @@ int main(int argc, char* argv[]) {
         }
         else if (strcmp(argv[i], "-n") == 0) {
             instr_time_slice = atoi(argv[i + 1]);
-            // No validation needed for this option
+            if (instr_time_slice < 0) {
+                printf("Invalid time slice. It must be 0 (traces run one after another) or more instructions.\n");
+                return 1;
+            }
+            trace_time_slice = instr_time_slice;
+        }
+        else if (strcmp(argv[i], "-t") == 0) {
+            num_threads = atoi(argv[i + 1]);
+            if (num_threads < 1) {
+                printf("Invalid number of threads. It must be at least 1.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-c") == 0) {
+            if (strcmp(argv[i + 1], "3c") == 0) {
+                classify_misses = 1;
+            }
+            else if (strcmp(argv[i + 1], "none") == 0) {
+                classify_misses = 0;
+            }
+            else {
+                printf("Invalid miss classification. It must be 3c or none.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-l1i") == 0 || strcmp(argv[i], "-l1d") == 0 ||
+                 strcmp(argv[i], "-l2") == 0 || strcmp(argv[i], "-l3") == 0) {
+            int l = 0;
+            while (strcmp(argv[i], level_options[l]) != 0) {
+                l++;
+            }
+            if (!parseLevelSpec(argv[i + 1], &hierarchy.levels[l], default_level_latencies[l])) {
+                printf("Invalid %s cache. It must be <size KB>:<block size>:<associativity>:<policy>[:<latency>].\n", level_names[l]);
+                return 1;
+            }
+            use_hierarchy = 1;
+        }
+        else if (strcmp(argv[i], "-inclusion") == 0) {
+            int inclusion = -1;
+            for (int j = 0; j < 3; j++) {
+                if (strcmp(argv[i + 1], inclusion_names[j]) == 0) {
+                    inclusion = j;
+                }
+            }
+            if (inclusion < 0) {
+                printf("Invalid inclusion policy. It must be nine, inclusive or exclusive.\n");
+                return 1;
+            }
+            hierarchy.inclusion = inclusion;
+        }
+        else if (strcmp(argv[i], "-mem") == 0) {
+            hierarchy.memory_latency = atoi(argv[i + 1]);
+            if (hierarchy.memory_latency < 0) {
+                printf("Invalid memory latency. It must not be negative.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-w") == 0) {
+            if (strcmp(argv[i + 1], "back") == 0) {
+                write_back = 1;
+            }
+            else if (strcmp(argv[i + 1], "through") == 0) {
+                write_back = 0;
+            }
+            else {
+                printf("Invalid write policy. It must be back or through.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-wa") == 0) {
+            if (strcmp(argv[i + 1], "on") == 0) {
+                write_allocate = 1;
+            }
+            else if (strcmp(argv[i + 1], "off") == 0) {
+                write_allocate = 0;
+            }
+            else {
+                printf("Invalid write allocation. It must be on or off.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-wbuf") == 0) {
+            write_buffer_entries = atoi(argv[i + 1]);
+            if (write_buffer_entries < 0 || write_buffer_entries > WRITE_BUFFER_MAX_ENTRIES) {
+                printf("Invalid write buffer. It must hold between 0 and %d entries.\n", WRITE_BUFFER_MAX_ENTRIES);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-pf") == 0) {
+            prefetcher = -1;
+            for (int j = 0; j < NUM_PREFETCHERS; j++) {
+                if (strcmp(argv[i + 1], prefetcher_names[j]) == 0) {
+                    prefetcher = j;
+                }
+            }
+            if (prefetcher < 0) {
+                printf("Invalid prefetcher. It must be none, nextline, stride or stream.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-pfd") == 0) {
+            prefetch_degree = atoi(argv[i + 1]);
+            if (prefetch_degree < 1 || prefetch_degree > MAX_PREFETCH_DEGREE) {
+                printf("Invalid prefetch degree. It must be between 1 and %d.\n", MAX_PREFETCH_DEGREE);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-warmup") == 0) {
+            char extra;
+            if (sscanf(argv[i + 1], "%lld%c", &warmup_instructions, &extra) != 1 || warmup_instructions < 0) {
+                printf("Invalid warmup. It must be a number of instructions.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-sample") == 0) {
+            char extra;
+            sample_warming = 0;
+            int fields = sscanf(argv[i + 1], "%lld:%lld:%lld%c", &sample_unit, &sample_period, &sample_warming, &extra);
+            if ((fields != 2 && fields != 3) || sample_unit < 1 || sample_warming < 0 ||
+                sample_period < sample_unit + sample_warming) {
+                printf("Invalid sampling. It must be <unit>:<period>[:<warming>] instructions with unit plus warming within the period.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-checkpoint") == 0) {
+            checkpoint_path = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-checkpoint-every") == 0) {
+            char extra;
+            if (sscanf(argv[i + 1], "%lld%c", &checkpoint_interval, &extra) != 1 || checkpoint_interval < 1) {
+                printf("Invalid checkpoint interval. It must be at least 1 instruction.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-restore") == 0) {
+            restore_path = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-interval") == 0) {
+            char extra;
+            stats_per_slice = strcmp(argv[i + 1], "slice") == 0;
+            if (!stats_per_slice && (sscanf(argv[i + 1], "%lld%c", &stats_interval, &extra) != 1 || stats_interval < 1)) {
+                printf("Invalid interval. It must be a number of instructions or slice.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-stats") == 0) {
+            stats_path = argv[i + 1];
+        }
+        else if (strcmp(argv[i], "-stats-format") == 0) {
+            if (strcmp(argv[i + 1], "csv") == 0) {
+                stats_format = STATS_FORMAT_CSV;
+            }
+            else if (strcmp(argv[i + 1], "binary") == 0) {
+                stats_format = STATS_FORMAT_BINARY;
+            }
+            else {
+                printf("Invalid statistics format. It must be csv or binary.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-simd") == 0) {
+            if (!parseSimdSetting(argv[i + 1])) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-host-prefetch") == 0) {
+            if (!parseHostPrefetchDistance(argv[i + 1])) {
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-decompress-threads") == 0) {
+            char extra;
+            if (sscanf(argv[i + 1], "%d%c", &decompress_threads, &extra) != 1 || decompress_threads < 1 ||
+                decompress_threads > MAX_DECOMPRESS_THREADS) {
+                printf("Invalid number of decompression threads. It must be between 1 and %d.\n", MAX_DECOMPRESS_THREADS);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-perf") == 0) {
+            if (strcmp(argv[i + 1], "on") == 0) {
+                profile_host = 1;
+            }
+            else if (strcmp(argv[i + 1], "off") == 0) {
+                profile_host = 0;
+            }
+            else {
+                printf("Invalid -perf setting. It must be on or off.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-tlb") == 0) {
+            char extra;
+            if (sscanf(argv[i + 1], "%d:%d%c", &tlb_entries, &tlb_associativity, &extra) != 2 ||
+                tlb_associativity < 1 || tlb_associativity > MAX_ASSOCIATIVITY ||
+                tlb_entries < tlb_associativity || tlb_entries % tlb_associativity != 0 ||
+                log2Int(tlb_entries / tlb_associativity) < 0) {
+                printf("Invalid TLB. It must be <entries>:<associativity> with up to 16 ways and a power-of-two number of sets.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-io") == 0) {
+            if (strcmp(argv[i + 1], "mmap") == 0) {
+                trace_io_mode = TRACE_IO_MMAP;
+            }
+            else if (strcmp(argv[i + 1], "pipeline") == 0) {
+                trace_io_mode = TRACE_IO_PIPELINE;
+            }
+            else {
+                printf("Invalid trace reader. It must be mmap or pipeline.\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-m") == 0) {
+            if (strcmp(argv[i + 1], "sim") == 0) {
+                mode = MODE_SIM;
+            }
+            else if (strcmp(argv[i + 1], "stack") == 0) {
+                mode = MODE_STACK;
+            }
+            else if (strcmp(argv[i + 1], "scaling") == 0) {
+                mode = MODE_SCALING;
+            }
+            else if (strcmp(argv[i + 1], "vm") == 0) {
+                mode = MODE_VM;
+            }
+            else {
+                printf("Invalid mode. It must be sim, stack, scaling or vm.\n");
+                return 1;
+            }
         }
         else if (strcmp(argv[i], "-f") == 0) {
-            if (num_trace_files >= 3) {
-                printf("Exceeded maximum number of trace files (3).\n");
+            if (num_trace_files >= MAX_TRACE_FILES) {
+                printf("Exceeded maximum number of trace files (%d).\n", MAX_TRACE_FILES);
                 return 1;
             }
             trace_files[num_trace_files++] = argv[i + 1];
@@ -142,6 +6794,133 @@ int main(int argc, char* argv[]) {
             return 1;
         }
     }
+    if (num_trace_files == 0) {
+        printUsage();
+        return 1;
+    }
+    int streamed = 0;
+    int piped = 0;
+    int from_stdin = 0;
+    for (int i = 0; i < num_trace_files; i++) {
+        int kind = traceInputKind(trace_files[i]);
+        streamed += kind != TRACE_MAPPED;
+        piped += kind == TRACE_PIPED;
+        from_stdin += strcmp(trace_files[i], "-") == 0;
+    }
+    if (streamed > 0) {
+        const char* error = NULL;
+        if (from_stdin > 1) {
+            error = "Standard input (-f -) can be given once.";
+        }
+        else if (mode == MODE_VM || (trace_time_slice > 0 && num_trace_files > 1)) {
+            error = "Compressed and piped traces are read start to end: -m vm and interleaved traces (-n) do not apply.";
+        }
+        else if (profile_host || checkpoint_path != NULL || restore_path != NULL) {
+            error = "Compressed and piped traces are decoded on the pipeline's own threads and cannot be resumed at a file offset: -perf, -checkpoint and -restore do not apply.";
+        }
+        else if (piped > 0 && mode == MODE_SCALING) {
+            error = "Scaling mode replays the traces for every thread count, so they cannot come from a pipe.";
+        }
+        if (error != NULL) {
+            printf("%s\n", error);
+            return 1;
+        }
+        // Only the pipeline streams; the mmap reader needs the raw bytes
+        trace_io_mode = TRACE_IO_PIPELINE;
+    }
+    if (use_hierarchy) {
+        const char* error = checkHierarchy(&hierarchy);
+        if (error == NULL && (mode != MODE_SIM || num_threads > 1 || classify_misses || num_cache_sizes > 0 ||
+                              !write_back || !write_allocate || write_buffer_entries != DEFAULT_WRITE_BUFFER_ENTRIES ||
+                              prefetcher != PREFETCH_NONE || prefetch_degree > 0 || warmup_instructions > 0 || sample_unit > 0 ||
+                              profile_host || checkpoint_path != NULL || restore_path != NULL || checkpoint_interval > 0 ||
+                              stats_interval > 0 || stats_per_slice || stats_path != NULL)) {
+            error = "A cache hierarchy is simulated on its own: -s, -b, -a, -r, -m, -t, -c, -w, -wa, -wbuf, -pf, -pfd, -warmup, -sample, -perf, -checkpoint, -restore, -checkpoint-every, -interval and -stats do not apply.";
+        }
+        if (error != NULL) {
+            printf("%s\n", error);
+            freeHierarchy(&hierarchy);
+            return 1;
+        }
+        int status = runHierarchy(&hierarchy, trace_files, num_trace_files);
+        freeHierarchy(&hierarchy);
+        free(trace_files);
+        return status;
+    }
+    // Stack distances depend only on the block size
+    if (num_block_sizes == 0 ||
+        (mode != MODE_STACK && (num_cache_sizes == 0 || num_associativities == 0 || num_policies == 0))) {
+        printUsage();
+        return 1;
+    }
+    int num_configs = num_cache_sizes * num_block_sizes * num_associativities * num_policies;
+    int sweep = num_configs > 1;
+    if (mode == MODE_SCALING && sweep) {
+        printf("Scaling mode simulates a single cache configuration.\n");
+        return 1;
+    }
+    if (prefetcher != PREFETCH_NONE && mode == MODE_SCALING) {
+        printf("A prefetcher fills sets other than the one referenced, so its cache cannot be split across threads.\n");
+        return 1;
+    }
+    int sampled = warmup_instructions > 0 || sample_unit > 0;
+    if (sampled && (mode == MODE_SCALING || mode == MODE_STACK || num_threads > 1)) {
+        printf("Sampling and warmup exclusion run on one thread in sim or vm mode.\n");
+        return 1;
+    }
+    if ((checkpoint_path != NULL || restore_path != NULL) &&
+        (mode != MODE_SIM || num_threads > 1 || sampled || trace_io_mode != TRACE_IO_MMAP ||
+         (trace_time_slice > 0 && num_trace_files > 1))) {
+        printf("Checkpoints are taken by the serial replay: -m, -t, -sample, -warmup, -io pipeline and interleaved traces do not apply.\n");
+        return 1;
+    }
+    if (stats_per_slice) {
+        if (instr_time_slice < 1) {
+            printf("-interval slice needs a time slice -n of at least 1 instruction.\n");
+            return 1;
+        }
+        stats_interval = instr_time_slice;
+    }
+    if ((stats_interval > 0) != (stats_path != NULL)) {
+        printf("-interval and -stats go together.\n");
+        return 1;
+    }
+    if (stats_interval > 0 && (mode == MODE_SCALING || mode == MODE_STACK || num_threads > 1 || sampled)) {
+        printf("Interval statistics are recorded by the serial sim or vm simulation, without -sample or -warmup.\n");
+        return 1;
+    }
+    if (profile_host && (mode == MODE_SCALING || mode == MODE_STACK || num_threads > 1 || trace_io_mode == TRACE_IO_PIPELINE)) {
+        printf("Host profiling follows the simulating thread: -m stack, -m scaling, -t and -io pipeline do not apply.\n");
+        return 1;
+    }
+    if (checkpoint_interval > 0 && checkpoint_path == NULL) {
+        printf("-checkpoint-every needs a -checkpoint file.\n");
+        return 1;
+    }
+    if (prefetch_degree == 0) {
+        prefetch_degree = default_prefetch_degrees[prefetcher];
+    }
+    if (mode == MODE_VM) {
+        const char* error = NULL;
+        if (sweep || num_threads > 1) {
+            error = "Virtual memory mode simulates a single cache on one thread.";
+        }
+        else if (physical_memory_mb < 0 || percent_mem_used < 0 || instr_time_slice < 1) {
+            error = "Virtual memory mode needs -p, -u and a time slice -n of at least 1 instruction.";
+        }
+        else if (physicalPages(physical_memory_mb) - systemPages(physical_memory_mb, percent_mem_used) < 1) {
+            error = "Virtual memory mode needs physical memory left for the processes (-u below 100).";
+        }
+        if (error != NULL) {
+            printf("%s\n", error);
+            return 1;
+        }
+    }
+    if (mode == MODE_STACK) {
+        int status = runStackDistance(block_sizes, num_block_sizes, trace_files, num_trace_files);
+        free(trace_files);
+        return status;
+    }
 
     printf("Cache Simulator CS 3853 Spring 2024 - Group #06\n");
     printf("Trace Files:\n");
@@ -149,35 +6928,105 @@ int main(int argc, char* argv[]) {
         printf("%s\n", trace_files[i]);
     }
     printf("\n***** Input Parameters *****\n\n");
-    printf("Cache Size: %d KB\n", cache_size_kb);
-    printf("Block Size: %d bytes\n", block_size);
-    printf("Associativity: %d\n", associativity);
-    printf("Replacement Policy: %s\n", (strcmp(replacement_policy, "rr") == 0) ? "Round Robin" : "Random");
+    if (sweep) {
+        printf("Cache Size: %s KB\n", cache_size_arg);
+        printf("Block Size: %s bytes\n", block_size_arg);
+        printf("Associativity: %s\n", associativity_arg);
+        printf("Replacement Policy: %s\n", policy_arg);
+    }
+    else {
+        printf("Cache Size: %d KB\n", cache_sizes_kb[0]);
+        printf("Block Size: %d bytes\n", block_sizes[0]);
+        printf("Associativity: %d\n", associativities[0]);
+        printf("Replacement Policy: %s\n", policy_descriptions[policies[0]]);
+    }
+    printf("Write Policy: %s, %s, %d-entry write buffer\n", write_back ? "Write-Back" : "Write-Through",
+           write_allocate ? "Write-Allocate" : "No-Write-Allocate", write_buffer_entries);
+    if (prefetcher != PREFETCH_NONE) {
+        printf("Prefetcher: %s, degree %d\n", prefetcher_descriptions[prefetcher], prefetch_degree);
+    }
     printf("Physical Memory: %d MB\n", physical_memory_mb);
     printf("Percent Memory Used by System: %d\n", percent_mem_used);
     printf("Instructions / Time Slice: %d\n", instr_time_slice);
 
-    // Cache Math and printing
-    int cache_size_b = cache_size_kb * 1024;
-    int total_rows = (cache_size_b / (block_size * associativity));
-    int total_block = cache_size_b / block_size;
-    int index_size = log2(total_rows);
-    int tag_size = 32 - (index_size + log2(block_size));
-    int overhead = (total_block * (tag_size + 1)) / 8;
-    double imp_mem_size = (overhead + cache_size_b) / 1024.00;
-    double cost = imp_mem_size * 0.15;
-
-    printf("\n***** Cache Calculated Values ****\n\n");
-    printf("Total # Blocks: %d\n", total_block);
-    printf("Tag Size: %d bits\n", tag_size);
-    printf("Index Size: %d bits\n", index_size);
-    printf("Total # Rows: %d\n", total_rows);
-    printf("Overhead Size: %d bytes\n", overhead);
-    printf("Implementation Memory Size: %.2f KB (%.0f bytes)\n", imp_mem_size, (imp_mem_size * 1024));
-    printf("Cost: $%.2f @ $0.15 / KB\n", cost);
-
-    int physical_pages = (physical_memory_mb / 4) * 1024;
-    int system_pages = physical_pages * ((double)percent_mem_used / 100);
+    // Allocate memory for every cache configuration
+    Cache* caches = (Cache*)malloc(num_configs * sizeof(Cache));
+    int num_caches = 0;
+    for (int s = 0; s < num_cache_sizes; s++) {
+        for (int b = 0; b < num_block_sizes; b++) {
+            for (int a = 0; a < num_associativities; a++) {
+                for (int r = 0; r < num_policies; r++) {
+                    if (!validCacheGeometry(cache_sizes_kb[s], block_sizes[b], associativities[a])) {
+                        if (!sweep) {
+                            printf("Invalid cache geometry. Block size and the number of rows must be powers of two.\n");
+                            return 1;
+                        }
+                        printf("Skipping %d KB / %d bytes / %d-way: the number of rows is not a power of two.\n",
+                               cache_sizes_kb[s], block_sizes[b], associativities[a]);
+                        continue;
+                    }
+                    if (policies[r] == POLICY_PLRU && log2Int(associativities[a]) < 0) {
+                        if (!sweep) {
+                            printf("Tree pseudo-LRU needs a power-of-two associativity.\n");
+                            return 1;
+                        }
+                        printf("Skipping %d KB / %d bytes / %d-way plru: the associativity is not a power of two.\n",
+                               cache_sizes_kb[s], block_sizes[b], associativities[a]);
+                        continue;
+                    }
+                    if (!createCache(&caches[num_caches], cache_sizes_kb[s], block_sizes[b], associativities[a], policies[r])) {
+                        printf("Unable to allocate memory for the cache.\n");
+                        return 1;
+                    }
+                    caches[num_caches].write_back = write_back;
+                    caches[num_caches].write_allocate = write_allocate;
+                    caches[num_caches].write_buffer.entries = write_buffer_entries;
+                    if (classify_misses && !enableMissClassification(&caches[num_caches])) {
+                        printf("Unable to allocate memory for the miss classifier.\n");
+                        return 1;
+                    }
+                    if (prefetcher != PREFETCH_NONE && !enablePrefetcher(&caches[num_caches], prefetcher, prefetch_degree)) {
+                        printf("Unable to allocate memory for the prefetcher.\n");
+                        return 1;
+                    }
+                    num_caches++;
+                }
+            }
+        }
+    }
+    if (num_caches == 0) {
+        printf("No configuration of the sweep has a valid cache geometry.\n");
+        free(caches);
+        return 1;
+    }
+    // Checked on the caches built: a sweep whose other configurations were
+    // skipped is a single cache, which -t shards
+    if (prefetcher != PREFETCH_NONE && num_caches == 1 && num_threads > 1) {
+        printf("A prefetcher fills sets other than the one referenced, so its cache cannot be split across threads.\n");
+        return 1;
+    }
+
+    if (!sweep) {
+        // Cache Math and printing
+        Cache* cache = &caches[0];
+        int cache_size_b = cache->cache_size_kb * 1024;
+        int total_block = cache->total_rows * cache->associativity;
+        int overhead = cacheOverheadBytes(cache);
+        double imp_mem_size = (overhead + cache_size_b) / 1024.00;
+        double cost = cacheCost(cache);
+
+        printf("\n***** Cache Calculated Values ****\n\n");
+        printf("Total # Blocks: %d\n", total_block);
+        printf("Tag Size: %d bits\n", cache->tag_bits);
+        printf("Index Size: %d bits\n", cache->index_bits);
+        printf("Total # Rows: %d\n", cache->total_rows);
+        printf("Overhead Size: %d bytes\n", overhead);
+        printf("Implementation Memory Size: %.2f KB (%.0f bytes)\n", imp_mem_size, (imp_mem_size * 1024));
+        printf("Cost: $%.2f @ $0.15 / KB\n", cost);
+    }
+
+    int physical_pages = physicalPages(physical_memory_mb);
+    int system_pages = systemPages(physical_memory_mb, percent_mem_used);
     int page_size = 19;
     int page_ram = system_pages * page_size;
 
@@ -187,150 +7036,166 @@ int main(int argc, char* argv[]) {
     printf("Size of Page Table Entry: %d bits\n", page_size);
     printf("Total RAM for Page Table(s): %d bytes\n", page_ram);
 
-    //Address printing
-    /*char line[MAX_LINE_LENGTH];
-    int lines_read = 0;
-    file1 = fopen(trace_files[0], "r");
-    while (fgets(line, sizeof(line), file1) != NULL && lines_read < MAX_PRINT_LINES) {
-        char lengthS[3];
-        char address[10];
-        if (line[0] == 'E')
-        {
-            lines_read++;
-            sscanf(line, "EIP (%2s): %8s", lengthS, address);
-            unsigned int hex_address;
-            sscanf(address, "%x", &hex_address);
-            int length = atoi(lengthS);
-            printf("0x%x: (%d)\n", hex_address, length);
-        }
-    }*/
-
     // Variables for cache simulation
-    int total_cache_accesses = 0;
-    int instruction_bytes = 0;
-    int src_dst_bytes = 0;
-    int cache_hits = 0;
-    int cache_misses = 0;
-    int compulsory_misses = 0;
-    int conflict_misses = 0;
-    double cpi = 0.0;
-    int bytes_accessed = 0;
-    int inst_counter = 0;
-
-    // Allocate memory for cache
-    int cache_size_bytes = cache_size_kb * 1024;
-    int num_cache_entries = cache_size_bytes / block_size;
-    CacheEntry*** cache = (CacheEntry***)malloc(total_rows * sizeof(CacheEntry**));
-    for (int i = 0; i < total_rows; i++) {
-          cache[i] = (CacheEntry**)malloc(associativity * sizeof(CacheEntry*));
-        for (int j = 0; j < associativity; j++) {
-            cache[i][j] = (CacheEntry*)malloc(sizeof(CacheEntry));
-              cache[i][j]->valid = 0;
-              cache[i][j]->tag = 0;
-        }
-    }
-
-    // Process each trace file
-    for (int i = 0; i < num_trace_files; ++i) {
-        FILE* file;
-        char line[MAX_LINE_LENGTH];
-        file = fopen(trace_files[i], "r");
-        if (file == NULL) {
-            printf("Error opening trace file %s\n", trace_files[i]);
-            continue; // Skip to the next trace file if unable to open
-        }
-
-        // Process each line of the trace file
-        while (fgets(line, sizeof(line), file) != NULL) {
-            // Parse relevant information from the line
-            if (line[0] == 'E')
-            {
-                inst_counter += 1;
-                char address[9]; // Memory address is 8 characters (hexadecimal) plus null terminator
-                int length;
-                sscanf(line, "EIP (%d): %8s", &length, address);
-
-                // Convert address string to hexadecimal integer
-                unsigned int hex_address;
-                sscanf(address, "%x", &hex_address);
-
-                // Calculate bytes accessed based on instruction length
-                 instruction_bytes += length; // Each byte is represented by two characters plus a space
-                 bytes_accessed += instruction_bytes;
-
-                // Simulate cache access and calculate CPI
-            simulateCacheAccess(cache, total_rows, block_size, hex_address, associativity, &cache_hits, &compulsory_misses, &cpi);
-            }
-            else if (line[0] == 'd') {
-                char dstM[9];
-                char srcM[9];
-                char trash[13];
-                int sLength = 4;
-                int dLength = 4;
+    TraceTotals totals;
+    memset(&totals, 0, sizeof(totals));
+    initHexDigitTable();
 
-                sscanf(line, "dstM: %9s %13s    srcM: %9s", dstM, trash, srcM);
-
-                unsigned int dHex_address;
-                sscanf(dstM, "%x", &dHex_address);
-
-                unsigned int sHex_address;
-                sscanf(srcM, "%x", &sHex_address);
-
-                if (dHex_address != 0) {
-                    src_dst_bytes += dLength;
-                    simulateCacheAccess(cache, cache_size_bytes, block_size, dHex_address, &cache_hits, &compulsory_misses, &conflict_misses, &cpi);
-                }
+    if (mode == MODE_SCALING) {
+        runShardScaling(&caches[0], num_threads, trace_files, num_trace_files);
+        freeCache(&caches[0]);
+        free(caches);
+        free(policy_arg);
+        free(trace_files);
+        return 0;
+    }
 
-                if (sHex_address != 0) {
-                    src_dst_bytes += sLength;
-                    simulateCacheAccess(cache, cache_size_bytes, block_size, dHex_address, &cache_hits, &compulsory_misses, &conflict_misses, &cpi);
-                }
+    VirtualMemory vm;
+    if (mode == MODE_VM && !createVirtualMemory(&vm, num_trace_files, physical_pages, system_pages, tlb_entries, tlb_associativity)) {
+        printf("Unable to allocate memory for the virtual memory simulation.\n");
+        return 1;
+    }
 
-                bytes_accessed += src_dst_bytes;
+    CacheGroup group = { caches, num_caches };
+    BatchConsumer consume = simulateCacheBatch;
+    void* context = &group;
+    if (mode == MODE_VM) {
+        vm.caches = &group;
+        consume = simulateVirtualBatch;
+        context = &vm;
+    }
+    TraceSampler sampler;
+    if (sampled) {
+        if (!createTraceSampler(&sampler, &group, consume, context, warmup_instructions, sample_unit, sample_period, sample_warming)) {
+            printf("Unable to allocate memory for sampling.\n");
+            return 1;
+        }
+        if (mode == MODE_VM) {
+            sampler.skip = skipVirtualBatch;
+            sampler.clear = clearVirtualMemoryStatistics;
+        }
+        consume = sampleTraceBatch;
+        context = &sampler;
+    }
+    TraceCheckpoint checkpoint;
+    if (checkpoint_path != NULL || restore_path != NULL) {
+        memset(&checkpoint, 0, sizeof(checkpoint));
+        checkpoint.path = checkpoint_path;
+        checkpoint.interval = checkpoint_interval;
+        checkpoint.group = &group;
+        checkpoint.trace_files = trace_files;
+        if (restore_path != NULL) {
+            if (!restoreCheckpoint(&checkpoint, restore_path, num_trace_files, &totals)) {
+                return 1;
             }
+            printf("\nRestored %s: %lld instructions, resuming %s at byte %zu\n", restore_path, totals.inst_counter,
+                   trace_files[checkpoint.start_trace], checkpoint.start_pos);
+        }
+        checkpoint.next_at = totals.inst_counter + checkpoint_interval;
+        trace_checkpoint = &checkpoint;
+    }
+    IntervalRecorder recorder;
+    if (stats_interval > 0) {
+        if (!createIntervalRecorder(&recorder, &group, consume, context, stats_interval, totals.inst_counter, stats_path, stats_format)) {
+            printf("Unable to start writing statistics file %s\n", stats_path);
+            return 1;
         }
+        consume = recordIntervalBatch;
+        context = &recorder;
+    }
 
-        fclose(file);
+    HostProfile profile;
+    if (profile_host) {
+        openHostProfile(&profile);
+        host_profile = &profile;
     }
 
+    struct timespec sim_start, sim_end;
+    clock_gettime(CLOCK_MONOTONIC, &sim_start);
 
-    // Calculate cache hit rate, miss rate, CPI, unused cache space, etc.
-    int total_misses = compulsory_misses + conflict_misses;
-    total_cache_accesses = total_misses + cache_hits;
-    double hit_rate = (((double)cache_hits * 100) / total_cache_accesses);
-    double miss_rate = 100 - hit_rate;
-    // Calculate unused KB
-    double unused_kb = ((total_block - (double)compulsory_misses) * ((double)block_size + overhead)) /  1024.0;
-    // Calculate waste
-    double waste = cost * unused_kb;
-    // Calculate percentage of unused cache space
-    double percentage_unused = (unused_kb / ((double)total_block * ((double)block_size + overhead) / 1024.0)) * 100.0;
+    if (mode == MODE_VM) {
+        // Always interleaved, even for one trace, so every reference is tagged
+        replayTracesInterleaved(trace_files, num_trace_files, instr_time_slice, &totals, consume, context);
+        vm.context_switches = totals.context_switches;
+    }
+    else if (num_threads > 1 && num_caches > 1) {
+        simulateTracesParallel(caches, num_caches, num_threads < num_caches ? num_threads : num_caches, trace_files, num_trace_files, &totals);
+    }
+    else if (num_threads > 1 && num_caches == 1) {
+        simulateTracesSharded(&caches[0], num_threads, trace_files, num_trace_files, &totals);
+    }
+    else {
+        replayTraces(trace_files, num_trace_files, &totals, consume, context);
+    }
+    if (profile_host) {
+        switchProfilePhase(&profile, PROFILE_STATS);
+    }
+    if (sampled) {
+        finishTraceSampler(&sampler, &totals);
+    }
+    int status = 0;
+    if (stats_interval > 0 && !finishIntervalRecorder(&recorder)) {
+        printf("Unable to write statistics file %s\n", stats_path);
+        status = 1;
+    }
 
-    //Calculate cpi
-    cpi = cpi / inst_counter;
+    clock_gettime(CLOCK_MONOTONIC, &sim_end);
+    double sim_seconds = elapsedSeconds(&sim_start, &sim_end);
 
+    long long total_cache_accesses = 0;
+    if (sweep) {
+        printSweepHeader();
+        for (int c = 0; c < num_caches; c++) {
+            printSweepRow(&caches[c], &totals);
+        }
+    }
+    else {
+        printCacheResults(&caches[0], &totals);
+    }
+    if (sampled) {
+        printSamplingResults(&sampler, &totals);
+        free(sampler.sums);
+    }
+    if (mode == MODE_VM) {
+        printVirtualMemoryResults(&vm, trace_files, instr_time_slice);
+        freeVirtualMemory(&vm);
+    }
+    for (int c = 0; c < num_caches; c++) {
+        total_cache_accesses += caches[c].cache_hits + caches[c].compulsory_misses + caches[c].capacity_misses + caches[c].conflict_misses;
+    }
+    if (profile_host) {
+        switchProfilePhase(&profile, PROFILE_IDLE);
+    }
 
-    // Print simulation results
-    printf("\n");
-    printf("***** CACHE SIMULATION RESULTS *****\n");
-    printf("Total Cache Accesses: %d\n", total_cache_accesses);
-    printf("Instruction Bytes: %d\t SrcDst Bytes: %d\n", instruction_bytes, src_dst_bytes);
-    printf("Cache Hits: %d\n", cache_hits);
-    printf("Cache Misses: %d\n", compulsory_misses + conflict_misses);
-    printf("--- Compulsory Misses: %d\n", compulsory_misses);
-    printf("--- Conflict Misses: %d\n", conflict_misses);
-    printf("\n***** CACHE HIT & MISS RATE *****\n");
-    printf("Hit Rate: %.4f%%\n", hit_rate);
-    printf("Miss Rate: %.4f%%\n", miss_rate);
-    printf("CPI:\t%.2f Cycles/Instruction  (%d)\n", cpi, inst_counter);
-    printf("Unused Cache Space: %f% \t Waste: $%.2f\n", percentage_unused, waste);
-    printf("Unused Cache Blocks: %lf", unused_kb);
+    printf("\n***** SIMULATION THROUGHPUT *****\n");
+    printf("Simulation Time: %.3f seconds\n", sim_seconds);
+    printf("Accesses / Second: %.0f\n", total_cache_accesses / sim_seconds);
+    printf("Parse Time: %.3f seconds (%lld bytes)\n", totals.parse_seconds, totals.trace_bytes);
+    printf("Parse Throughput: %.1f MB/s\n", totals.trace_bytes / (1024.0 * 1024.0) / totals.parse_seconds);
+    if (totals.context_switches > 0) {
+        printf("Context Switches: %lld (every %d instructions)\n", totals.context_switches, trace_time_slice);
+    }
+    if (totals.pipelined) {
+        printStageUtilization(&totals);
+    }
+    if (checkpoint_path != NULL) {
+        printf("Checkpoints Written: %d to %s\n", checkpoint.written, checkpoint_path);
+    }
+    if (stats_interval > 0 && status == 0) {
+        printf("Interval Statistics: %lld intervals of %lld instructions written to %s\n", recorder.intervals, stats_interval, stats_path);
+    }
+    if (profile_host) {
+        printHostProfile(&profile, total_cache_accesses);
+        closeHostProfile(&profile);
+    }
 
     // Free allocated memory
-    for (int i = 0; i < num_cache_entries; i++) {
-        free(cache[i]);
+    for (int c = 0; c < num_caches; c++) {
+        freeCache(&caches[c]);
     }
-    free(cache);
+    free(caches);
+    free(policy_arg);
+    free(trace_files);
 
-    return 0;
-}
\ No newline at end of file
+    return status;
+}